@@ -0,0 +1,72 @@
+/*
+ * ext4_shim.h - kernel definitions needed to build ext4 hot path code
+ * (fs/ext4/bitmap.c and fs/ext4/snapshot_map.h) in userspace
+ *
+ * Included with -include before the ext4 sources, which skip their
+ * kernel includes when __KERNEL__ is not defined.
+ * Define EXT4_SHIM_NO_LIST_READ to build without
+ * CONFIG_EXT4_FS_SNAPSHOT_LIST_READ.
+ */
+
+#ifndef _EXT4_SHIM_H
+#define _EXT4_SHIM_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "ext4_shim.h: ext4_find_next_zero_bit() assumes a little endian cpu"
+#endif
+
+/* snapshot configuration, as in the default Kconfig */
+#ifndef EXT4_SHIM_NO_LIST_READ
+#define CONFIG_EXT4_FS_SNAPSHOT_LIST_READ	1
+#endif
+
+typedef uint8_t __u8;
+typedef uint32_t __u32;
+typedef unsigned long long ext4_fsblk_t;
+
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+#define EXT4_NDIR_BLOCKS	12
+
+#define BITS_PER_LONG		(__SIZEOF_LONG__ * 8)
+#define hweight_long(w)		__builtin_popcountl(w)
+
+#define min(x, y) ({				\
+	typeof(x) _min1 = (x);			\
+	typeof(y) _min2 = (y);			\
+	_min1 < _min2 ? _min1 : _min2; })
+
+/* little endian find_next_zero_bit(), as ext2_find_next_zero_bit() */
+static inline int ext4_find_next_zero_bit(const void *addr, int size,
+		int offset)
+{
+	const unsigned long *p = (const unsigned long *)addr +
+		offset / BITS_PER_LONG;
+	unsigned long zeros;
+
+	if (offset >= size)
+		return size;
+	/* zero bits of the first word, from @offset on */
+	zeros = ~*p & (~0UL << (offset % BITS_PER_LONG));
+	offset -= offset % BITS_PER_LONG;
+	while (!zeros) {
+		offset += BITS_PER_LONG;
+		if (offset >= size)
+			return size;
+		zeros = ~*++p;
+	}
+	offset += __builtin_ctzl(zeros);
+	return offset < size ? offset : size;
+}
+
+/* fs/ext4/bitmap.c */
+extern void ext4_set_bits(void *bitmap, int start, int len);
+extern void ext4_clear_bits(void *bitmap, int start, int len);
+extern unsigned int ext4_count_bits(const void *bitmap, int start, int len);
+extern int ext4_count_set_run(const void *bitmap, int start, int max);
+
+#endif	/* _EXT4_SHIM_H */
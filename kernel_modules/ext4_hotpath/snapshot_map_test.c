@@ -0,0 +1,252 @@
+/*
+ * snapshot_map_test.c - test driver for fs/ext4/snapshot_map.h
+ *
+ * Checks the snapshot image block arithmetic, the COW bitmap helpers and
+ * the snapshot file access decision of ext4_snapshot_read_access()
+ * against the nested checks that ext4_snapshot_get_inode_access() used
+ * to make inline.  With -b, also times the access decision and the COW
+ * bitmap scan of ext4_snapshot_test_cow_bitmap().
+ *
+ * usage: snapshot_map_test [-b] [-n iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "snapshot_map.h"
+
+static int failed;
+static volatile long sink;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n",		\
+				__FILE__, __LINE__, #cond);		\
+			failed++;					\
+		}							\
+	} while (0)
+
+static void test_arithmetic(void)
+{
+	ext4_fsblk_t block;
+
+	CHECK(SNAPSHOT_ADDR_PER_BLOCK == 1024);
+	CHECK(SNAPSHOT_IND_PER_BLOCK_GROUP == 32);
+	CHECK(SNAPSHOT_DIND_BLOCK_GROUPS == 32);
+	CHECK(SNAPSHOT_BLOCK_OFFSET == EXT4_NDIR_BLOCKS + 1024);
+	/* a block group is mapped by 32 indirect blocks */
+	CHECK(SNAPSHOT_IND_PER_BLOCK_GROUP * SNAPSHOT_ADDR_PER_BLOCK ==
+	      SNAPSHOT_BLOCKS_PER_GROUP);
+	/* snapshot meta blocks have negative image addresses */
+	CHECK(SNAPSHOT_BLOCK(0) < 0);
+	CHECK(SNAPSHOT_BLOCK(SNAPSHOT_BLOCK_OFFSET) == 0);
+	CHECK(SNAPSHOT_ISIZE(0) ==
+	      (long long)SNAPSHOT_BLOCK_OFFSET * SNAPSHOT_BLOCK_SIZE);
+
+	for (block = 0; block < (1ULL << 32); block = block * 3 + 7) {
+		CHECK(SNAPSHOT_BLOCK(SNAPSHOT_IBLOCK(block)) ==
+		      (ext4_snapblk_t)block);
+		CHECK(SNAPSHOT_BLOCK_GROUP(block) * SNAPSHOT_BLOCKS_PER_GROUP +
+		      SNAPSHOT_BLOCK_GROUP_OFFSET(block) == block);
+		CHECK(SNAPSHOT_BLOCK_GROUP_OFFSET(block) <
+		      SNAPSHOT_BLOCKS_PER_GROUP);
+	}
+}
+
+static unsigned char cow[SNAPSHOT_BLOCK_SIZE]
+	__attribute__((aligned(sizeof(long))));
+
+static int ref_count_inuse(const void *bitmap, int bit, int maxblocks)
+{
+	const unsigned char *p = bitmap;
+	int inuse = 0;
+
+	while (inuse < maxblocks && bit + inuse < SNAPSHOT_BLOCKS_PER_GROUP &&
+	       (p[(bit + inuse) >> 3] >> ((bit + inuse) & 7)) & 1)
+		inuse++;
+	return inuse;
+}
+
+static void test_cow_bitmap(void)
+{
+	static unsigned char dst[SNAPSHOT_BLOCK_SIZE], mask[SNAPSHOT_BLOCK_SIZE]
+		__attribute__((aligned(sizeof(long))));
+	int i, bit, max;
+
+	/* every bit offset, with runs crossing byte and word boundaries */
+	for (i = 0; i < SNAPSHOT_BLOCK_SIZE; i++)
+		cow[i] = (i % 9 == 8) ? 0x7f : 0xff;
+	for (bit = 0; bit < SNAPSHOT_BLOCKS_PER_GROUP; bit++)
+		for (max = 0; max <= 130; max += 13)
+			CHECK(ext4_snapshot_count_inuse(cow, bit, max) ==
+			      ref_count_inuse(cow, bit, max));
+	/* runs up to the end of the block group */
+	memset(cow, 0xff, sizeof(cow));
+	CHECK(ext4_snapshot_count_inuse(cow, 0, SNAPSHOT_BLOCKS_PER_GROUP) ==
+	      SNAPSHOT_BLOCKS_PER_GROUP);
+	CHECK(ext4_snapshot_count_inuse(cow, SNAPSHOT_BLOCKS_PER_GROUP - 1,
+					1 << 20) == 1);
+	memset(cow, 0, sizeof(cow));
+	CHECK(ext4_snapshot_count_inuse(cow, 100, 100) == 0);
+
+	for (i = 0; i < SNAPSHOT_BLOCK_SIZE; i++) {
+		cow[i] = random();
+		mask[i] = random();
+	}
+	ext4_snapshot_mask_bitmap(dst, cow, mask);
+	for (i = 0; i < SNAPSHOT_BLOCK_SIZE; i++)
+		CHECK(dst[i] == (cow[i] & ~mask[i]));
+}
+
+/*
+ * The checks of ext4_snapshot_get_inode_access() before they were
+ * factored out, with the sampled state passed in @access.
+ */
+static enum ext4_snapshot_read ref_read_access(unsigned int access,
+		long long iblock)
+{
+	if (!(access & SNAPSHOT_ACCESS_LIST)) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
+		if (access & SNAPSHOT_ACCESS_PREV_HEAD)
+			return SNAPSHOT_READ_NORMAL;
+		return SNAPSHOT_READ_DENY;
+#else
+		return SNAPSHOT_READ_NORMAL;
+#endif
+	}
+	if (access & SNAPSHOT_ACCESS_WRITE)
+		return SNAPSHOT_READ_DENY;
+	if (iblock < SNAPSHOT_BLOCK_OFFSET)
+		return SNAPSHOT_READ_NORMAL;
+	if (access & SNAPSHOT_ACCESS_HANDLE)
+		return SNAPSHOT_READ_NORMAL;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
+	if (access & SNAPSHOT_ACCESS_ACTIVE)
+		return SNAPSHOT_READ_BDEV;
+	if (access & SNAPSHOT_ACCESS_UNLISTED)
+		return SNAPSHOT_READ_BROKEN;
+	if (access & SNAPSHOT_ACCESS_PREV_HEAD)
+		return SNAPSHOT_READ_BROKEN;
+	return SNAPSHOT_READ_PREV;
+#else
+	return (access & SNAPSHOT_ACCESS_ACTIVE) ?
+		SNAPSHOT_READ_BDEV : SNAPSHOT_READ_NORMAL;
+#endif
+}
+
+static void test_read_access(void)
+{
+	const long long iblocks[] = {
+		0, SNAPSHOT_BLOCK_OFFSET - 1, SNAPSHOT_BLOCK_OFFSET,
+		SNAPSHOT_IBLOCK(1ULL << 32),
+	};
+	unsigned int access, i;
+
+	for (access = 0; access < 0x40; access++)
+		for (i = 0; i < sizeof(iblocks) / sizeof(iblocks[0]); i++)
+			CHECK(ext4_snapshot_read_access(access, iblocks[i]) ==
+			      ref_read_access(access, iblocks[i]));
+
+	/* the common cases, spelled out */
+	CHECK(ext4_snapshot_read_access(SNAPSHOT_ACCESS_LIST |
+					SNAPSHOT_ACCESS_ACTIVE,
+					SNAPSHOT_BLOCK_OFFSET) ==
+	      SNAPSHOT_READ_BDEV);
+	CHECK(ext4_snapshot_read_access(SNAPSHOT_ACCESS_LIST |
+					SNAPSHOT_ACCESS_WRITE, 0) ==
+	      SNAPSHOT_READ_DENY);
+	CHECK(ext4_snapshot_read_access(SNAPSHOT_ACCESS_LIST |
+					SNAPSHOT_ACCESS_HANDLE,
+					SNAPSHOT_BLOCK_OFFSET) ==
+	      SNAPSHOT_READ_NORMAL);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
+	CHECK(ext4_snapshot_read_access(SNAPSHOT_ACCESS_LIST,
+					SNAPSHOT_BLOCK_OFFSET) ==
+	      SNAPSHOT_READ_PREV);
+	CHECK(ext4_snapshot_read_access(SNAPSHOT_ACCESS_PREV_HEAD, 0) ==
+	      SNAPSHOT_READ_NORMAL);
+	CHECK(ext4_snapshot_read_access(0, SNAPSHOT_BLOCK_OFFSET) ==
+	      SNAPSHOT_READ_DENY);
+#endif
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(unsigned int iters)
+{
+	unsigned int *access = malloc(iters * sizeof(*access));
+	int *bits = malloc(iters * sizeof(*bits));
+	unsigned int i;
+	double t;
+
+	if (!access || !bits)
+		exit(1);
+	for (i = 0; i < iters; i++) {
+		access[i] = random() & 0x3f;
+		bits[i] = random() % SNAPSHOT_BLOCKS_PER_GROUP;
+	}
+	/* COW bitmap of a file system that is 90% in use */
+	for (i = 0; i < SNAPSHOT_BLOCK_SIZE; i++)
+		cow[i] = random() % 10 ? 0xff : random();
+
+	printf("op,impl,ns_per_op\n");
+	t = now_ns();
+	for (i = 0; i < iters; i++)
+		sink += ref_read_access(access[i], SNAPSHOT_IBLOCK(bits[i]));
+	printf("read_access,nested,%.2f\n", (now_ns() - t) / iters);
+	t = now_ns();
+	for (i = 0; i < iters; i++)
+		sink += ext4_snapshot_read_access(access[i],
+						  SNAPSHOT_IBLOCK(bits[i]));
+	printf("read_access,ext4_snapshot_read_access,%.2f\n",
+	       (now_ns() - t) / iters);
+	t = now_ns();
+	for (i = 0; i < iters; i++)
+		sink += ref_count_inuse(cow, bits[i], 1024);
+	printf("count_inuse,bit,%.2f\n", (now_ns() - t) / iters);
+	t = now_ns();
+	for (i = 0; i < iters; i++)
+		sink += ext4_snapshot_count_inuse(cow, bits[i], 1024);
+	printf("count_inuse,ext4_snapshot_count_inuse,%.2f\n",
+	       (now_ns() - t) / iters);
+	free(access);
+	free(bits);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int iters = 1000000;
+	int c, do_bench = 0;
+
+	while ((c = getopt(argc, argv, "bn:")) != -1) {
+		switch (c) {
+		case 'b': do_bench = 1; break;
+		case 'n': iters = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: snapshot_map_test [-b] "
+				"[-n iterations]\n");
+			return 2;
+		}
+	}
+	srandom(1);
+	test_arithmetic();
+	test_cow_bitmap();
+	test_read_access();
+	if (failed) {
+		fprintf(stderr, "snapshot_map_test: %d checks failed\n",
+			failed);
+		return 1;
+	}
+	fprintf(stderr, "snapshot_map_test: all checks passed\n");
+	if (do_bench && iters)
+		bench(iters);
+	return 0;
+}
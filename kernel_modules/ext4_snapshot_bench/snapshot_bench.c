@@ -0,0 +1,639 @@
+/*
+ * snapshot_bench.c - ext4 snapshots workload benchmark
+ *
+ * Drives a loop device ext4 file system through cycles of
+ * snapshot take / file overwrite / snapshot delete and reports, per cycle
+ * and in total:
+ * - COW statistics from /proc/fs/ext4/<dev>/snapshot_stats
+ *   (copied, packed, moved and already mapped blocks)
+ * - write amplification: device KB written (lifetime_write_kbytes)
+ *   divided by KB written by the benchmark
+ * - snapshot take stall time, as seen by the caller and by the kernel
+ * - snapshot read through latency of cold 4K reads from the oldest
+ *   snapshot, as seen by the caller and by the kernel
+ * Results are printed as CSV (one row per cycle and a total row) or JSON.
+ *
+ * Requires root, a kernel with CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS and
+ * mkfs.ext4.  The snapshot file system must have 4K blocks and, because
+ * snapshot files are mapped with indirect blocks, should be created
+ * without the extent feature (see the default mkfs options below).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+#include <linux/loop.h>
+
+/* ext4 snapshot inode flags (see fs/ext4/ext4.h) */
+#define EXT4_SNAPFILE_LIST_FL		0x00000100 /* snapshot is on list (S) */
+#define EXT4_SNAPFILE_ENABLED_FL	0x00000200 /* snapshot is enabled (n) */
+#define EXT4_SNAPFILE_FL		0x01000000 /* snapshot file (x) */
+
+#define DEFAULT_MKFS_OPTS	"-b 4096 -O ^extent,^flex_bg,^huge_file,^64bit"
+#define MAX_SNAPSHOTS		64
+#define MAX_STATS		32
+#define SNAPSHOT_BLOCK_SIZE	4096
+/*
+ * The snapshot image starts after the direct blocks and the first
+ * indirect block of the snapshot file, which map snapshot meta blocks
+ * (SNAPSHOT_BLOCK_OFFSET in fs/ext4/snapshot_map.h)
+ */
+#define SNAPSHOT_BLOCK_OFFSET	(12 + SNAPSHOT_BLOCK_SIZE / 4)
+
+enum pattern { PAT_SEQ, PAT_RAND, PAT_HOT };
+static const char *pattern_names[] = { "seq", "rand", "hot" };
+
+static struct config {
+	const char *image;
+	const char *mnt;
+	const char *mkfs_opts;
+	unsigned int fs_mb;		/* file system size */
+	unsigned int file_mb;		/* overwritten file size */
+	unsigned int write_mb;		/* overwritten per cycle */
+	unsigned int io_kb;		/* overwrite request size */
+	unsigned int snapshots;		/* max. snapshots kept */
+	unsigned int cycles;
+	unsigned int reads;		/* read through samples per cycle */
+	enum pattern pattern;
+	unsigned int hot_pct;		/* hot set size in % of file */
+	unsigned int seed;
+	int json;
+	int keep;
+} cfg = {
+	.image		= "/tmp/snapshot_bench.img",
+	.mnt		= "/tmp/snapshot_bench.mnt",
+	.mkfs_opts	= DEFAULT_MKFS_OPTS,
+	.fs_mb		= 1024,
+	.file_mb	= 256,
+	.write_mb	= 64,
+	.io_kb		= 4,
+	.snapshots	= 4,
+	.cycles		= 16,
+	.reads		= 256,
+	.pattern	= PAT_RAND,
+	.hot_pct	= 10,
+	.seed		= 1,
+};
+
+/* snapshot statistics, as read from /proc/fs/ext4/<dev>/snapshot_stats */
+struct stats {
+	int num;
+	char name[MAX_STATS][32];
+	long long val[MAX_STATS];
+};
+
+struct cycle {
+	unsigned int cycle;
+	unsigned int live;		/* snapshots after the cycle */
+	long long take_usec;
+	long long delete_usec;
+	long long user_kb;		/* written by the benchmark */
+	long long dev_kb;		/* written to the device */
+	long long read_p50_usec;
+	long long read_p99_usec;
+	long long read_max_usec;
+	struct stats delta;
+};
+
+static char loop_dev[32];
+static char dev_name[16];
+static int mounted;
+
+/* @err is the errno of the failed call, captured by the caller, or 0 */
+static void die(int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "snapshot_bench: ");
+	vfprintf(stderr, fmt, ap);
+	if (err)
+		fprintf(stderr, ": %s", strerror(err));
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static long long now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void write_str(const char *path, const char *str)
+{
+	int fd = open(path, O_WRONLY);
+
+	if (fd < 0 || write(fd, str, strlen(str)) < 0)
+		die(errno, "write %s", path);
+	close(fd);
+}
+
+static void read_stats(struct stats *s)
+{
+	char path[64];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/fs/ext4/%s/snapshot_stats",
+		 dev_name);
+	f = fopen(path, "r");
+	if (!f)
+		die(errno, "open %s (CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS=n?)", path);
+	s->num = 0;
+	while (s->num < MAX_STATS &&
+	       fscanf(f, "%31s %lld", s->name[s->num], &s->val[s->num]) == 2)
+		s->num++;
+	fclose(f);
+}
+
+static int is_max_stat(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 9 && !strcmp(name + len - 9, "_max_usec");
+}
+
+/* maximums can't be diffed - report the maximum since the last reset */
+static void diff_stats(struct stats *d, const struct stats *a,
+		       const struct stats *b)
+{
+	int i;
+
+	*d = *b;
+	for (i = 0; i < b->num && i < a->num; i++)
+		if (!is_max_stat(b->name[i]))
+			d->val[i] = b->val[i] - a->val[i];
+}
+
+static long long lifetime_write_kb(void)
+{
+	char path[64];
+	long long kb = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/fs/ext4/%s/lifetime_write_kbytes",
+		 dev_name);
+	f = fopen(path, "r");
+	if (!f)
+		die(errno, "open %s", path);
+	if (fscanf(f, "%lld", &kb) != 1)
+		die(0, "parse %s", path);
+	fclose(f);
+	return kb;
+}
+
+static void drop_caches(void)
+{
+	sync();
+	write_str("/proc/sys/vm/drop_caches", "3");
+}
+
+static unsigned int get_flags(const char *path)
+{
+	unsigned int flags;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || ioctl(fd, FS_IOC_GETFLAGS, &flags))
+		die(errno, "getflags %s", path);
+	close(fd);
+	return flags;
+}
+
+static void set_flags(const char *path, unsigned int set, unsigned int clear)
+{
+	unsigned int flags;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || ioctl(fd, FS_IOC_GETFLAGS, &flags))
+		die(errno, "getflags %s", path);
+	flags = (flags | set) & ~clear;
+	if (ioctl(fd, FS_IOC_SETFLAGS, &flags))
+		die(errno, "setflags 0x%x %s", flags, path);
+	close(fd);
+}
+
+static void setup(void)
+{
+	struct loop_info64 info;
+	char cmd[512];
+	int fd, ctl, dev, nr;
+
+	fd = open(cfg.image, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || ftruncate(fd, (off_t)cfg.fs_mb << 20))
+		die(errno, "create %s", cfg.image);
+	ctl = open("/dev/loop-control", O_RDWR);
+	if (ctl < 0)
+		die(errno, "open /dev/loop-control");
+	nr = ioctl(ctl, LOOP_CTL_GET_FREE);
+	if (nr < 0)
+		die(errno, "get free loop device");
+	close(ctl);
+	snprintf(loop_dev, sizeof(loop_dev), "/dev/loop%d", nr);
+	snprintf(dev_name, sizeof(dev_name), "loop%d", nr);
+	dev = open(loop_dev, O_RDWR);
+	if (dev < 0 || ioctl(dev, LOOP_SET_FD, fd))
+		die(errno, "attach %s to %s", cfg.image, loop_dev);
+	memset(&info, 0, sizeof(info));
+	strncpy((char *)info.lo_file_name, cfg.image, LO_NAME_SIZE - 1);
+	ioctl(dev, LOOP_SET_STATUS64, &info);
+	close(dev);
+	close(fd);
+
+	snprintf(cmd, sizeof(cmd), "mkfs.ext4 -q -F %s %s >&2",
+		 cfg.mkfs_opts, loop_dev);
+	if (system(cmd))
+		die(0, "%s failed", cmd);
+	mkdir(cfg.mnt, 0755);
+	if (mount(loop_dev, cfg.mnt, "ext4", 0, "data=ordered"))
+		die(errno, "mount %s on %s", loop_dev, cfg.mnt);
+	mounted = 1;
+}
+
+static void cleanup(void)
+{
+	int dev;
+
+	if (mounted && umount(cfg.mnt))
+		perror("snapshot_bench: umount");
+	mounted = 0;
+	dev = open(loop_dev, O_RDWR);
+	if (dev >= 0) {
+		ioctl(dev, LOOP_CLR_FD, 0);
+		close(dev);
+	}
+	if (!cfg.keep)
+		unlink(cfg.image);
+}
+
+/* fill the overwritten file, so overwrites hit blocks that are in use */
+static int create_file(const char *path)
+{
+	char *buf = malloc(1 << 20);
+	unsigned int i;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (!buf || fd < 0)
+		die(errno, "create %s", path);
+	for (i = 0; i < cfg.file_mb; i++) {
+		ssize_t n;
+
+		memset(buf, i, 1 << 20);
+		n = write(fd, buf, 1 << 20);
+		if (n != 1 << 20)
+			die(n < 0 ? errno : 0, "fill %s (wrote %zd)", path, n);
+	}
+	if (fsync(fd))
+		die(errno, "fsync %s", path);
+	free(buf);
+	return fd;
+}
+
+static off_t next_offset(off_t prev, off_t io_size, off_t file_size)
+{
+	off_t nr_ios = file_size / io_size;
+	off_t hot_ios = nr_ios * cfg.hot_pct / 100;
+
+	switch (cfg.pattern) {
+	case PAT_SEQ:
+		prev += io_size;
+		return prev + io_size > file_size ? 0 : prev;
+	case PAT_HOT:
+		/* 90% of requests go to the first hot_pct% of the file */
+		if (hot_ios && random() % 10)
+			return (random() % hot_ios) * io_size;
+		/* fall through */
+	case PAT_RAND:
+	default:
+		return (random() % nr_ios) * io_size;
+	}
+}
+
+/* returns KB written */
+static long long overwrite(int fd, off_t *pos)
+{
+	off_t io_size = (off_t)cfg.io_kb << 10;
+	off_t file_size = (off_t)cfg.file_mb << 20;
+	long long nr_ios = ((long long)cfg.write_mb << 20) / io_size;
+	char *buf = malloc(io_size);
+	long long i;
+
+	if (!buf)
+		die(errno, "malloc");
+	for (i = 0; i < nr_ios; i++) {
+		memset(buf, (int)random(), io_size);
+		ssize_t n = pwrite(fd, buf, io_size, *pos);
+
+		if (n != io_size)
+			die(n < 0 ? errno : 0, "overwrite at %lld (wrote %zd)",
+			    (long long)*pos, n);
+		*pos = next_offset(*pos, io_size, file_size);
+	}
+	if (fsync(fd))
+		die(errno, "fsync");
+	free(buf);
+	return nr_ios * cfg.io_kb;
+}
+
+static long long take(const char *path)
+{
+	long long start;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		die(errno, "create snapshot file %s", path);
+	close(fd);
+	if (!(get_flags(path) & EXT4_SNAPFILE_FL))
+		die(0, "%s is not a snapshot file", path);
+	start = now_usec();
+	set_flags(path, EXT4_SNAPFILE_LIST_FL, 0);
+	return now_usec() - start;
+}
+
+static long long delete(const char *path)
+{
+	long long start = now_usec();
+
+	set_flags(path, 0, EXT4_SNAPFILE_LIST_FL);
+	if (unlink(path))
+		die(errno, "unlink %s", path);
+	return now_usec() - start;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Read random blocks of the file system image through snapshot @path.
+ * Snapshot blocks that were not COWed are read through newer snapshots
+ * and eventually from the block device.  Page cache is dropped first,
+ * so every read goes through ext4_snapshot_get_block().
+ */
+static void read_through(const char *path, struct cycle *c)
+{
+	long long *lat, start;
+	off_t nr_blocks = ((off_t)cfg.fs_mb << 20) / SNAPSHOT_BLOCK_SIZE;
+	char buf[SNAPSHOT_BLOCK_SIZE];
+	unsigned int i;
+	int fd;
+
+	if (!cfg.reads)
+		return;
+	lat = calloc(cfg.reads, sizeof(*lat));
+	if (!lat)
+		die(errno, "malloc");
+	set_flags(path, EXT4_SNAPFILE_ENABLED_FL, 0);
+	drop_caches();
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die(errno, "open %s", path);
+	for (i = 0; i < cfg.reads; i++) {
+		/* image block @blk is at file block blk + SNAPSHOT_BLOCK_OFFSET */
+		off_t blk = random() % nr_blocks;
+
+		start = now_usec();
+		if (pread(fd, buf, SNAPSHOT_BLOCK_SIZE,
+			  (blk + SNAPSHOT_BLOCK_OFFSET) * SNAPSHOT_BLOCK_SIZE) < 0)
+			die(errno, "read %s block %lld", path, (long long)blk);
+		lat[i] = now_usec() - start;
+	}
+	close(fd);
+	set_flags(path, 0, EXT4_SNAPFILE_ENABLED_FL);
+
+	qsort(lat, cfg.reads, sizeof(*lat), cmp_ll);
+	c->read_p50_usec = lat[cfg.reads / 2];
+	c->read_p99_usec = lat[(cfg.reads * 99) / 100];
+	c->read_max_usec = lat[cfg.reads - 1];
+	free(lat);
+}
+
+static void print_header(const struct stats *s)
+{
+	int i;
+
+	if (cfg.json) {
+		printf("{\n  \"config\": {\"fs_mb\": %u, \"file_mb\": %u, "
+		       "\"write_mb\": %u, \"io_kb\": %u, \"snapshots\": %u, "
+		       "\"cycles\": %u, \"reads\": %u, \"pattern\": \"%s\", "
+		       "\"hot_pct\": %u, \"seed\": %u, \"mkfs\": \"%s\"},\n"
+		       "  \"cycles\": [",
+		       cfg.fs_mb, cfg.file_mb, cfg.write_mb, cfg.io_kb,
+		       cfg.snapshots, cfg.cycles, cfg.reads,
+		       pattern_names[cfg.pattern], cfg.hot_pct, cfg.seed,
+		       cfg.mkfs_opts);
+		return;
+	}
+	printf("cycle,live,take_usec,delete_usec,user_kb,dev_kb,write_amp,"
+	       "read_p50_usec,read_p99_usec,read_max_usec");
+	for (i = 0; i < s->num; i++)
+		printf(",%s", s->name[i]);
+	printf("\n");
+}
+
+static void print_cycle(const struct cycle *c, int last)
+{
+	double amp = c->user_kb ? (double)c->dev_kb / c->user_kb : 0;
+	int i;
+
+	if (cfg.json) {
+		printf("%s\n    {\"cycle\": ", c->cycle ? "," : "");
+		if (last)
+			printf("\"total\"");
+		else
+			printf("%u", c->cycle);
+		printf(", \"live\": %u, \"take_usec\": %lld, "
+		       "\"delete_usec\": %lld, \"user_kb\": %lld, "
+		       "\"dev_kb\": %lld, \"write_amp\": %.3f, "
+		       "\"read_p50_usec\": %lld, \"read_p99_usec\": %lld, "
+		       "\"read_max_usec\": %lld",
+		       c->live, c->take_usec, c->delete_usec, c->user_kb,
+		       c->dev_kb, amp, c->read_p50_usec, c->read_p99_usec,
+		       c->read_max_usec);
+		for (i = 0; i < c->delta.num; i++)
+			printf(", \"%s\": %lld", c->delta.name[i],
+			       c->delta.val[i]);
+		printf("}");
+		if (last)
+			printf("\n  ]\n}\n");
+		return;
+	}
+	if (last)
+		printf("total");
+	else
+		printf("%u", c->cycle);
+	printf(",%u,%lld,%lld,%lld,%lld,%.3f,%lld,%lld,%lld", c->live,
+	       c->take_usec, c->delete_usec, c->user_kb, c->dev_kb, amp,
+	       c->read_p50_usec, c->read_p99_usec, c->read_max_usec);
+	for (i = 0; i < c->delta.num; i++)
+		printf(",%lld", c->delta.val[i]);
+	printf("\n");
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: snapshot_bench [options]\n"
+		"  -i image     loop image file (%s)\n"
+		"  -m dir       mount point (%s)\n"
+		"  -o opts      mkfs.ext4 options (\"%s\")\n"
+		"  -s MB        file system size (%u)\n"
+		"  -f MB        overwritten file size (%u)\n"
+		"  -w MB        overwritten per cycle (%u)\n"
+		"  -b KB        overwrite request size (%u)\n"
+		"  -n N         max. snapshots kept (%u)\n"
+		"  -c N         take/overwrite/delete cycles (%u)\n"
+		"  -r N         read through samples per cycle (%u)\n"
+		"  -p pattern   overwrite pattern: seq, rand or hot (rand)\n"
+		"  -h PCT       hot set size in %% of the file (%u)\n"
+		"  -S seed      random seed (%u)\n"
+		"  -j           print JSON instead of CSV\n"
+		"  -k           keep the image file\n",
+		cfg.image, cfg.mnt, cfg.mkfs_opts, cfg.fs_mb, cfg.file_mb,
+		cfg.write_mb, cfg.io_kb, cfg.snapshots, cfg.cycles, cfg.reads,
+		cfg.hot_pct, cfg.seed);
+	exit(2);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+	int c, i;
+
+	while ((c = getopt(argc, argv, "i:m:o:s:f:w:b:n:c:r:p:h:S:jk")) != -1) {
+		switch (c) {
+		case 'i': cfg.image = optarg; break;
+		case 'm': cfg.mnt = optarg; break;
+		case 'o': cfg.mkfs_opts = optarg; break;
+		case 's': cfg.fs_mb = atoi(optarg); break;
+		case 'f': cfg.file_mb = atoi(optarg); break;
+		case 'w': cfg.write_mb = atoi(optarg); break;
+		case 'b': cfg.io_kb = atoi(optarg); break;
+		case 'n': cfg.snapshots = atoi(optarg); break;
+		case 'c': cfg.cycles = atoi(optarg); break;
+		case 'r': cfg.reads = atoi(optarg); break;
+		case 'h': cfg.hot_pct = atoi(optarg); break;
+		case 'S': cfg.seed = atoi(optarg); break;
+		case 'j': cfg.json = 1; break;
+		case 'k': cfg.keep = 1; break;
+		case 'p':
+			for (i = 0; i < 3; i++)
+				if (!strcmp(optarg, pattern_names[i]))
+					break;
+			if (i == 3)
+				usage();
+			cfg.pattern = i;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!cfg.fs_mb || !cfg.file_mb || !cfg.io_kb || cfg.hot_pct > 100 ||
+	    cfg.file_mb >= cfg.fs_mb || (cfg.io_kb << 10) % SNAPSHOT_BLOCK_SIZE ||
+	    !cfg.snapshots || cfg.snapshots > MAX_SNAPSHOTS)
+		usage();
+}
+
+int main(int argc, char *argv[])
+{
+	/* ring of snapshot file names, one more than the live snapshots */
+	char snaps[MAX_SNAPSHOTS + 1][256], file[200], dir[200];
+	char stats_path[64];
+	struct stats s0, s1, s2;
+	struct cycle c, total;
+	unsigned int i, oldest = 0, live = 0;
+	long long kb0, kb1, kb2;
+	off_t pos = 0;
+	int fd;
+
+	parse_args(argc, argv);
+	srandom(cfg.seed);
+	atexit(cleanup);
+	setup();
+
+	/* files created in a snapfile dir are snapshot files */
+	snprintf(dir, sizeof(dir), "%s/snapshots", cfg.mnt);
+	if (mkdir(dir, 0700))
+		die(errno, "mkdir %s", dir);
+	set_flags(dir, EXT4_SNAPFILE_FL, 0);
+	snprintf(file, sizeof(file), "%s/data", cfg.mnt);
+	fd = create_file(file);
+	sync();
+
+	/* reset counters before the first take */
+	snprintf(stats_path, sizeof(stats_path),
+		 "/proc/fs/ext4/%s/snapshot_stats", dev_name);
+	write_str(stats_path, "0");
+	read_stats(&s0);
+	kb0 = lifetime_write_kb();
+	print_header(&s0);
+
+	memset(&total, 0, sizeof(total));
+	s1 = s0;
+	kb1 = kb0;
+	for (i = 0; i < cfg.cycles; i++) {
+		char *snap = snaps[i % (MAX_SNAPSHOTS + 1)];
+
+		memset(&c, 0, sizeof(c));
+		c.cycle = i;
+		snprintf(snap, sizeof(snaps[0]), "%s/%u", dir, i);
+		c.take_usec = take(snap);
+		live++;
+		c.user_kb = overwrite(fd, &pos);
+		if (live > cfg.snapshots) {
+			c.delete_usec = delete(snaps[oldest %
+						     (MAX_SNAPSHOTS + 1)]);
+			oldest++;
+			live--;
+		}
+		sync();
+		/* oldest snapshot has the longest read through path */
+		read_through(snaps[oldest % (MAX_SNAPSHOTS + 1)], &c);
+		c.live = live;
+
+		read_stats(&s2);
+		kb2 = lifetime_write_kb();
+		c.dev_kb = kb2 - kb1;
+		diff_stats(&c.delta, &s1, &s2);
+		print_cycle(&c, 0);
+		fflush(stdout);
+
+		total.take_usec += c.take_usec;
+		total.delete_usec += c.delete_usec;
+		total.user_kb += c.user_kb;
+		if (c.read_p50_usec > total.read_p50_usec)
+			total.read_p50_usec = c.read_p50_usec;
+		if (c.read_p99_usec > total.read_p99_usec)
+			total.read_p99_usec = c.read_p99_usec;
+		if (c.read_max_usec > total.read_max_usec)
+			total.read_max_usec = c.read_max_usec;
+		s1 = s2;
+		kb1 = kb2;
+	}
+	close(fd);
+
+	/* total row: sums, except for read latency which is worst cycle */
+	total.cycle = cfg.cycles;
+	total.live = live;
+	total.dev_kb = kb1 - kb0;
+	diff_stats(&total.delta, &s0, &s1);
+	print_cycle(&total, 1);
+	return 0;
+}
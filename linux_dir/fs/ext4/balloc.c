@@ -577,21 +577,32 @@ int ext4_claim_free_blocks(struct ext4_sb_info *sbi,
  *
  * ext4_should_retry_alloc() is called when ENOSPC is returned, and if
  * it is profitable to retry the operation, this function will wait
- * for the current or commiting transaction to complete, and then
- * return TRUE.
+ * for the current or commiting transaction to complete and for the blocks
+ * it freed to be discarded, and then return TRUE.
  *
  * if the total number of retries exceed three times, return FALSE.
  */
 int ext4_should_retry_alloc(struct super_block *sb, int *retries)
 {
-	if (!ext4_has_free_blocks(EXT4_SB(sb), 1) ||
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int retry;
+
+	if (!ext4_has_free_blocks(sbi, 1) ||
 	    (*retries)++ > 3 ||
-	    !EXT4_SB(sb)->s_journal)
+	    !sbi->s_journal)
 		return 0;
 
 	jbd_debug(1, "%s: retrying operation after ENOSPC\n", sb->s_id);
 
-	return jbd2_journal_force_commit_nested(EXT4_SB(sb)->s_journal);
+	retry = jbd2_journal_force_commit_nested(sbi->s_journal);
+	/*
+	 * With -o discard, the blocks freed by committed transactions are
+	 * only put back in the buddy by the discard work, so wait for it
+	 * (it was queued by the commit above or by an earlier commit).
+	 */
+	if (flush_work(&sbi->s_discard_work))
+		retry = 1;
+	return retry;
 }
 
 /*
@@ -7,24 +7,122 @@
  * Universite Pierre et Marie Curie (Paris VI)
  */
 
+#ifdef __KERNEL__
 #include <linux/buffer_head.h>
 #include <linux/jbd2.h>
+#include <linux/bitops.h>
 #include "ext4.h"
+#endif
 
-#ifdef EXT4FS_DEBUG
+/*
+ * Range helpers for ext4 bitmaps. ext4 bitmaps are little endian, bit n
+ * lives in byte n / 8, so whole bytes and whole words can be handled at
+ * once independent of the cpu byte order. None of these are atomic, the
+ * caller serializes access to the bitmap (group lock or buffer lock).
+ *
+ * The range helpers only need min(), hweight_long(), BITS_PER_LONG and
+ * ext4_find_next_zero_bit(), so they can also be built into a userspace
+ * benchmark (see kernel_modules/ext4_hotpath), which provides those.
+ */
 
-static const int nibblemap[] = {4, 3, 3, 2, 3, 2, 2, 1, 3, 2, 2, 1, 2, 1, 1, 0};
+/*
+ * ext4_set_bits() - set @len bits of @bitmap starting at @start
+ */
+void ext4_set_bits(void *bitmap, int start, int len)
+{
+	unsigned char *p = (unsigned char *)bitmap + (start >> 3);
+	int end = start + len;
 
-unsigned int ext4_count_free(struct buffer_head *map, unsigned int numchars)
+	if (len <= 0)
+		return;
+	if ((start & 7) || end - start < 8) {
+		int last = min(end, (start | 7) + 1);
+
+		*p++ |= ((1 << (last - start)) - 1) << (start & 7);
+		start = last;
+	}
+	if (end - start >= 8) {
+		memset(p, 0xff, (end - start) >> 3);
+		p += (end - start) >> 3;
+		start += (end - start) & ~7;
+	}
+	if (start < end)
+		*p |= 0xff >> (8 - (end - start));
+}
+
+/*
+ * ext4_clear_bits() - clear @len bits of @bitmap starting at @start
+ */
+void ext4_clear_bits(void *bitmap, int start, int len)
 {
-	unsigned int i, sum = 0;
+	unsigned char *p = (unsigned char *)bitmap + (start >> 3);
+	int end = start + len;
 
+	if (len <= 0)
+		return;
+	if ((start & 7) || end - start < 8) {
+		int last = min(end, (start | 7) + 1);
+
+		*p++ &= ~(((1 << (last - start)) - 1) << (start & 7));
+		start = last;
+	}
+	if (end - start >= 8) {
+		memset(p, 0, (end - start) >> 3);
+		p += (end - start) >> 3;
+		start += (end - start) & ~7;
+	}
+	if (start < end)
+		*p &= ~(0xff >> (8 - (end - start)));
+}
+
+/*
+ * ext4_count_bits() - count the set bits in [@start, @start + @len) of a
+ * word aligned @bitmap
+ */
+unsigned int ext4_count_bits(const void *bitmap, int start, int len)
+{
+	const unsigned long *w;
+	const unsigned char *p = bitmap;
+	unsigned int count = 0;
+	int end = start + len;
+
+	while (start < end && (start & (BITS_PER_LONG - 1))) {
+		count += (p[start >> 3] >> (start & 7)) & 1;
+		start++;
+	}
+	w = bitmap + (start >> 3);
+	while (end - start >= BITS_PER_LONG) {
+		count += hweight_long(*w++);
+		start += BITS_PER_LONG;
+	}
+	while (start < end) {
+		count += (p[start >> 3] >> (start & 7)) & 1;
+		start++;
+	}
+	return count;
+}
+
+/*
+ * ext4_count_set_run() - count the consecutive set bits of a word aligned
+ * @bitmap from @start on, but not past bit @max
+ */
+int ext4_count_set_run(const void *bitmap, int start, int max)
+{
+	int next;
+
+	if (start >= max)
+		return 0;
+	next = ext4_find_next_zero_bit((void *)bitmap, max, start);
+	return min(next, max) - start;
+}
+
+#ifdef EXT4FS_DEBUG
+
+unsigned int ext4_count_free(struct buffer_head *map, unsigned int numchars)
+{
 	if (!map)
 		return 0;
-	for (i = 0; i < numchars; i++)
-		sum += nibblemap[map->b_data[i] & 0xf] +
-			nibblemap[(map->b_data[i] >> 4) & 0xf];
-	return sum;
+	return numchars * 8 - ext4_count_bits(map->b_data, 0, numchars * 8);
 }
 
 #endif  /*  EXT4FS_DEBUG  */
@@ -25,7 +25,7 @@
 #include <linux/jbd2.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
-#include <linux/rbtree.h>
+#include <linux/sort.h>
 #include "ext4.h"
 
 static unsigned char ext4_filetype_table[] = {
@@ -256,63 +256,88 @@ out:
 #define pos2min_hash(pos)	(0)
 
 /*
- * This structure holds the nodes of the red-black tree used to store
- * the directory entry in hash order.
+ * This structure holds a directory entry read by ext4_htree_fill_tree().
+ * The entries of one batch, normally one htree leaf, are allocated from
+ * the chunks of dir_private_info and sorted by hash in its fnames array.
  */
 struct fname {
 	__u32		hash;
 	__u32		minor_hash;
-	struct rb_node	rb_hash;
-	struct fname	*next;
 	__u32		inode;
 	__u8		name_len;
 	__u8		file_type;
 	char		name[0];
 };
 
+struct fname_chunk {
+	struct fname_chunk *next;
+	unsigned int	size;		/* bytes available in data */
+	unsigned int	used;
+	char		data[0];
+};
+
+/* size of the first chunk, it holds at least one name of any length */
+#define FNAME_CHUNK_MIN		512
+/* initial size of the fnames array */
+#define FNAME_ARRAY_MIN		32
+
 /*
- * This functoin implements a non-recursive way of freeing all of the
- * nodes in the red-black tree.
+ * Free the entries of the current batch.  The newest chunk is kept for
+ * the next batch, which is usually the next leaf of the same size.
  */
-static void free_rb_tree_fname(struct rb_root *root)
+static void ext4_htree_reset_fnames(struct dir_private_info *info)
 {
-	struct rb_node	*n = root->rb_node;
-	struct rb_node	*parent;
-	struct fname	*fname;
-
-	while (n) {
-		/* Do the node's children first */
-		if (n->rb_left) {
-			n = n->rb_left;
-			continue;
-		}
-		if (n->rb_right) {
-			n = n->rb_right;
-			continue;
-		}
-		/*
-		 * The node has no children; free it, and then zero
-		 * out parent's link to it.  Finally go to the
-		 * beginning of the loop and try to free the parent
-		 * node.
-		 */
-		parent = rb_parent(n);
-		fname = rb_entry(n, struct fname, rb_hash);
-		while (fname) {
-			struct fname *old = fname;
-			fname = fname->next;
-			kfree(old);
+	struct fname_chunk *chunk = info->chunks, *next;
+
+	if (chunk) {
+		next = chunk->next;
+		chunk->next = NULL;
+		chunk->used = 0;
+		while (next) {
+			chunk = next;
+			next = chunk->next;
+			kfree(chunk);
 		}
-		if (!parent)
-			*root = RB_ROOT;
-		else if (parent->rb_left == n)
-			parent->rb_left = NULL;
-		else if (parent->rb_right == n)
-			parent->rb_right = NULL;
-		n = parent;
 	}
+	info->nr_fnames = 0;
+	info->curr_fname = 0;
+}
+
+static struct fname *ext4_htree_alloc_fname(struct dir_private_info *info,
+					    int len)
+{
+	struct fname_chunk *chunk = info->chunks;
+	struct fname *fname;
+
+	len = ALIGN(len, sizeof(void *));
+	if (!chunk || chunk->used + len > chunk->size) {
+		/* small directories only ever need the first, small chunk */
+		unsigned int size = chunk ? PAGE_SIZE : FNAME_CHUNK_MIN;
+
+		chunk = kmalloc(size, GFP_KERNEL);
+		if (!chunk)
+			return NULL;
+		chunk->next = info->chunks;
+		chunk->size = size - sizeof(*chunk);
+		chunk->used = 0;
+		info->chunks = chunk;
+	}
+	fname = (struct fname *) (chunk->data + chunk->used);
+	chunk->used += len;
+	return fname;
 }
 
+static int fname_cmp(const void *a, const void *b)
+{
+	const struct fname *f1 = *(const struct fname **) a;
+	const struct fname *f2 = *(const struct fname **) b;
+
+	if (f1->hash != f2->hash)
+		return f1->hash < f2->hash ? -1 : 1;
+	if (f1->minor_hash != f2->minor_hash)
+		return f1->minor_hash < f2->minor_hash ? -1 : 1;
+	return 0;
+}
 
 static struct dir_private_info *ext4_htree_create_dir_info(loff_t pos)
 {
@@ -328,28 +353,41 @@ static struct dir_private_info *ext4_htree_create_dir_info(loff_t pos)
 
 void ext4_htree_free_dir_info(struct dir_private_info *p)
 {
-	free_rb_tree_fname(&p->root);
+	ext4_htree_reset_fnames(p);
+	kfree(p->chunks);
+	kfree(p->fnames);
 	kfree(p);
 }
 
 /*
- * Given a directory entry, enter it into the fname rb tree.
+ * Given a directory entry, add it to the current batch of fnames.
  */
 int ext4_htree_store_dirent(struct file *dir_file, __u32 hash,
 			     __u32 minor_hash,
 			     struct ext4_dir_entry_2 *dirent)
 {
-	struct rb_node **p, *parent = NULL;
-	struct fname *fname, *new_fn;
 	struct dir_private_info *info;
-	int len;
+	struct fname *new_fn;
 
 	info = dir_file->private_data;
-	p = &info->root.rb_node;
+
+	if (info->nr_fnames == info->max_fnames) {
+		/* start small, most directories are small */
+		unsigned int max = info->max_fnames ?
+			2 * info->max_fnames : FNAME_ARRAY_MIN;
+		struct fname **fnames;
+
+		fnames = krealloc(info->fnames, max * sizeof(*fnames),
+				  GFP_KERNEL);
+		if (!fnames)
+			return -ENOMEM;
+		info->fnames = fnames;
+		info->max_fnames = max;
+	}
 
 	/* Create and allocate the fname structure */
-	len = sizeof(struct fname) + dirent->name_len + 1;
-	new_fn = kzalloc(len, GFP_KERNEL);
+	new_fn = ext4_htree_alloc_fname(info, sizeof(struct fname) +
+					dirent->name_len + 1);
 	if (!new_fn)
 		return -ENOMEM;
 	new_fn->hash = hash;
@@ -360,33 +398,7 @@ int ext4_htree_store_dirent(struct file *dir_file, __u32 hash,
 	memcpy(new_fn->name, dirent->name, dirent->name_len);
 	new_fn->name[dirent->name_len] = 0;
 
-	while (*p) {
-		parent = *p;
-		fname = rb_entry(parent, struct fname, rb_hash);
-
-		/*
-		 * If the hash and minor hash match up, then we put
-		 * them on a linked list.  This rarely happens...
-		 */
-		if ((new_fn->hash == fname->hash) &&
-		    (new_fn->minor_hash == fname->minor_hash)) {
-			new_fn->next = fname->next;
-			fname->next = new_fn;
-			return 0;
-		}
-
-		if (new_fn->hash < fname->hash)
-			p = &(*p)->rb_left;
-		else if (new_fn->hash > fname->hash)
-			p = &(*p)->rb_right;
-		else if (new_fn->minor_hash < fname->minor_hash)
-			p = &(*p)->rb_left;
-		else /* if (new_fn->minor_hash > fname->minor_hash) */
-			p = &(*p)->rb_right;
-	}
-
-	rb_link_node(&new_fn->rb_hash, parent, p);
-	rb_insert_color(&new_fn->rb_hash, &info->root);
+	info->fnames[info->nr_fnames++] = new_fn;
 	return 0;
 }
 
@@ -394,37 +406,42 @@ int ext4_htree_store_dirent(struct file *dir_file, __u32 hash,
 
 /*
  * This is a helper function for ext4_dx_readdir.  It calls filldir
- * for all entres on the fname linked list.  (Normally there is only
- * one entry on the linked list, unless there are 62 bit hash collisions.)
+ * for all entries with the hash of the current fname.  (Normally there
+ * is only one, unless there are 62 bit hash collisions.)
  */
 static int call_filldir(struct file *filp, void *dirent,
-			filldir_t filldir, struct fname *fname)
+			filldir_t filldir)
 {
 	struct dir_private_info *info = filp->private_data;
 	loff_t	curr_pos;
 	struct inode *inode = filp->f_path.dentry->d_inode;
 	struct super_block *sb;
+	struct fname *fname, *first;
 	int error;
 
 	sb = inode->i_sb;
 
-	if (!fname) {
+	if (info->curr_fname >= info->nr_fnames) {
 		printk(KERN_ERR "EXT4-fs: call_filldir: called with "
-		       "null fname?!?\n");
+		       "no fname?!?\n");
 		return 0;
 	}
-	curr_pos = hash2pos(fname->hash, fname->minor_hash);
-	while (fname) {
+	first = info->fnames[info->curr_fname];
+	curr_pos = hash2pos(first->hash, first->minor_hash);
+	while (info->curr_fname < info->nr_fnames) {
+		fname = info->fnames[info->curr_fname];
+		if (fname_cmp(&fname, &first))
+			break;
 		error = filldir(dirent, fname->name,
 				fname->name_len, curr_pos,
 				fname->inode,
 				get_dtype(sb, fname->file_type));
 		if (error) {
 			filp->f_pos = curr_pos;
-			info->extra_fname = fname;
+			info->extra_fname = 1;
 			return error;
 		}
-		fname = fname->next;
+		info->curr_fname++;
 	}
 	return 0;
 }
@@ -449,9 +466,8 @@ static int ext4_dx_readdir(struct file *filp,
 
 	/* Some one has messed with f_pos; reset the world */
 	if (info->last_pos != filp->f_pos) {
-		free_rb_tree_fname(&info->root);
-		info->curr_node = NULL;
-		info->extra_fname = NULL;
+		ext4_htree_reset_fnames(info);
+		info->extra_fname = 0;
 		info->curr_hash = pos2maj_hash(filp->f_pos);
 		info->curr_minor_hash = pos2min_hash(filp->f_pos);
 	}
@@ -461,23 +477,21 @@ static int ext4_dx_readdir(struct file *filp,
 	 * chain, return them first.
 	 */
 	if (info->extra_fname) {
-		if (call_filldir(filp, dirent, filldir, info->extra_fname))
+		if (call_filldir(filp, dirent, filldir))
 			goto finished;
-		info->extra_fname = NULL;
+		info->extra_fname = 0;
 		goto next_node;
-	} else if (!info->curr_node)
-		info->curr_node = rb_first(&info->root);
+	}
 
 	while (1) {
 		/*
-		 * Fill the rbtree if we have no more entries,
+		 * Refill the batch if we have no more entries,
 		 * or the inode has changed since we last read in the
 		 * cached entries.
 		 */
-		if ((!info->curr_node) ||
+		if ((info->curr_fname >= info->nr_fnames) ||
 		    (filp->f_version != inode->i_version)) {
-			info->curr_node = NULL;
-			free_rb_tree_fname(&info->root);
+			ext4_htree_reset_fnames(info);
 			filp->f_version = inode->i_version;
 			ret = ext4_htree_fill_tree(filp, info->curr_hash,
 						   info->curr_minor_hash,
@@ -488,19 +502,19 @@ static int ext4_dx_readdir(struct file *filp,
 				filp->f_pos = EXT4_HTREE_EOF;
 				break;
 			}
-			info->curr_node = rb_first(&info->root);
+			/* one sort per batch instead of a tree insert per entry */
+			sort(info->fnames, info->nr_fnames,
+			     sizeof(*info->fnames), fname_cmp, NULL);
 		}
 
-		fname = rb_entry(info->curr_node, struct fname, rb_hash);
+		fname = info->fnames[info->curr_fname];
 		info->curr_hash = fname->hash;
 		info->curr_minor_hash = fname->minor_hash;
-		if (call_filldir(filp, dirent, filldir, fname))
+		if (call_filldir(filp, dirent, filldir))
 			break;
 	next_node:
-		info->curr_node = rb_next(info->curr_node);
-		if (info->curr_node) {
-			fname = rb_entry(info->curr_node, struct fname,
-					 rb_hash);
+		if (info->curr_fname < info->nr_fnames) {
+			fname = info->fnames[info->curr_fname];
 			info->curr_hash = fname->hash;
 			info->curr_minor_hash = fname->minor_hash;
 		} else {
@@ -0,0 +1,414 @@
+/*
+ *  linux/fs/ext4/dir_cache.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Name cache of linear (non-htree) directories.
+ *
+ * ext4_find_entry() scans every block of a directory that is not
+ * indexed.  For directories that are looked up often, the first lookup
+ * that would scan them instead reads all blocks into a hash table
+ * mapping each name to the logical block and offset of its entry.  The
+ * table is kept up to date by ext4_add_entry() and ext4_delete_entry(),
+ * so a name missing from it does not exist.  A name found in it is still
+ * checked against the directory block, and any mismatch drops the cache.
+ *
+ * The cache is built and updated with the directory's i_mutex held.  The
+ * i_dc_lock spinlock guards it against the shrinker, which frees whole
+ * caches from a per sb LRU list.  The memory used by all caches of a file
+ * system is bounded by the dir_cache_kb sysfs tunable, 0 disables the
+ * cache.
+ *
+ * "." and ".." are not cached, they are always looked up in block 0.
+ */
+
+#include <linux/fs.h>
+#include <linux/dcache.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include "ext4.h"
+
+/* directories shorter than this are cheap enough to scan */
+#define EXT4_DC_MIN_BLOCKS	2
+/* limits of the hash table size, in bits */
+#define EXT4_DC_MIN_BITS	5
+#define EXT4_DC_MAX_BITS	12
+
+struct ext4_dc_entry {
+	struct hlist_node	dce_hash;
+	ext4_lblk_t		dce_block;	/* logical block of the entry */
+	unsigned short		dce_offset;	/* offset of the entry in it */
+	unsigned char		dce_name_len;
+	char			dce_name[0];
+};
+
+struct ext4_dir_cache {
+	ext4_lblk_t		dc_nblocks;	/* directory size in blocks */
+	unsigned int		dc_bits;	/* log2 of hash table size */
+	size_t			dc_bytes;	/* memory charged to the cache */
+	struct hlist_head	dc_table[0];
+};
+
+static inline struct hlist_head *ext4_dc_bucket(struct ext4_dir_cache *dc,
+						const char *name, int len)
+{
+	return &dc->dc_table[hash_32(full_name_hash(name, len), dc->dc_bits)];
+}
+
+static struct ext4_dc_entry *ext4_dc_find(struct ext4_dir_cache *dc,
+					  const char *name, int len)
+{
+	struct ext4_dc_entry *dce;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(dce, node, ext4_dc_bucket(dc, name, len),
+			     dce_hash) {
+		if (dce->dce_name_len == len &&
+		    !memcmp(dce->dce_name, name, len))
+			return dce;
+	}
+	return NULL;
+}
+
+static void ext4_dc_free(struct ext4_sb_info *sbi, struct ext4_dir_cache *dc)
+{
+	struct ext4_dc_entry *dce;
+	struct hlist_node *node, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < (1U << dc->dc_bits); i++)
+		hlist_for_each_entry_safe(dce, node, tmp, &dc->dc_table[i],
+					  dce_hash)
+			kfree(dce);
+	percpu_counter_sub(&sbi->s_dir_cache_bytes, dc->dc_bytes);
+	kfree(dc);
+}
+
+/*
+ * Allocate an entry for @name, charging it to the file system.  Fails if
+ * the file system is over its dir_cache_kb budget.  The caller charges
+ * the entry to its cache, under i_dc_lock if the cache is published.
+ */
+static struct ext4_dc_entry *ext4_dc_alloc(struct ext4_sb_info *sbi,
+					   const char *name, int len,
+					   ext4_lblk_t block,
+					   unsigned int offset)
+{
+	struct ext4_dc_entry *dce;
+	size_t size = sizeof(*dce) + len;
+
+	if (percpu_counter_read(&sbi->s_dir_cache_bytes) + size >
+	    (s64)sbi->s_dir_cache_kb << 10)
+		return NULL;
+	dce = kmalloc(size, GFP_NOFS);
+	if (!dce)
+		return NULL;
+	dce->dce_block = block;
+	dce->dce_offset = offset;
+	dce->dce_name_len = len;
+	memcpy(dce->dce_name, name, len);
+	percpu_counter_add(&sbi->s_dir_cache_bytes, size);
+	return dce;
+}
+
+/*
+ * Read all blocks of @dir into a new cache.  Returns NULL if a block
+ * cannot be read or the cache does not fit in the budget, in which case
+ * the caller falls back to scanning the directory.
+ */
+static struct ext4_dir_cache *ext4_dc_build(struct inode *dir,
+					    ext4_lblk_t nblocks)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	unsigned int blocksize = sb->s_blocksize;
+	struct ext4_dir_cache *dc;
+	struct ext4_dir_entry_2 *de;
+	struct ext4_dc_entry *dce;
+	struct buffer_head *bh;
+	unsigned int bits, offset;
+	ext4_lblk_t block;
+	char *top;
+	int err;
+
+	bits = clamp_t(unsigned int, ilog2(nblocks) + 5,
+		       EXT4_DC_MIN_BITS, EXT4_DC_MAX_BITS);
+	dc = kzalloc(sizeof(*dc) + (sizeof(struct hlist_head) << bits),
+		     GFP_NOFS);
+	if (!dc)
+		return NULL;
+	dc->dc_nblocks = nblocks;
+	dc->dc_bits = bits;
+	dc->dc_bytes = sizeof(*dc) + (sizeof(struct hlist_head) << bits);
+	percpu_counter_add(&sbi->s_dir_cache_bytes, dc->dc_bytes);
+
+	for (block = 0; block < nblocks; block++) {
+		bh = ext4_bread(NULL, dir, block, 0, &err);
+		if (!bh)
+			goto fail;
+		de = (struct ext4_dir_entry_2 *) bh->b_data;
+		top = bh->b_data + blocksize;
+		offset = 0;
+		while ((char *) de < top) {
+			if (!ext4_check_dir_entry(dir, de, bh,
+					(block << sb->s_blocksize_bits) +
+					offset)) {
+				brelse(bh);
+				goto fail;
+			}
+			/* dot entries are not cached */
+			if (de->inode && !(de->name[0] == '.' &&
+			    (de->name_len == 1 || (de->name_len == 2 &&
+						   de->name[1] == '.')))) {
+				dce = ext4_dc_alloc(sbi, de->name,
+						    de->name_len, block, offset);
+				if (!dce) {
+					brelse(bh);
+					goto fail;
+				}
+				/* not published yet, no lock needed */
+				dc->dc_bytes += sizeof(*dce) + de->name_len;
+				hlist_add_head(&dce->dce_hash,
+					       ext4_dc_bucket(dc, de->name,
+							      de->name_len));
+			}
+			offset += ext4_rec_len_from_disk(de->rec_len,
+							 blocksize);
+			de = (struct ext4_dir_entry_2 *) (bh->b_data + offset);
+		}
+		brelse(bh);
+	}
+	return dc;
+
+fail:
+	ext4_dc_free(sbi, dc);
+	return NULL;
+}
+
+static void ext4_dc_touch(struct inode *dir)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(dir->i_sb);
+
+	spin_lock(&sbi->s_dc_lru_lock);
+	list_move_tail(&EXT4_I(dir)->i_dc_lru, &sbi->s_dc_lru);
+	spin_unlock(&sbi->s_dc_lru_lock);
+}
+
+/*
+ * ext4_dc_lookup() - look @name up in the name cache of @dir
+ *
+ * Builds the cache on first use.  Returns 1 and the location of the entry
+ * if the name is cached, 0 if the name does not exist, and -1 if @dir has
+ * no cache or @name is "." or "..", and @dir must be scanned.
+ * Called with the i_mutex of @dir held.
+ */
+int ext4_dc_lookup(struct inode *dir, const struct qstr *name,
+		   ext4_lblk_t *block, unsigned int *offset)
+{
+	struct ext4_inode_info *ei = EXT4_I(dir);
+	struct ext4_sb_info *sbi = EXT4_SB(dir->i_sb);
+	ext4_lblk_t nblocks = dir->i_size >> dir->i_sb->s_blocksize_bits;
+	struct ext4_dir_cache *dc, *stale = NULL;
+	struct ext4_dc_entry *dce;
+	int ret = -1;
+
+	if (!sbi->s_dir_cache_kb || nblocks < EXT4_DC_MIN_BLOCKS)
+		return -1;
+	if (name->name[0] == '.' && (name->len == 1 ||
+	    (name->len == 2 && name->name[1] == '.')))
+		/* not cached, see ext4_dc_build() */
+		return -1;
+
+	spin_lock(&ei->i_dc_lock);
+	dc = ei->i_dir_cache;
+	if (dc && dc->dc_nblocks != nblocks) {
+		/* the directory changed behind our back */
+		stale = dc;
+		ei->i_dir_cache = dc = NULL;
+	}
+	spin_unlock(&ei->i_dc_lock);
+	if (stale)
+		ext4_dc_free(sbi, stale);
+
+	if (!dc) {
+		/* don't bother if the budget is obviously exhausted */
+		if (percpu_counter_read(&sbi->s_dir_cache_bytes) +
+		    2 * dir->i_size > (s64)sbi->s_dir_cache_kb << 10)
+			return -1;
+		dc = ext4_dc_build(dir, nblocks);
+		if (!dc)
+			return -1;
+		spin_lock(&ei->i_dc_lock);
+		ei->i_dir_cache = dc;
+		spin_unlock(&ei->i_dc_lock);
+	}
+
+	spin_lock(&ei->i_dc_lock);
+	dc = ei->i_dir_cache;
+	if (dc) {
+		dce = ext4_dc_find(dc, name->name, name->len);
+		if (dce) {
+			*block = dce->dce_block;
+			*offset = dce->dce_offset;
+			ret = 1;
+		} else
+			ret = 0;
+	}
+	spin_unlock(&ei->i_dc_lock);
+	if (dc)
+		ext4_dc_touch(dir);
+	return ret;
+}
+
+/*
+ * ext4_dc_insert() - record a name added at @block, @offset of @dir
+ * Drops the cache if the entry cannot be allocated, since the cache must
+ * not miss any name.
+ */
+void ext4_dc_insert(struct inode *dir, const char *name, int len,
+		    ext4_lblk_t block, unsigned int offset)
+{
+	struct ext4_inode_info *ei = EXT4_I(dir);
+	struct ext4_sb_info *sbi = EXT4_SB(dir->i_sb);
+	struct ext4_dir_cache *dc, *cached;
+	struct ext4_dc_entry *dce = NULL;
+	size_t size = sizeof(*dce) + len;
+
+	/*
+	 * The shrinker may free the cache at any time without i_mutex, so
+	 * @cached is only compared, never dereferenced, outside i_dc_lock.
+	 */
+	spin_lock(&ei->i_dc_lock);
+	cached = ei->i_dir_cache;
+	spin_unlock(&ei->i_dc_lock);
+	if (!cached)
+		return;
+	dce = ext4_dc_alloc(sbi, name, len, block, offset);
+
+	spin_lock(&ei->i_dc_lock);
+	dc = ei->i_dir_cache;
+	if (!dc || dc != cached) {
+		/* freed by the shrinker meanwhile, charge nothing */
+		spin_unlock(&ei->i_dc_lock);
+		if (dce) {
+			percpu_counter_sub(&sbi->s_dir_cache_bytes, size);
+			kfree(dce);
+		}
+		return;
+	}
+	if (dce) {
+		hlist_add_head(&dce->dce_hash, ext4_dc_bucket(dc, name, len));
+		dc->dc_bytes += size;
+		if (block >= dc->dc_nblocks)
+			dc->dc_nblocks = block + 1;
+		dc = NULL;
+	} else
+		ei->i_dir_cache = NULL;
+	spin_unlock(&ei->i_dc_lock);
+	if (dc)
+		ext4_dc_free(sbi, dc);
+}
+
+/*
+ * ext4_dc_remove() - forget a name deleted from @dir
+ */
+void ext4_dc_remove(struct inode *dir, const char *name, int len)
+{
+	struct ext4_inode_info *ei = EXT4_I(dir);
+	struct ext4_dir_cache *dc;
+	struct ext4_dc_entry *dce = NULL;
+	size_t size = sizeof(*dce) + len;
+
+	if (!ei->i_dir_cache)
+		return;
+	spin_lock(&ei->i_dc_lock);
+	dc = ei->i_dir_cache;
+	if (dc) {
+		dce = ext4_dc_find(dc, name, len);
+		if (dce) {
+			hlist_del(&dce->dce_hash);
+			dc->dc_bytes -= size;
+		}
+	}
+	spin_unlock(&ei->i_dc_lock);
+	if (dce) {
+		percpu_counter_sub(&EXT4_SB(dir->i_sb)->s_dir_cache_bytes,
+				   size);
+		kfree(dce);
+	}
+}
+
+/*
+ * ext4_dc_drop() - free the name cache of @dir
+ * Called when the directory gets indexed or is evicted, and when a cached
+ * entry turns out to be wrong.
+ */
+void ext4_dc_drop(struct inode *dir)
+{
+	struct ext4_inode_info *ei = EXT4_I(dir);
+	struct ext4_sb_info *sbi = EXT4_SB(dir->i_sb);
+	struct ext4_dir_cache *dc;
+
+	if (!ei->i_dir_cache && list_empty(&ei->i_dc_lru))
+		return;
+	spin_lock(&sbi->s_dc_lru_lock);
+	list_del_init(&ei->i_dc_lru);
+	spin_unlock(&sbi->s_dc_lru_lock);
+
+	spin_lock(&ei->i_dc_lock);
+	dc = ei->i_dir_cache;
+	ei->i_dir_cache = NULL;
+	spin_unlock(&ei->i_dc_lock);
+	if (dc)
+		ext4_dc_free(sbi, dc);
+}
+
+static int ext4_dc_shrink(struct shrinker *shrink, int nr_to_scan,
+			  gfp_t gfp_mask)
+{
+	struct ext4_sb_info *sbi = container_of(shrink, struct ext4_sb_info,
+						s_dc_shrinker);
+	struct ext4_inode_info *ei, *tmp;
+	struct ext4_dir_cache *dc;
+
+	if (nr_to_scan) {
+		spin_lock(&sbi->s_dc_lru_lock);
+		list_for_each_entry_safe(ei, tmp, &sbi->s_dc_lru, i_dc_lru) {
+			if (nr_to_scan <= 0)
+				break;
+			if (!spin_trylock(&ei->i_dc_lock))
+				continue;
+			dc = ei->i_dir_cache;
+			ei->i_dir_cache = NULL;
+			spin_unlock(&ei->i_dc_lock);
+			list_del_init(&ei->i_dc_lru);
+			if (dc) {
+				nr_to_scan -= (dc->dc_bytes >> PAGE_SHIFT) + 1;
+				ext4_dc_free(sbi, dc);
+			}
+		}
+		spin_unlock(&sbi->s_dc_lru_lock);
+	}
+	return percpu_counter_read_positive(&sbi->s_dir_cache_bytes) >>
+		PAGE_SHIFT;
+}
+
+/*
+ * ext4_dc_register_shrinker() - register the directory name cache shrinker
+ * Called from ext4_fill_super() at the end of a successful mount.
+ */
+void ext4_dc_register_shrinker(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	sbi->s_dc_shrinker.shrink = ext4_dc_shrink;
+	sbi->s_dc_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sbi->s_dc_shrinker);
+}
+
+void ext4_dc_unregister_shrinker(struct super_block *sb)
+{
+	unregister_shrinker(&EXT4_SB(sb)->s_dc_shrinker);
+}
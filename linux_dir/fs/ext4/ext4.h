@@ -179,34 +179,12 @@ struct ext4_map_blocks {
 	unsigned int m_flags;
 };
 
-/*
- * For delayed allocation tracking
- */
-struct mpage_da_data {
-	struct inode *inode;
-	sector_t b_blocknr;		/* start block number of extent */
-	size_t b_size;			/* size of extent */
-	unsigned long b_state;		/* state of the extent */
-	unsigned long first_page, next_page;	/* extent of pages */
-	struct writeback_control *wbc;
-	int io_done;
-	int pages_written;
-	int retval;
-};
-
 /*
  * Flags for ext4_io_end->flags
  */
 #define	EXT4_IO_END_UNWRITTEN	0x0001
 #define EXT4_IO_END_ERROR	0x0002
 
-struct ext4_io_page {
-	struct page	*p_page;
-	atomic_t	p_count;
-};
-
-#define MAX_IO_PAGES 128
-
 typedef struct ext4_io_end {
 	struct list_head	list;		/* per-file finished IO list */
 	struct inode		*inode;		/* file being written to */
@@ -214,21 +192,33 @@ typedef struct ext4_io_end {
 	struct page		*page;		/* page struct for buffer write */
 	loff_t			offset;		/* offset in the file */
 	ssize_t			size;		/* size of the extent */
-	struct work_struct	work;		/* data work queue */
 	struct kiocb		*iocb;		/* iocb struct for AIO */
 	int			result;		/* error value for AIO */
-	int			num_io_pages;
-	struct ext4_io_page	*pages[MAX_IO_PAGES];
 } ext4_io_end_t;
 
 struct ext4_io_submit {
 	int			io_op;
 	struct bio		*io_bio;
 	ext4_io_end_t		*io_end;
-	struct ext4_io_page	*io_page;
 	sector_t		io_next_block;
 };
 
+/*
+ * For delayed allocation tracking
+ */
+struct mpage_da_data {
+	struct inode *inode;
+	sector_t b_blocknr;		/* start block number of extent */
+	size_t b_size;			/* size of extent */
+	unsigned long b_state;		/* state of the extent */
+	unsigned long first_page, next_page;	/* extent of pages */
+	struct writeback_control *wbc;
+	int io_done;
+	int pages_written;
+	int retval;
+	struct ext4_io_submit io_submit;	/* bio being built */
+};
+
 /*
  * Special inodes numbers
  */
@@ -394,6 +384,7 @@ struct flex_groups {
 #define EXT4_SNAPFILE_INUSE_FL		0x00000800 /* snapshot is in-use  (p) */
 /* snapshot persistent flags */
 #define EXT4_SNAPFILE_FL		0x01000000 /* snapshot file (x) */
+#define EXT4_SNAPFILE_PACKED_FL	0x02000000 /* snapshot is packed (z) */
 #define EXT4_SNAPFILE_DELETED_FL	0x04000000 /* snapshot is deleted (s) */
 #define EXT4_SNAPFILE_SHRUNK_FL	0x08000000 /* snapshot was shrunk (h) */
 /* more snapshot non-persistent flags */
@@ -415,7 +406,8 @@ struct flex_groups {
 
 /* snapshot persistent read-only flags */
 #define EXT4_FL_SNAPSHOT_RO_MASK		\
-	 (EXT4_SNAPFILE_DELETED_FL|EXT4_SNAPFILE_SHRUNK_FL)
+	 (EXT4_SNAPFILE_DELETED_FL|EXT4_SNAPFILE_SHRUNK_FL| \
+	  EXT4_SNAPFILE_PACKED_FL)
 
 /* non-persistent snapshot status flags */
 #define EXT4_FL_SNAPSHOT_DYN_MASK		\
@@ -638,6 +630,8 @@ struct ext4_new_group_data {
  /* note ioctl 11 reserved for filesystem-independent FIEMAP ioctl */
 #define EXT4_IOC_ALLOC_DA_BLKS		_IO('f', 12)
 #define EXT4_IOC_MOVE_EXT		_IOWR('f', 15, struct move_extent)
+#define EXT4_IOC_ZERO_RANGE		_IOW('f', 16, struct ext4_zero_range)
+#define EXT4_IOC_PRECACHE_EXTENTS	_IO('f', 17)
 
 #if defined(__KERNEL__) && defined(CONFIG_COMPAT)
 /*
@@ -751,6 +745,20 @@ struct move_extent {
 	__u64 moved_len;	/* moved block length */
 };
 
+struct ext4_zero_range {
+	__u64 offset;		/* byte offset of the range to zero */
+	__u64 len;		/* byte length of the range to zero */
+	__u32 mode;		/* 0 or FALLOC_FL_KEEP_SIZE */
+	__u32 reserved;		/* should be zero */
+};
+
+/*
+ * ext4 private fallocate mode, only passed by EXT4_IOC_ZERO_RANGE since
+ * the VFS does not know about it yet: zero the range, allocating the
+ * holes as uninitialized extents.
+ */
+#define EXT4_FALLOC_FL_ZERO_RANGE	0x10
+
 #define EXT4_EPOCH_BITS 2
 #define EXT4_EPOCH_MASK ((1 << EXT4_EPOCH_BITS) - 1)
 #define EXT4_NSEC_MASK  (~0UL << EXT4_EPOCH_BITS)
@@ -858,6 +866,8 @@ struct ext4_ext_cache {
 	__u32		ec_type;
 };
 
+#include "extents_status.h"
+
 /*
  * fourth extended file system inode data in memory
  */
@@ -902,6 +912,10 @@ struct ext4_inode_info {
 	 * is stored in i_next_snapshot_ino and not in i_dtime
 	 */
 	__u32	i_next_snapshot_ino;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	/* in-memory index of packed COWed blocks (allocated on demand) */
+	struct ext4_snapshot_pack *i_snapshot_pack;
+#endif
 
 #endif
 	/*
@@ -935,7 +949,17 @@ struct ext4_inode_info {
 	struct inode vfs_inode;
 	struct jbd2_inode jinode;
 
-	struct ext4_ext_cache i_cached_extent;
+	/* extent status cache, see extents_status.c */
+	rwlock_t i_es_lock;
+	struct ext4_es_tree i_es_tree;
+	struct list_head i_es_lru;	/* on s_es_lru if cache not empty */
+	unsigned int i_es_nr;		/* no. of cached entries */
+	ext4_lblk_t i_ext_ra_next;	/* leaf after the last one mapped */
+
+	/* name cache of linear directories, see dir_cache.c */
+	spinlock_t i_dc_lock;
+	struct ext4_dir_cache *i_dir_cache;
+	struct list_head i_dc_lru;	/* on s_dc_lru if cache built */
 	/*
 	 * File creation time. Its function is same as that of
 	 * struct timespec i_{a,c,m}time in the generic inode.
@@ -968,6 +992,7 @@ struct ext4_inode_info {
 
 	/* completed IOs that might need unwritten extents handling */
 	struct list_head i_completed_io_list;
+	struct work_struct i_unwritten_work;	/* converts completed IO */
 	spinlock_t i_completed_io_lock;
 	/* current io_end structure for async DIO write*/
 	ext4_io_end_t *cur_aio_dio;
@@ -1221,6 +1246,7 @@ struct ext4_sb_info {
 	unsigned long s_overhead_last;  /* Last calculated overhead */
 	unsigned long s_blocks_last;    /* Last seen block count */
 	loff_t s_bitmap_maxbytes;	/* max bytes for bitmap files */
+	struct super_block *s_sb;	/* Back pointer to the super block */
 	struct buffer_head * s_sbh;	/* Buffer containing the super block */
 	struct ext4_super_block *s_es;	/* Pointer to the super block in the buffer */
 	struct buffer_head **s_group_desc;
@@ -1267,6 +1293,16 @@ struct ext4_sb_info {
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
 	struct list_head s_snapshot_list;	/* [ s_snapshot_mutex ] */
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	unsigned int s_snapshot_pack;		/* pack COWed blocks of new snapshots */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+	struct shrinker s_snapshot_shrinker;	/* snapshots cache shrinker */
+	unsigned int s_snapshot_cache_kb;	/* snapshots cache soft limit */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	struct ext4_snapshot_stats __percpu *s_snapshot_stats;
+#endif
 #endif
 #ifdef CONFIG_JBD2_DEBUG
 	struct timer_list turn_ro_timer;	/* For turning read-only (crash simulation) */
@@ -1295,6 +1331,11 @@ struct ext4_sb_info {
 	spinlock_t s_md_lock;
 	unsigned short *s_mb_offsets;
 	unsigned int *s_mb_maxs;
+	/* groups by order of largest free extent and avg fragment size */
+	struct list_head *s_mb_largest_free_orders;
+	spinlock_t *s_mb_largest_free_orders_locks;
+	struct list_head *s_mb_avg_fragment_size;
+	spinlock_t *s_mb_avg_fragment_size_locks;
 
 	/* tunables */
 	unsigned long s_stripe;
@@ -1304,10 +1345,10 @@ struct ext4_sb_info {
 	unsigned int s_mb_stats;
 	unsigned int s_mb_order2_reqs;
 	unsigned int s_mb_group_prealloc;
+	unsigned int s_mb_optimize_scan;
+	unsigned int s_mb_prefetch;
 	unsigned int s_max_writeback_mb_bump;
-	/* where last allocation was done - for stream allocation */
-	unsigned long s_mb_last_group;
-	unsigned long s_mb_last_start;
+	unsigned int s_extent_max_zeroout_kb;
 
 	/* stats for buddy allocator */
 	atomic_t s_bal_reqs;	/* number of reqs with len > 1 */
@@ -1327,6 +1368,7 @@ struct ext4_sb_info {
 
 	/* locality groups */
 	struct ext4_locality_group __percpu *s_locality_groups;
+	struct ext4_mb_stats __percpu *s_mb_pcpu_stats;
 
 	/* for write statistics */
 	unsigned long s_sectors_written_start;
@@ -1338,6 +1380,27 @@ struct ext4_sb_info {
 	/* workqueue for dio unwritten */
 	struct workqueue_struct *dio_unwritten_wq;
 
+	/* blocks freed by committed transactions, waiting for discard */
+	spinlock_t s_discard_lock;
+	struct list_head s_discard_list;
+	struct work_struct s_discard_work;
+	struct workqueue_struct *s_discard_wq;
+	/* FITRIM rate limit in MB/s (0 is unlimited) */
+	unsigned int s_trim_max_mbps;
+
+	/* extent status cache, see extents_status.c */
+	struct shrinker s_es_shrinker;
+	struct list_head s_es_lru;	/* inodes with cached extents */
+	spinlock_t s_es_lru_lock;
+	struct percpu_counter s_extent_cache_cnt;
+
+	/* name cache of linear directories, see dir_cache.c */
+	struct shrinker s_dc_shrinker;
+	struct list_head s_dc_lru;	/* directories with a cache */
+	spinlock_t s_dc_lru_lock;
+	struct percpu_counter s_dir_cache_bytes;
+	unsigned int s_dir_cache_kb;	/* limit of s_dir_cache_bytes */
+
 	/* timer for periodic error stats printing */
 	struct timer_list s_err_report;
 
@@ -1493,6 +1556,7 @@ EXT4_INODE_BIT_FNS(state, state_flags)
 #define EXT4_FEATURE_INCOMPAT_FLEX_BG		0x0200
 #define EXT4_FEATURE_INCOMPAT_EA_INODE		0x0400 /* EA in inode */
 #define EXT4_FEATURE_INCOMPAT_DIRDATA		0x1000 /* data in dirent */
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR		0x4000 /* >2GB or 3-lvl htree */
 
 #define EXT4_FEATURE_COMPAT_SUPP	EXT2_FEATURE_COMPAT_EXT_ATTR
 #define EXT4_FEATURE_INCOMPAT_SUPP	(EXT4_FEATURE_INCOMPAT_FILETYPE| \
@@ -1500,7 +1564,8 @@ EXT4_INODE_BIT_FNS(state, state_flags)
 					 EXT4_FEATURE_INCOMPAT_META_BG| \
 					 EXT4_FEATURE_INCOMPAT_EXTENTS| \
 					 EXT4_FEATURE_INCOMPAT_64BIT| \
-					 EXT4_FEATURE_INCOMPAT_FLEX_BG)
+					 EXT4_FEATURE_INCOMPAT_FLEX_BG| \
+					 EXT4_FEATURE_INCOMPAT_LARGEDIR)
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_OLD
 #define EXT4_FEATURE_RO_COMPAT_SUPP	(EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER| \
@@ -1663,6 +1728,16 @@ static inline __le16 ext4_rec_len_to_disk(unsigned len, unsigned blocksize)
 #define EXT4_DIR_LINK_MAX(dir) (!is_dx(dir) && (dir)->i_nlink >= EXT4_LINK_MAX)
 #define EXT4_DIR_LINK_EMPTY(dir) ((dir)->i_nlink == 2 || (dir)->i_nlink == 1)
 
+/* Maximum number of index levels below the root, plus one */
+#define EXT4_HTREE_LEVEL_COMPAT	2
+#define EXT4_HTREE_LEVEL	3
+
+static inline int ext4_dir_htree_level(struct super_block *sb)
+{
+	return EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_LARGEDIR) ?
+		EXT4_HTREE_LEVEL : EXT4_HTREE_LEVEL_COMPAT;
+}
+
 /* Legal values for the dx_root hash_version field: */
 
 #define DX_HASH_LEGACY		0
@@ -1712,9 +1787,12 @@ static inline struct ext4_inode *ext4_raw_inode(struct ext4_iloc *iloc)
  * readdir operations in hash tree order.
  */
 struct dir_private_info {
-	struct rb_root	root;
-	struct rb_node	*curr_node;
-	struct fname	*extra_fname;
+	struct fname	**fnames;	/* current batch, sorted by hash */
+	unsigned int	nr_fnames;
+	unsigned int	max_fnames;
+	unsigned int	curr_fname;	/* next entry to return */
+	struct fname_chunk *chunks;	/* memory of the fnames */
+	int		extra_fname;	/* in the middle of a collision run */
 	loff_t		last_pos;
 	__u32		curr_hash;
 	__u32		curr_minor_hash;
@@ -1745,6 +1823,13 @@ void ext4_get_group_no_and_offset(struct super_block *sb, ext4_fsblk_t blocknr,
 #define EXT4_LAZYINIT_QUIT			0x0001
 #define EXT4_LAZYINIT_RUNNING			0x0002
 
+/*
+ * Lazy init request modes: block bitmap prefetch runs first, followed
+ * by inode table zeroing if needed.
+ */
+#define EXT4_LI_MODE_PREFETCH_BBITMAP		0
+#define EXT4_LI_MODE_ITABLE			1
+
 /*
  * Lazy inode table initialization info
  */
@@ -1767,6 +1852,8 @@ struct ext4_li_request {
 	struct list_head	lr_request;
 	unsigned long		lr_next_sched;
 	unsigned long		lr_timeout;
+	int			lr_mode;
+	ext4_group_t		lr_first_not_zeroed;
 };
 
 struct ext4_features {
@@ -1788,6 +1875,10 @@ struct ext4_features {
 
 /* bitmap.c */
 extern unsigned int ext4_count_free(struct buffer_head *, unsigned);
+extern void ext4_set_bits(void *bitmap, int start, int len);
+extern void ext4_clear_bits(void *bitmap, int start, int len);
+extern unsigned int ext4_count_bits(const void *bitmap, int start, int len);
+extern int ext4_count_set_run(const void *bitmap, int start, int max);
 
 /* balloc.c */
 extern unsigned int ext4_block_group(struct super_block *sb,
@@ -1865,6 +1956,10 @@ extern void ext4_free_blocks(handle_t *handle, struct inode *inode,
 extern int ext4_mb_add_groupinfo(struct super_block *sb,
 		ext4_group_t i, struct ext4_group_desc *desc);
 extern int ext4_trim_fs(struct super_block *, struct fstrim_range *);
+extern ext4_group_t ext4_mb_prefetch(struct super_block *sb,
+				     ext4_group_t group, unsigned int nr);
+extern void ext4_mb_prefetch_fini(struct super_block *sb, ext4_group_t group,
+				  unsigned int nr);
 
 /* inode.c */
 struct buffer_head *ext4_getblk(handle_t *, struct inode *,
@@ -1896,6 +1991,8 @@ extern int ext4_writepage_trans_blocks(struct inode *);
 extern int ext4_chunk_trans_blocks(struct inode *, int nrblocks);
 extern int ext4_block_truncate_page(handle_t *handle,
 		struct address_space *mapping, loff_t from);
+extern int ext4_block_zero_page_range(handle_t *handle,
+		struct address_space *mapping, loff_t from, loff_t length);
 extern int ext4_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf);
 extern qsize_t *ext4_get_reserved_space(struct inode *inode);
 extern void ext4_da_update_reserve_space(struct inode *inode,
@@ -1907,6 +2004,16 @@ extern long ext4_compat_ioctl(struct file *, unsigned int, unsigned long);
 /* migrate.c */
 extern int ext4_ext_migrate(struct inode *);
 
+/* dir_cache.c */
+extern int ext4_dc_lookup(struct inode *dir, const struct qstr *name,
+			  ext4_lblk_t *block, unsigned int *offset);
+extern void ext4_dc_insert(struct inode *dir, const char *name, int len,
+			   ext4_lblk_t block, unsigned int offset);
+extern void ext4_dc_remove(struct inode *dir, const char *name, int len);
+extern void ext4_dc_drop(struct inode *dir);
+extern void ext4_dc_register_shrinker(struct super_block *sb);
+extern void ext4_dc_unregister_shrinker(struct super_block *sb);
+
 /* namei.c */
 extern int ext4_orphan_add(handle_t *, struct inode *);
 extern int ext4_orphan_del(handle_t *, struct inode *);
@@ -2032,9 +2139,11 @@ static inline void ext4_r_blocks_count_set(struct ext4_super_block *es,
 	es->s_r_blocks_count_hi = cpu_to_le32(blk >> 32);
 }
 
-static inline loff_t ext4_isize(struct ext4_inode *raw_inode)
+static inline loff_t ext4_isize(struct super_block *sb,
+				struct ext4_inode *raw_inode)
 {
-	if (S_ISREG(le16_to_cpu(raw_inode->i_mode)))
+	if (S_ISREG(le16_to_cpu(raw_inode->i_mode)) ||
+	    EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_LARGEDIR))
 		return ((loff_t)le32_to_cpu(raw_inode->i_size_high) << 32) |
 			le32_to_cpu(raw_inode->i_size_lo);
 	else
@@ -2124,6 +2233,10 @@ struct ext4_group_info {
 	ext4_grpblk_t	bb_free;	/* total free blocks */
 	ext4_grpblk_t	bb_fragments;	/* nr of freespace fragments */
 	ext4_grpblk_t	bb_largest_free_order;/* order of largest frag in BG */
+	ext4_grpblk_t	bb_avg_fragment_size_order;/* order of avg frag size */
+	ext4_group_t	bb_group;	/* group number */
+	struct          list_head bb_largest_free_order_node;
+	struct          list_head bb_avg_fragment_size_node;
 	struct          list_head bb_prealloc_list;
 #ifdef DOUBLE_CHECK
 	void            *bb_bitmap;
@@ -2243,6 +2356,7 @@ extern int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 extern void ext4_ext_truncate(struct inode *);
 extern void ext4_ext_init(struct super_block *);
 extern void ext4_ext_release(struct super_block *);
+extern int ext4_ext_precache(struct inode *inode);
 extern long ext4_fallocate(struct inode *inode, int mode, loff_t offset,
 			  loff_t len);
 extern int ext4_convert_unwritten_extents(struct inode *inode, loff_t offset,
@@ -2262,7 +2376,9 @@ extern void ext4_exit_pageio(void);
 extern void ext4_ioend_wait(struct inode *);
 extern void ext4_free_io_end(ext4_io_end_t *io);
 extern ext4_io_end_t *ext4_init_io_end(struct inode *inode, gfp_t flags);
-extern int ext4_end_io_nolock(ext4_io_end_t *io);
+extern void ext4_add_complete_io(ext4_io_end_t *io_end);
+extern int ext4_flush_completed_IO(struct inode *inode);
+extern void ext4_end_io_work(struct work_struct *work);
 extern void ext4_io_submit(struct ext4_io_submit *io);
 extern int ext4_bio_write_page(struct ext4_io_submit *io,
 			       struct page *page,
@@ -2273,10 +2389,12 @@ extern int ext4_bio_write_page(struct ext4_io_submit *io,
 enum ext4_state_bits {
 	BH_Uninit	/* blocks are allocated but uninitialized on disk */
 	  = BH_JBDPrivateStart,
+	BH_Verified,	/* metadata block has been checked since it was read */
 };
 
 BUFFER_FNS(Uninit, uninit)
 TAS_BUFFER_FNS(Uninit, uninit)
+BUFFER_FNS(Verified, verified)
 
 /*
  * Add new method to test wether block and inode bitmaps are properly
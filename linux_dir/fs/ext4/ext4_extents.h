@@ -115,6 +115,20 @@ struct ext4_ext_path {
 	struct buffer_head		*p_bh;
 };
 
+/*
+ * Number of ext4_ext_path entries a lookup keeps on the stack.  A lookup
+ * needs depth + 2 entries (one spare for tree growth), so trees up to two
+ * levels deep, i.e. all but huge or very fragmented files, are looked up
+ * without allocating the path.
+ */
+#define EXT4_EXT_PATH_ONSTACK	4
+
+/*
+ * Number of sibling leaves read ahead by ext4_ext_find_extent() once it
+ * sees the leaves of an index node being mapped in order.
+ */
+#define EXT4_EXT_RA_LEAVES	8
+
 /*
  * structure for external API
  */
@@ -197,7 +211,7 @@ static inline unsigned short ext_depth(struct inode *inode)
 static inline void
 ext4_ext_invalidate_cache(struct inode *inode)
 {
-	EXT4_I(inode)->i_cached_extent.ec_type = EXT4_EXT_CACHE_NO;
+	ext4_es_remove_extent(inode, 0, EXT_MAX_BLOCK);
 }
 
 static inline void ext4_ext_mark_uninitialized(struct ext4_extent *ext)
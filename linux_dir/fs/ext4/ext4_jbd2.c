@@ -186,6 +186,26 @@ out:
 	return err;
 }
 
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_ADAPTIVE
+/*
+ * ext4_snapshot_trans_credits() - the buffer credits to reserve for a
+ * handle that may dirty @nblocks more user buffers.
+ *
+ * COW credits are only needed while there is an active snapshot.  They
+ * cannot be added on demand, because jbd2_journal_extend() fails once the
+ * running transaction is locked for commit and a handle cannot be restarted
+ * in the middle of a COW operation.  So when there is an active snapshot,
+ * the worst case COW credits are reserved up front.
+ */
+int ext4_snapshot_trans_credits(struct super_block *sb, int nblocks)
+{
+	if (!ext4_snapshot_has_active(sb))
+		/* active snapshot is only set with no running handles */
+		return nblocks;
+	return EXT4_SNAPSHOT_TRANS_BLOCKS(nblocks);
+}
+
 #endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_TRACE
 #ifdef CONFIG_JBD_DEBUG
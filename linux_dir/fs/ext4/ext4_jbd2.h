@@ -121,15 +121,29 @@
 #define EXT4_SNAPSHOT_START_TRANS_BLOCKS(n) \
 	((n)*(1+EXT4_COW_CREDITS)+2*EXT4_SNAPSHOT_CREDITS)
 
+#define EXT4_RESERVE_COW_CREDITS	(EXT4_COW_CREDITS +		\
+					 EXT4_SNAPSHOT_CREDITS)
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_ADAPTIVE
+/*
+ * check for sufficient buffer credits for @n user blocks and, if there is
+ * an active snapshot, for their COW operations
+ */
+#define EXT4_SNAPSHOT_HAS_TRANS_BLOCKS(handle, n)			\
+	((handle)->h_buffer_credits >= ext4_snapshot_trans_credits(	\
+		(handle)->h_transaction->t_journal->j_private, (n)) &&	\
+	 ((ext4_handle_t *)(handle))->h_user_credits >= (n))
+
+extern int ext4_snapshot_trans_credits(struct super_block *sb,
+		int nblocks);
+#else
 /*
  * check for sufficient buffer and COW credits
  */
 #define EXT4_SNAPSHOT_HAS_TRANS_BLOCKS(handle, n)			\
 	((handle)->h_buffer_credits >= EXT4_SNAPSHOT_TRANS_BLOCKS(n) && \
 	 ((ext4_handle_t *)(handle))->h_user_credits >= (n))
-
-#define EXT4_RESERVE_COW_CREDITS	(EXT4_COW_CREDITS +		\
-					 EXT4_SNAPSHOT_CREDITS)
+#endif
 
 /*
  * Ext4 is not designed for filesystems under 4G with journal size < 128M
@@ -145,7 +159,7 @@
 
 #define EXT4_RESERVE_TRANS_BLOCKS	12U
 
-#define EXT4_INDEX_EXTRA_TRANS_BLOCKS	8
+#define EXT4_INDEX_EXTRA_TRANS_BLOCKS	12U
 
 #ifdef CONFIG_QUOTA
 /* Amount of blocks needed for quota update - we know that the structure was
@@ -466,7 +480,13 @@ static inline handle_t *ext4_journal_current_handle(void)
 static inline int __ext4_journal_extend(const char *where,
 		ext4_handle_t *handle, int nblocks)
 {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_ADAPTIVE
+	int lower = ext4_snapshot_trans_credits(
+			handle->h_transaction->t_journal->j_private,
+			handle->h_user_credits+nblocks);
+#else
 	int lower = EXT4_SNAPSHOT_TRANS_BLOCKS(handle->h_user_credits+nblocks);
+#endif
 	int err = 0;
 	int missing = lower - handle->h_buffer_credits;
 	if (missing > 0)
@@ -491,8 +511,15 @@ static inline int __ext4_journal_extend(const char *where,
 static inline int __ext4_journal_restart(const char *where,
 		ext4_handle_t *handle, int nblocks)
 {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_ADAPTIVE
+	int err = jbd2_journal_restart((handle_t *)handle,
+			ext4_snapshot_trans_credits(
+				handle->h_transaction->t_journal->j_private,
+				nblocks) + EXT4_SNAPSHOT_CREDITS);
+#else
 	int err = jbd2_journal_restart((handle_t *)handle,
 				  EXT4_SNAPSHOT_START_TRANS_BLOCKS(nblocks));
+#endif
 	if (!err) {
 		handle->h_base_credits = nblocks;
 		handle->h_user_credits = nblocks;
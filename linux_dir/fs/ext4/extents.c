@@ -603,6 +603,74 @@ int ext4_ext_tree_init(handle_t *handle, struct inode *inode)
 	return 0;
 }
 
+/*
+ * Read the extent tree block @pblk, whose entries are at @depth, and check
+ * it the first time it is used after being read from disk, including when
+ * it was brought in by readahead.
+ */
+static struct buffer_head *
+ext4_ext_read_block(struct inode *inode, ext4_fsblk_t pblk, int depth)
+{
+	struct buffer_head *bh;
+
+	bh = sb_getblk(inode->i_sb, pblk);
+	if (unlikely(!bh))
+		return ERR_PTR(-EIO);
+	if (!bh_uptodate_or_lock(bh)) {
+		if (bh_submit_read(bh) < 0) {
+			put_bh(bh);
+			return ERR_PTR(-EIO);
+		}
+	}
+	if (!buffer_verified(bh)) {
+		/* validate the extent entries */
+		if (ext4_ext_check(inode, ext_block_hdr(bh), depth)) {
+			put_bh(bh);
+			return ERR_PTR(-EIO);
+		}
+		set_buffer_verified(bh);
+	}
+	return bh;
+}
+
+/*
+ * Called when descending from the lowest index node @parent into a leaf.
+ * A sequential scan maps the leaves of an index node in order; when the
+ * leaf at @parent->p_idx is the one following the leaf visited last,
+ * read ahead the next EXT4_EXT_RA_LEAVES sibling leaves so the scan does
+ * not stall on each leaf boundary.  The window is refilled when the next
+ * leaf is found neither cached nor under I/O.  i_ext_ra_next is only a
+ * hint, racing updates just cost a missed or extra readahead.
+ */
+static void ext4_ext_leaf_readahead(struct inode *inode,
+				    struct ext4_ext_path *parent)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_extent_idx *ix = parent->p_idx;
+	struct ext4_extent_idx *last = EXT_LAST_INDEX(parent->p_hdr);
+	struct buffer_head *bh;
+	int sequential, n;
+
+	sequential = le32_to_cpu(ix->ei_block) == ei->i_ext_ra_next;
+	if (ix == last) {
+		ei->i_ext_ra_next = EXT_MAX_BLOCK;
+		return;
+	}
+	ei->i_ext_ra_next = le32_to_cpu(ix[1].ei_block);
+	if (!sequential)
+		return;
+
+	bh = sb_find_get_block(inode->i_sb, ext4_idx_pblock(ix + 1));
+	if (bh) {
+		n = buffer_uptodate(bh) || buffer_locked(bh);
+		brelse(bh);
+		if (n)
+			return;
+	}
+	for (n = 0, ix++; ix <= last && n < EXT4_EXT_RA_LEAVES; ix++, n++)
+		sb_breadahead(inode->i_sb, ext4_idx_pblock(ix));
+}
+
 struct ext4_ext_path *
 ext4_ext_find_extent(struct inode *inode, ext4_lblk_t block,
 					struct ext4_ext_path *path)
@@ -628,8 +696,6 @@ ext4_ext_find_extent(struct inode *inode, ext4_lblk_t block,
 	i = depth;
 	/* walk through the tree */
 	while (i) {
-		int need_to_validate = 0;
-
 		ext_debug("depth %d: num %d, max %d\n",
 			  ppos, le16_to_cpu(eh->eh_entries), le16_to_cpu(eh->eh_max));
 
@@ -638,17 +704,11 @@ ext4_ext_find_extent(struct inode *inode, ext4_lblk_t block,
 		path[ppos].p_depth = i;
 		path[ppos].p_ext = NULL;
 
-		bh = sb_getblk(inode->i_sb, path[ppos].p_block);
-		if (unlikely(!bh))
+		if (i == 1)
+			ext4_ext_leaf_readahead(inode, path + ppos);
+		bh = ext4_ext_read_block(inode, path[ppos].p_block, i - 1);
+		if (IS_ERR(bh))
 			goto err;
-		if (!bh_uptodate_or_lock(bh)) {
-			if (bh_submit_read(bh) < 0) {
-				put_bh(bh);
-				goto err;
-			}
-			/* validate the extent entries */
-			need_to_validate = 1;
-		}
 		eh = ext_block_hdr(bh);
 		ppos++;
 		if (unlikely(ppos > depth)) {
@@ -660,9 +720,6 @@ ext4_ext_find_extent(struct inode *inode, ext4_lblk_t block,
 		path[ppos].p_bh = bh;
 		path[ppos].p_hdr = eh;
 		i--;
-
-		if (need_to_validate && ext4_ext_check(inode, eh, i))
-			goto err;
 	}
 
 	path[ppos].p_depth = i;
@@ -686,6 +743,31 @@ err:
 	return ERR_PTR(-EIO);
 }
 
+/*
+ * Like ext4_ext_find_extent(), but use the caller's on-stack @spath of
+ * EXT4_EXT_PATH_ONSTACK entries when the tree is shallow enough.  The
+ * result must be released with ext4_ext_put_path().
+ */
+static struct ext4_ext_path *
+ext4_ext_find_extent_onstack(struct inode *inode, ext4_lblk_t block,
+			     struct ext4_ext_path *spath)
+{
+	if (ext_depth(inode) + 2 > EXT4_EXT_PATH_ONSTACK)
+		return ext4_ext_find_extent(inode, block, NULL);
+	memset(spath, 0, sizeof(*spath) * EXT4_EXT_PATH_ONSTACK);
+	return ext4_ext_find_extent(inode, block, spath);
+}
+
+static void ext4_ext_put_path(struct ext4_ext_path *path,
+			      struct ext4_ext_path *spath)
+{
+	if (path) {
+		ext4_ext_drop_refs(path);
+		if (path != spath)
+			kfree(path);
+	}
+}
+
 /*
  * ext4_ext_insert_index:
  * insert new index [@logical;@ptr] into the block at @curp;
@@ -1794,7 +1876,9 @@ cleanup:
 		ext4_ext_drop_refs(npath);
 		kfree(npath);
 	}
-	ext4_ext_invalidate_cache(inode);
+	/* the new extent fills (part of) a cached hole */
+	ext4_es_remove_extent(inode, le32_to_cpu(newext->ee_block),
+			      ext4_ext_get_actual_len(newext));
 	return err;
 }
 
@@ -1919,15 +2003,8 @@ static void
 ext4_ext_put_in_cache(struct inode *inode, ext4_lblk_t block,
 			__u32 len, ext4_fsblk_t start, int type)
 {
-	struct ext4_ext_cache *cex;
 	BUG_ON(len == 0);
-	spin_lock(&EXT4_I(inode)->i_block_reservation_lock);
-	cex = &EXT4_I(inode)->i_cached_extent;
-	cex->ec_type = type;
-	cex->ec_block = block;
-	cex->ec_len = len;
-	cex->ec_start = start;
-	spin_unlock(&EXT4_I(inode)->i_block_reservation_lock);
+	ext4_es_insert_extent(inode, block, len, start, type);
 }
 
 /*
@@ -1983,32 +2060,20 @@ static int
 ext4_ext_in_cache(struct inode *inode, ext4_lblk_t block,
 			struct ext4_extent *ex)
 {
-	struct ext4_ext_cache *cex;
-	int ret = EXT4_EXT_CACHE_NO;
+	struct ext4_ext_cache cex;
+	int ret;
 
-	/*
-	 * We borrow i_block_reservation_lock to protect i_cached_extent
-	 */
-	spin_lock(&EXT4_I(inode)->i_block_reservation_lock);
-	cex = &EXT4_I(inode)->i_cached_extent;
-
-	/* has cache valid data? */
-	if (cex->ec_type == EXT4_EXT_CACHE_NO)
-		goto errout;
-
-	BUG_ON(cex->ec_type != EXT4_EXT_CACHE_GAP &&
-			cex->ec_type != EXT4_EXT_CACHE_EXTENT);
-	if (in_range(block, cex->ec_block, cex->ec_len)) {
-		ex->ee_block = cpu_to_le32(cex->ec_block);
-		ext4_ext_store_pblock(ex, cex->ec_start);
-		ex->ee_len = cpu_to_le16(cex->ec_len);
+	ret = ext4_es_lookup_extent(inode, block, &cex);
+	if (ret != EXT4_EXT_CACHE_NO) {
+		BUG_ON(ret != EXT4_EXT_CACHE_GAP &&
+				ret != EXT4_EXT_CACHE_EXTENT);
+		ex->ee_block = cpu_to_le32(cex.ec_block);
+		ext4_ext_store_pblock(ex, cex.ec_start);
+		ex->ee_len = cpu_to_le16(cex.ec_len);
 		ext_debug("%u cached by %u:%u:%llu\n",
 				block,
-				cex->ec_block, cex->ec_len, cex->ec_start);
-		ret = cex->ec_type;
+				cex.ec_block, cex.ec_len, cex.ec_start);
 	}
-errout:
-	spin_unlock(&EXT4_I(inode)->i_block_reservation_lock);
 	return ret;
 }
 
@@ -2488,6 +2553,88 @@ void ext4_ext_release(struct super_block *sb)
 #endif
 }
 
+/*
+ * Read the whole extent tree of @inode into the buffer cache and its
+ * initialized extents into the extent status cache, so that a following
+ * large scan of the file does not have to read the tree block by block.
+ * The children of each index node are read ahead together before they
+ * are walked.  Called by EXT4_IOC_PRECACHE_EXTENTS.
+ */
+int ext4_ext_precache(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_ext_path *path;
+	struct ext4_extent_idx *ix;
+	struct ext4_extent *ex;
+	struct buffer_head *bh;
+	int i = 0, depth, ret = 0;
+
+	if (!ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS))
+		return 0;
+
+	down_read(&ei->i_data_sem);
+	depth = ext_depth(inode);
+	/* the root is in the inode, nothing to read */
+	if (depth == 0)
+		goto out_sem;
+
+	path = kzalloc(sizeof(struct ext4_ext_path) * (depth + 1), GFP_NOFS);
+	if (!path) {
+		ret = -ENOMEM;
+		goto out_sem;
+	}
+	path[0].p_depth = depth;
+	path[0].p_hdr = ext_inode_hdr(inode);
+	path[0].p_idx = EXT_FIRST_INDEX(path[0].p_hdr);
+
+	while (i >= 0) {
+		if (i == depth) {
+			/* cache the initialized extents of the leaf */
+			for (ex = EXT_FIRST_EXTENT(path[i].p_hdr);
+			     ex <= EXT_LAST_EXTENT(path[i].p_hdr); ex++) {
+				if (ext4_ext_is_uninitialized(ex))
+					continue;
+				ext4_es_insert_extent(inode,
+						le32_to_cpu(ex->ee_block),
+						ext4_ext_get_actual_len(ex),
+						ext4_ext_pblock(ex),
+						EXT4_EXT_CACHE_EXTENT);
+			}
+		}
+		/* leaf or end of index node: go up */
+		if (i == depth ||
+		    path[i].p_idx > EXT_LAST_INDEX(path[i].p_hdr)) {
+			brelse(path[i].p_bh);
+			path[i].p_bh = NULL;
+			i--;
+			continue;
+		}
+		/* first visit of an index node: read ahead all its children */
+		if (path[i].p_idx == EXT_FIRST_INDEX(path[i].p_hdr)) {
+			for (ix = path[i].p_idx;
+			     ix <= EXT_LAST_INDEX(path[i].p_hdr); ix++)
+				sb_breadahead(inode->i_sb, ext4_idx_pblock(ix));
+		}
+		bh = ext4_ext_read_block(inode, ext4_idx_pblock(path[i].p_idx),
+					 depth - i - 1);
+		if (IS_ERR(bh)) {
+			ret = PTR_ERR(bh);
+			break;
+		}
+		path[i].p_idx++;
+		i++;
+		path[i].p_bh = bh;
+		path[i].p_hdr = ext_block_hdr(bh);
+		path[i].p_idx = EXT_FIRST_INDEX(path[i].p_hdr);
+	}
+
+	ext4_ext_drop_refs(path);
+	kfree(path);
+out_sem:
+	up_read(&ei->i_data_sem);
+	return ret;
+}
+
 /* FIXME!! we need to try to merge to left or right after zero-out  */
 static int ext4_ext_zeroout(struct inode *inode, struct ext4_extent *ex)
 {
@@ -2505,7 +2652,6 @@ static int ext4_ext_zeroout(struct inode *inode, struct ext4_extent *ex)
 	return ret;
 }
 
-#define EXT4_EXT_ZERO_LEN 7
 /*
  * This function is called by ext4_ext_map_blocks() if someone tries to write
  * to an uninitialized extent. It may result in splitting the uninitialized
@@ -2529,6 +2675,7 @@ static int ext4_ext_convert_to_initialized(handle_t *handle,
 	ext4_lblk_t ee_block, eof_block;
 	unsigned int allocated, ee_len, depth;
 	ext4_fsblk_t newblock;
+	unsigned int max_zeroout;
 	int err = 0;
 	int ret = 0;
 	int may_zeroout;
@@ -2560,12 +2707,15 @@ static int ext4_ext_convert_to_initialized(handle_t *handle,
 	 * zeroout only if extent is fully insde i_size or new_size.
 	 */
 	may_zeroout = ee_block + ee_len <= eof_block;
+	/* half of the extent_max_zeroout_kb tunable, in blocks */
+	max_zeroout = EXT4_SB(inode->i_sb)->s_extent_max_zeroout_kb >>
+		(inode->i_sb->s_blocksize_bits - 9);
 
 	err = ext4_ext_get_access(handle, inode, path + depth);
 	if (err)
 		goto out;
-	/* If extent has less than 2*EXT4_EXT_ZERO_LEN zerout directly */
-	if (ee_len <= 2*EXT4_EXT_ZERO_LEN && may_zeroout) {
+	/* If extent has less than 2*max_zeroout zerout directly */
+	if (ee_len <= 2*max_zeroout && may_zeroout) {
 		err =  ext4_ext_zeroout(inode, &orig_ex);
 		if (err)
 			goto fix_extent_len;
@@ -2595,8 +2745,8 @@ static int ext4_ext_convert_to_initialized(handle_t *handle,
 	/* ex3: to ee_block + ee_len : uninitialised */
 	if (allocated > map->m_len) {
 		unsigned int newdepth;
-		/* If extent has less than EXT4_EXT_ZERO_LEN zerout directly */
-		if (allocated <= EXT4_EXT_ZERO_LEN && may_zeroout) {
+		/* If extent has less than max_zeroout zerout directly */
+		if (allocated <= max_zeroout && may_zeroout) {
 			/*
 			 * map->m_lblk == ee_block is handled by the zerouout
 			 * at the beginning.
@@ -2719,11 +2869,11 @@ static int ext4_ext_convert_to_initialized(handle_t *handle,
 
 		allocated = map->m_len;
 
-		/* If extent has less than EXT4_EXT_ZERO_LEN and we are trying
+		/* If extent has less than max_zeroout and we are trying
 		 * to insert a extent in the middle zerout directly
 		 * otherwise give the extent a chance to merge to left
 		 */
-		if (le16_to_cpu(orig_ex.ee_len) <= EXT4_EXT_ZERO_LEN &&
+		if (le16_to_cpu(orig_ex.ee_len) <= max_zeroout &&
 			map->m_lblk != ee_block && may_zeroout) {
 			err =  ext4_ext_zeroout(inode, &orig_ex);
 			if (err)
@@ -3244,10 +3394,7 @@ out1:
 	map->m_pblk = newblock;
 	map->m_len = allocated;
 out2:
-	if (path) {
-		ext4_ext_drop_refs(path);
-		kfree(path);
-	}
+	/* path is released by the caller */
 	return err ? err : allocated;
 }
 
@@ -3272,6 +3419,7 @@ out2:
 int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 			struct ext4_map_blocks *map, int flags)
 {
+	struct ext4_ext_path spath[EXT4_EXT_PATH_ONSTACK];
 	struct ext4_ext_path *path = NULL;
 	struct ext4_extent_header *eh;
 	struct ext4_extent newex, *ex;
@@ -3311,7 +3459,7 @@ int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 	}
 
 	/* find extent for this block */
-	path = ext4_ext_find_extent(inode, map->m_lblk, NULL);
+	path = ext4_ext_find_extent_onstack(inode, map->m_lblk, spath);
 	if (IS_ERR(path)) {
 		err = PTR_ERR(path);
 		path = NULL;
@@ -3364,6 +3512,7 @@ int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 			ret = ext4_ext_handle_uninitialized_extents(handle,
 					inode, map, path, flags, allocated,
 					newblock);
+			ext4_ext_put_path(path, spath);
 			return ret;
 		}
 	}
@@ -3503,10 +3652,7 @@ out:
 	map->m_pblk = newblock;
 	map->m_len = allocated;
 out2:
-	if (path) {
-		ext4_ext_drop_refs(path);
-		kfree(path);
-	}
+	ext4_ext_put_path(path, spath);
 	return err ? err : allocated;
 }
 
@@ -3604,6 +3750,135 @@ static void ext4_falloc_update_inode(struct inode *inode,
 
 }
 
+/*
+ * Zero the byte range [offset, offset + len) of an extent mapped file.
+ * Partial blocks at the edges are zeroed through the page cache.  For the
+ * whole blocks in between, holes are allocated as uninitialized extents
+ * and initialized extents are zeroed on disk with large zero-filled bios,
+ * so neither the page cache nor the extent tree is touched block by block.
+ * Uninitialized extents already read back as zeroes and are left alone.
+ */
+static long ext4_zero_range(struct inode *inode, loff_t offset, loff_t len,
+			    int mode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct address_space *mapping = inode->i_mapping;
+	unsigned int credits, blkbits = inode->i_blkbits;
+	struct ext4_map_blocks map;
+	ext4_lblk_t lblk, end_lblk;
+	loff_t start, end;
+	handle_t *handle;
+	int retries = 0;
+	int ret, ret2;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	/* zeroed blocks would bypass the journal */
+	if (ext4_should_journal_data(inode))
+		return -EOPNOTSUPP;
+
+	/* [start, end) are the whole blocks in the range */
+	start = EXT4_BLOCK_ALIGN(offset, blkbits);
+	end = (offset + len) & ~((loff_t)sb->s_blocksize - 1);
+
+	mutex_lock(&inode->i_mutex);
+	ret = inode_newsize_ok(inode, offset + len);
+	if (ret)
+		goto out_mutex;
+
+	/* old data must not be written back over the zeroed blocks */
+	ret = filemap_write_and_wait_range(mapping, offset, offset + len - 1);
+	if (ret)
+		goto out_mutex;
+	ret = ext4_flush_completed_IO(inode);
+	if (ret < 0)
+		goto out_mutex;
+
+	lblk = start >> blkbits;
+	end_lblk = end >> blkbits;
+	while (lblk < end_lblk) {
+		map.m_lblk = lblk;
+		map.m_len = end_lblk - lblk;
+		ret = ext4_map_blocks(NULL, inode, &map, 0);
+		if (ret < 0)
+			goto out_mutex;
+		if (ret > 0) {
+			lblk += ret;
+			/* uninitialized extents already read back as zeroes */
+			if (!(map.m_flags & EXT4_MAP_MAPPED))
+				continue;
+			ret = sb_issue_zeroout(sb, map.m_pblk, ret, GFP_NOFS);
+			if (ret < 0)
+				goto out_mutex;
+			continue;
+		}
+
+		/* hole: allocate up to the next mapped block */
+		map.m_len = end_lblk - lblk;
+		credits = ext4_chunk_trans_blocks(inode, map.m_len);
+		handle = ext4_journal_start(inode, credits);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			goto out_mutex;
+		}
+		ret = ext4_map_blocks(handle, inode, &map,
+				      EXT4_GET_BLOCKS_CREATE_UNINIT_EXT);
+		if (ret > 0) {
+			ext4_falloc_update_inode(inode, mode,
+					(loff_t)(lblk + ret) << blkbits, 0);
+			ext4_mark_inode_dirty(handle, inode);
+		}
+		ret2 = ext4_journal_stop(handle);
+		if (ret == -ENOSPC && ext4_should_retry_alloc(sb, &retries))
+			continue;
+		if (ret <= 0) {
+			if (!ret)
+				ret = -EIO;
+			goto out_mutex;
+		}
+		if (ret2) {
+			ret = ret2;
+			goto out_mutex;
+		}
+		lblk += ret;
+	}
+	/*
+	 * Buffered reads and page faults don't take i_mutex, so the old data
+	 * may have been read back into page cache until the blocks were
+	 * zeroed.  Drop the pages only now that the zeroes are on disk.
+	 */
+	if (start < end)
+		truncate_inode_pages_range(mapping, start, end - 1);
+
+	handle = ext4_journal_start(inode, ext4_writepage_trans_blocks(inode));
+	if (IS_ERR(handle)) {
+		ret = PTR_ERR(handle);
+		goto out_mutex;
+	}
+	if (start > end) {
+		/* head and tail are in the same block */
+		ret = ext4_block_zero_page_range(handle, mapping, offset, len);
+	} else {
+		ret = 0;
+		if (offset < start)
+			ret = ext4_block_zero_page_range(handle, mapping,
+							 offset, start - offset);
+		if (!ret && end < offset + len)
+			ret = ext4_block_zero_page_range(handle, mapping,
+						end, offset + len - end);
+	}
+	inode->i_mtime = inode->i_ctime = ext4_current_time(inode);
+	if (!ret)
+		ext4_falloc_update_inode(inode, mode, offset + len, 0);
+	ext4_mark_inode_dirty(handle, inode);
+	ret2 = ext4_journal_stop(handle);
+	if (!ret)
+		ret = ret2;
+out_mutex:
+	mutex_unlock(&inode->i_mutex);
+	return ret;
+}
+
 /*
  * preallocate space for a file. This implements ext4's fallocate inode
  * operation, which gets called from sys_fallocate system call.
@@ -3633,6 +3908,10 @@ long ext4_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len)
 	if (S_ISDIR(inode->i_mode))
 		return -ENODEV;
 
+	if (mode & EXT4_FALLOC_FL_ZERO_RANGE)
+		return ext4_zero_range(inode, offset, len,
+				       mode & ~EXT4_FALLOC_FL_ZERO_RANGE);
+
 	map.m_lblk = offset >> blkbits;
 	/*
 	 * We can't just convert len to max_blocks because
@@ -0,0 +1,403 @@
+/*
+ *  linux/fs/ext4/extents_status.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Per inode cache of extents and holes.
+ *
+ * ext4_ext_map_blocks() used to remember only the last extent (or hole)
+ * it looked up, so any access pattern touching more than one extent fell
+ * back to walking the extent tree.  The cache is now a per inode rb-tree
+ * of non-overlapping ranges, each either an initialized extent or a hole.
+ * Uninitialized extents are never cached.
+ *
+ * Lookups take i_es_lock for reading only, updates take it for writing.
+ * Entries are never allocated with the lock dropped, so a failed
+ * allocation simply means the range is not cached.  Inodes with cached
+ * entries are kept on a per sb LRU list (ordered by last insert) that a
+ * shrinker walks to free whole trees under memory pressure.
+ */
+
+#include <linux/fs.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include "ext4.h"
+#include "ext4_extents.h"
+
+static struct kmem_cache *ext4_es_cachep;
+
+int __init ext4_init_es(void)
+{
+	ext4_es_cachep = KMEM_CACHE(extent_status, SLAB_RECLAIM_ACCOUNT);
+	if (ext4_es_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void ext4_exit_es(void)
+{
+	if (ext4_es_cachep)
+		kmem_cache_destroy(ext4_es_cachep);
+}
+
+void ext4_es_init_tree(struct ext4_es_tree *tree)
+{
+	tree->root = RB_ROOT;
+	tree->cache_es = NULL;
+}
+
+static inline ext4_lblk_t ext4_es_end(struct extent_status *es)
+{
+	BUG_ON(es->es_lblk + es->es_len < es->es_lblk);
+	return es->es_lblk + es->es_len - 1;
+}
+
+/*
+ * Find the entry covering @lblk, or failing that the first entry after
+ * @lblk.  Returns NULL if there is none.
+ */
+static struct extent_status *__es_tree_search(struct rb_root *root,
+					      ext4_lblk_t lblk)
+{
+	struct rb_node *node = root->rb_node;
+	struct extent_status *es = NULL;
+
+	while (node) {
+		es = rb_entry(node, struct extent_status, rb_node);
+		if (lblk < es->es_lblk)
+			node = node->rb_left;
+		else if (lblk > ext4_es_end(es))
+			node = node->rb_right;
+		else
+			return es;
+	}
+
+	if (es && lblk < es->es_lblk)
+		return es;
+
+	if (es && lblk > ext4_es_end(es)) {
+		node = rb_next(&es->rb_node);
+		return node ? rb_entry(node, struct extent_status, rb_node) :
+			      NULL;
+	}
+
+	return NULL;
+}
+
+/* Link @es into the tree, its range must not overlap any other entry */
+static void ext4_es_link(struct ext4_es_tree *tree, struct extent_status *es)
+{
+	struct rb_node **p = &tree->root.rb_node;
+	struct rb_node *parent = NULL;
+	struct extent_status *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct extent_status, rb_node);
+		if (es->es_lblk < entry->es_lblk)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&es->rb_node, parent, p);
+	rb_insert_color(&es->rb_node, &tree->root);
+}
+
+static struct extent_status *
+ext4_es_alloc_extent(struct inode *inode, ext4_lblk_t lblk, __u32 len,
+		     ext4_fsblk_t pblk, int type)
+{
+	struct extent_status *es;
+
+	es = kmem_cache_alloc(ext4_es_cachep, GFP_ATOMIC);
+	if (es == NULL)
+		return NULL;
+	es->es_lblk = lblk;
+	es->es_len = len;
+	es->es_pblk = pblk;
+	es->es_type = type;
+	EXT4_I(inode)->i_es_nr++;
+	percpu_counter_inc(&EXT4_SB(inode->i_sb)->s_extent_cache_cnt);
+	return es;
+}
+
+static void ext4_es_free_extent(struct inode *inode, struct extent_status *es)
+{
+	struct ext4_es_tree *tree = &EXT4_I(inode)->i_es_tree;
+
+	if (tree->cache_es == es)
+		tree->cache_es = NULL;
+	rb_erase(&es->rb_node, &tree->root);
+	EXT4_I(inode)->i_es_nr--;
+	percpu_counter_dec(&EXT4_SB(inode->i_sb)->s_extent_cache_cnt);
+	kmem_cache_free(ext4_es_cachep, es);
+}
+
+/*
+ * Can @es2 be appended to @es1?  Extents are only merged up to the
+ * length a single on-disk extent can have, because the lookup result is
+ * handed out as an ext4_extent.
+ */
+static int ext4_es_can_merge(struct extent_status *es1,
+			     struct extent_status *es2)
+{
+	if (es1->es_type != es2->es_type)
+		return 0;
+	if (ext4_es_end(es1) + 1 != es2->es_lblk)
+		return 0;
+	if (es1->es_type == EXT4_EXT_CACHE_GAP)
+		return (__u64)es1->es_len + es2->es_len <= EXT_MAX_BLOCK;
+	if (es1->es_pblk + es1->es_len != es2->es_pblk)
+		return 0;
+	return es1->es_len + es2->es_len <= EXT_INIT_MAX_LEN;
+}
+
+static struct extent_status *
+ext4_es_try_to_merge_left(struct inode *inode, struct extent_status *es)
+{
+	struct rb_node *node = rb_prev(&es->rb_node);
+	struct extent_status *left;
+
+	if (!node)
+		return es;
+	left = rb_entry(node, struct extent_status, rb_node);
+	if (!ext4_es_can_merge(left, es))
+		return es;
+	left->es_len += es->es_len;
+	ext4_es_free_extent(inode, es);
+	return left;
+}
+
+static void ext4_es_try_to_merge_right(struct inode *inode,
+				       struct extent_status *es)
+{
+	struct rb_node *node = rb_next(&es->rb_node);
+	struct extent_status *right;
+
+	if (!node)
+		return;
+	right = rb_entry(node, struct extent_status, rb_node);
+	if (!ext4_es_can_merge(es, right))
+		return;
+	es->es_len += right->es_len;
+	ext4_es_free_extent(inode, right);
+}
+
+/*
+ * Drop [@lblk, @end] from the tree, trimming or splitting the entries
+ * that stick out of the range.  If a split entry can't be allocated, the
+ * whole entry is dropped instead.
+ */
+static void __es_remove_extent(struct inode *inode, ext4_lblk_t lblk,
+			       ext4_lblk_t end)
+{
+	struct ext4_es_tree *tree = &EXT4_I(inode)->i_es_tree;
+	struct extent_status *es, *tail;
+	struct rb_node *node;
+	ext4_lblk_t es_end, skip;
+
+	es = __es_tree_search(&tree->root, lblk);
+	while (es && es->es_lblk <= end) {
+		node = rb_next(&es->rb_node);
+		es_end = ext4_es_end(es);
+
+		if (es->es_lblk < lblk && es_end > end) {
+			/* range is in the middle of the entry: split it */
+			skip = end + 1 - es->es_lblk;
+			tail = ext4_es_alloc_extent(inode, end + 1,
+					es_end - end, es->es_type ==
+					EXT4_EXT_CACHE_GAP ? 0 :
+					es->es_pblk + skip, es->es_type);
+			if (tail == NULL) {
+				ext4_es_free_extent(inode, es);
+				return;
+			}
+			es->es_len = lblk - es->es_lblk;
+			ext4_es_link(tree, tail);
+			return;
+		}
+
+		if (es->es_lblk < lblk) {
+			/* trim the tail of the entry */
+			es->es_len = lblk - es->es_lblk;
+		} else if (es_end > end) {
+			/* trim the head of the entry */
+			skip = end + 1 - es->es_lblk;
+			es->es_lblk += skip;
+			es->es_len -= skip;
+			if (es->es_type != EXT4_EXT_CACHE_GAP)
+				es->es_pblk += skip;
+			return;
+		} else {
+			ext4_es_free_extent(inode, es);
+		}
+		es = node ? rb_entry(node, struct extent_status, rb_node) :
+			    NULL;
+	}
+}
+
+/*
+ * Clamp [@lblk, @lblk + @len) to the logical block range of a file and
+ * return its last block.
+ */
+static inline ext4_lblk_t ext4_es_range_end(ext4_lblk_t lblk, __u32 len)
+{
+	if (len > EXT_MAX_BLOCK - lblk)
+		len = EXT_MAX_BLOCK - lblk;
+	return lblk + len - 1;
+}
+
+/*
+ * ext4_es_lookup_extent() - look up the cached extent or hole that
+ * covers @lblk.  Returns EXT4_EXT_CACHE_NO if @lblk is not cached,
+ * otherwise the type of the entry, which is copied to @cex.
+ */
+int ext4_es_lookup_extent(struct inode *inode, ext4_lblk_t lblk,
+			  struct ext4_ext_cache *cex)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_es_tree *tree = &ei->i_es_tree;
+	struct extent_status *es;
+	int ret = EXT4_EXT_CACHE_NO;
+
+	read_lock(&ei->i_es_lock);
+	es = tree->cache_es;
+	if (!es || lblk < es->es_lblk || lblk > ext4_es_end(es)) {
+		es = __es_tree_search(&tree->root, lblk);
+		if (!es || lblk < es->es_lblk)
+			goto out;
+		/* a racing lookup may store a different hint, that's fine */
+		tree->cache_es = es;
+	}
+	cex->ec_block = es->es_lblk;
+	cex->ec_len = es->es_len;
+	cex->ec_start = es->es_pblk;
+	cex->ec_type = es->es_type;
+	ret = es->es_type;
+out:
+	read_unlock(&ei->i_es_lock);
+	return ret;
+}
+
+/*
+ * ext4_es_insert_extent() - cache that [@lblk, @lblk + @len) is mapped
+ * to @pblk (EXT4_EXT_CACHE_EXTENT) or is a hole (EXT4_EXT_CACHE_GAP).
+ * Whatever was cached for the range before is replaced.
+ */
+void ext4_es_insert_extent(struct inode *inode, ext4_lblk_t lblk,
+			   __u32 len, ext4_fsblk_t pblk, int type)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct extent_status *es;
+	ext4_lblk_t end;
+
+	BUG_ON(len == 0);
+	end = ext4_es_range_end(lblk, len);
+
+	write_lock(&ei->i_es_lock);
+	__es_remove_extent(inode, lblk, end);
+	es = ext4_es_alloc_extent(inode, lblk, end - lblk + 1, pblk, type);
+	if (es) {
+		ext4_es_link(&ei->i_es_tree, es);
+		es = ext4_es_try_to_merge_left(inode, es);
+		ext4_es_try_to_merge_right(inode, es);
+		ei->i_es_tree.cache_es = es;
+	}
+	write_unlock(&ei->i_es_lock);
+
+	if (!es)
+		return;
+	spin_lock(&sbi->s_es_lru_lock);
+	list_move_tail(&ei->i_es_lru, &sbi->s_es_lru);
+	spin_unlock(&sbi->s_es_lru_lock);
+}
+
+/*
+ * ext4_es_remove_extent() - forget whatever is cached for
+ * [@lblk, @lblk + @len), e.g. because the extent tree changed there.
+ */
+void ext4_es_remove_extent(struct inode *inode, ext4_lblk_t lblk, __u32 len)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+
+	if (len == 0)
+		return;
+	write_lock(&ei->i_es_lock);
+	__es_remove_extent(inode, lblk, ext4_es_range_end(lblk, len));
+	write_unlock(&ei->i_es_lock);
+}
+
+/* Free all entries of the tree, called with i_es_lock held for writing */
+static void __es_remove_all(struct inode *inode)
+{
+	struct ext4_es_tree *tree = &EXT4_I(inode)->i_es_tree;
+	struct rb_node *node;
+
+	while ((node = rb_first(&tree->root)) != NULL)
+		ext4_es_free_extent(inode,
+				rb_entry(node, struct extent_status, rb_node));
+}
+
+/* Called from ext4_clear_inode() to free the cache of an evicted inode */
+void ext4_es_evict_inode(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+
+	write_lock(&ei->i_es_lock);
+	__es_remove_all(inode);
+	write_unlock(&ei->i_es_lock);
+
+	spin_lock(&sbi->s_es_lru_lock);
+	list_del_init(&ei->i_es_lru);
+	spin_unlock(&sbi->s_es_lru_lock);
+}
+
+/*
+ * Free the cached extents of the least recently extended inodes.  Inodes
+ * that are busy updating their cache are skipped.
+ */
+static int ext4_es_shrink(struct shrinker *shrink, int nr_to_scan,
+			  gfp_t gfp_mask)
+{
+	struct ext4_sb_info *sbi = container_of(shrink, struct ext4_sb_info,
+						s_es_shrinker);
+	struct ext4_inode_info *ei, *tmp;
+
+	if (nr_to_scan) {
+		spin_lock(&sbi->s_es_lru_lock);
+		list_for_each_entry_safe(ei, tmp, &sbi->s_es_lru, i_es_lru) {
+			if (nr_to_scan <= 0)
+				break;
+			if (!write_trylock(&ei->i_es_lock))
+				continue;
+			nr_to_scan -= ei->i_es_nr;
+			__es_remove_all(&ei->vfs_inode);
+			list_del_init(&ei->i_es_lru);
+			write_unlock(&ei->i_es_lock);
+		}
+		spin_unlock(&sbi->s_es_lru_lock);
+	}
+	return percpu_counter_read_positive(&sbi->s_extent_cache_cnt);
+}
+
+/*
+ * ext4_es_register_shrinker() - register the extent cache shrinker
+ * Called from ext4_fill_super() at the end of a successful mount.
+ */
+void ext4_es_register_shrinker(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	sbi->s_es_shrinker.shrink = ext4_es_shrink;
+	sbi->s_es_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sbi->s_es_shrinker);
+}
+
+void ext4_es_unregister_shrinker(struct super_block *sb)
+{
+	unregister_shrinker(&EXT4_SB(sb)->s_es_shrinker);
+}
@@ -0,0 +1,43 @@
+/*
+ *  linux/fs/ext4/extents_status.h
+ *
+ * Per inode cache of the extents and holes of an extent mapped file,
+ * see extents_status.c.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _EXT4_EXTENTS_STATUS_H
+#define _EXT4_EXTENTS_STATUS_H
+
+struct extent_status {
+	struct rb_node	rb_node;
+	ext4_lblk_t	es_lblk;	/* first logical block */
+	__u32		es_len;		/* must be 32bit to cache holes */
+	ext4_fsblk_t	es_pblk;	/* first physical block, 0 for holes */
+	__u32		es_type;	/* EXT4_EXT_CACHE_GAP/EXTENT */
+};
+
+struct ext4_es_tree {
+	struct rb_root	root;
+	struct extent_status *cache_es;	/* last entry found by a lookup */
+};
+
+extern int __init ext4_init_es(void);
+extern void ext4_exit_es(void);
+extern void ext4_es_init_tree(struct ext4_es_tree *tree);
+
+extern int ext4_es_lookup_extent(struct inode *inode, ext4_lblk_t lblk,
+				 struct ext4_ext_cache *cex);
+extern void ext4_es_insert_extent(struct inode *inode, ext4_lblk_t lblk,
+				  __u32 len, ext4_fsblk_t pblk, int type);
+extern void ext4_es_remove_extent(struct inode *inode, ext4_lblk_t lblk,
+				  __u32 len);
+extern void ext4_es_evict_inode(struct inode *inode);
+
+extern void ext4_es_register_shrinker(struct super_block *sb);
+extern void ext4_es_unregister_shrinker(struct super_block *sb);
+
+#endif /* _EXT4_EXTENTS_STATUS_H */
@@ -24,6 +24,7 @@
 #include <linux/fs.h>
 #include <linux/jbd2.h>
 #include <linux/mount.h>
+#include <linux/pagemap.h>
 #include <linux/path.h>
 #include <linux/quotaops.h>
 #include "ext4.h"
@@ -54,10 +55,110 @@ static int ext4_release_file(struct inode *inode, struct file *filp)
 	}
 	if (is_dx(inode) && filp->private_data)
 		ext4_htree_free_dir_info(filp->private_data);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+	if (ext4_snapshot_list(inode))
+		/* snapshot closed (unmounted?) - trim snapshots cache */
+		ext4_snapshot_cache_release(inode);
+#endif
 
 	return 0;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_READAHEAD
+/*
+ * ext4_snapshot_readahead_page() - collect the buffers of page @index of
+ * @file, whose old data has to be read before the page is partially
+ * written.  The buffers are added to @bhs with a reference held.
+ * Returns the no. of buffers added.
+ */
+static int ext4_snapshot_readahead_page(struct file *file, pgoff_t index,
+		struct buffer_head **bhs)
+{
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	struct buffer_head *bh, *head;
+	struct page *page;
+	sector_t block;
+	int nr = 0;
+
+	page = find_or_create_page(mapping, index, mapping_gfp_mask(mapping));
+	if (!page)
+		return 0;
+	if (PageUptodate(page))
+		goto out;
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, inode->i_sb->s_blocksize, 0);
+	block = (sector_t)index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_uptodate(bh))
+			continue;
+		/* holes and new blocks have no old data to read */
+		if (!buffer_mapped(bh) &&
+		    (ext4_get_block(inode, block, bh, 0) || !buffer_mapped(bh)))
+			continue;
+		if (buffer_unwritten(bh) || buffer_delay(bh))
+			continue;
+		get_bh(bh);
+		bhs[nr++] = bh;
+	} while (block++, (bh = bh->b_this_page) != head);
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	return nr;
+}
+
+/*
+ * ext4_snapshot_write_readahead() - read ahead partially written pages
+ * @file:	file being written
+ * @pos:	start of write range, as passed to ext4_file_write()
+ * @count:	length of write range
+ *
+ * The old data of a partially written block has to be read before the
+ * block is moved to snapshot.  Before the first page is copied, submit
+ * the reads of all the not uptodate buffers of the partially written
+ * first and last pages together, and don't wait for them.  write_begin()
+ * then finds the buffers uptodate or under I/O, instead of reading them
+ * one synchronous buffer at a time.
+ */
+static void ext4_snapshot_write_readahead(struct file *file,
+		loff_t pos, size_t count)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct buffer_head *bhs[2 * MAX_BUF_PER_PAGE];
+	loff_t isize = i_size_read(inode);
+	loff_t end;
+	pgoff_t first, last;
+	int nr = 0;
+
+	if (file->f_flags & O_APPEND)
+		/* where generic_write_checks() will place the write */
+		pos = isize;
+	end = pos + count;
+	/* the page that holds EOF may still have old data below it */
+	if (!count || (pos & PAGE_CACHE_MASK) >= isize ||
+			(file->f_flags & O_DIRECT))
+		return;
+	if (!ext4_snapshot_should_move_data(inode) ||
+			!ext4_snapshot_has_active(inode->i_sb))
+		return;
+
+	first = pos >> PAGE_CACHE_SHIFT;
+	last = (end - 1) >> PAGE_CACHE_SHIFT;
+	if (pos & ~PAGE_CACHE_MASK || (first == last &&
+				end & ~PAGE_CACHE_MASK && end < isize))
+		nr += ext4_snapshot_readahead_page(file, first, bhs + nr);
+	if (last != first && end & ~PAGE_CACHE_MASK && end < isize)
+		nr += ext4_snapshot_readahead_page(file, last, bhs + nr);
+	if (!nr)
+		return;
+	/* READA may be dropped on congestion, then write_begin() reads */
+	ll_rw_block(READA, nr, bhs);
+	while (nr--)
+		put_bh(bhs[nr]);
+}
+
+#endif
 static ssize_t
 ext4_file_write(struct kiocb *iocb, const struct iovec *iov,
 		unsigned long nr_segs, loff_t pos)
@@ -83,6 +184,10 @@ ext4_file_write(struct kiocb *iocb, const struct iovec *iov,
 		}
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_READAHEAD
+	ext4_snapshot_write_readahead(iocb->ki_filp, pos,
+				      iov_length(iov, nr_segs));
+#endif
 	return generic_file_aio_write(iocb, iov, nr_segs, pos);
 }
 
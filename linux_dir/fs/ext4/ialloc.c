@@ -46,22 +46,16 @@
  */
 
 /*
- * To avoid calling the atomic setbit hundreds or thousands of times, we only
- * need to use it within a single byte (to ensure we get endianness right).
- * We can use memset for the rest of the bitmap as there are no other users.
+ * Mark the bits past the end of the group in use, whole bytes at a time
+ * (see ext4_set_bits()).
  */
 void ext4_mark_bitmap_end(int start_bit, int end_bit, char *bitmap)
 {
-	int i;
-
 	if (start_bit >= end_bit)
 		return;
 
 	ext4_debug("mark end bits +%d through +%d used\n", start_bit, end_bit);
-	for (i = start_bit; i < ((start_bit + 7) & ~7UL); i++)
-		ext4_set_bit(i, bitmap);
-	if (i < end_bit)
-		memset(bitmap + (i >> 3), 0xff, (end_bit - i) >> 3);
+	ext4_set_bits(bitmap, start_bit, end_bit - start_bit);
 }
 
 /* Initializes an uninitialized inode bitmap */
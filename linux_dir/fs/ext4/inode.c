@@ -1089,9 +1089,15 @@ static int ext4_ind_map_blocks(handle_t *handle, struct inode *inode,
 	int depth;
 	int count = 0;
 	ext4_fsblk_t first_block = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+	int move_count = 0;
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ
 	int read_through = 0;
 	struct inode *prev_snapshot;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	ktime_t read_start = ktime_set(0, 0);
+#endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
 retry:
@@ -1110,6 +1116,13 @@ retry:
 		err = read_through;
 		goto out;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	/* time the whole read through, including hops to newer snapshots */
+	if (read_through > 0 && !ktime_to_ns(read_start)) {
+		snapshot_stat_inc(inode->i_sb, SNAPSTAT_READ_THROUGH);
+		read_start = ktime_get();
+	}
+#endif
 	err = -EIO;
 #endif
 
@@ -1127,10 +1140,29 @@ retry:
 	if (!partial && flags &&
 			ext4_snapshot_should_move_data(inode)) {
 		first_block = le32_to_cpu(chain[depth - 1].key);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+		/* count the physically contiguous mapped blocks */
+		count = 1;
+		while (count < map->m_len && count <= blocks_to_boundary &&
+		       le32_to_cpu(*(chain[depth-1].p + count)) ==
+		       first_block + count)
+			count++;
+		/* should move a run of data blocks to snapshot? */
+		err = ext4_snapshot_move(handle, inode, first_block, count, 0);
+		count = 0;
+		if (err > 0) {
+			/* replace the whole run with new blocks at once */
+			move_count = err;
+			blocks_to_boundary = move_count - 1;
+		} else if (ext4_snapshot_has_active(inode->i_sb))
+			/* the next blocks may still need to be moved */
+			blocks_to_boundary = 0;
+#else
 		blocks_to_boundary = 0;
 		/* should move 1 data block to snapshot? */
 		err = ext4_snapshot_get_move_access(handle, inode,
 				first_block, 0);
+#endif
 		if (err)
 			/* do not map found block */
 			partial = chain + depth - 1;
@@ -1176,6 +1208,8 @@ retry:
 				partial--;
 			}
 			/* repeat the same routine with prev snapshot */
+			snapshot_stat_inc(inode->i_sb,
+					  SNAPSTAT_READ_THROUGH_HOPS);
 			inode = prev_snapshot;
 			goto retry;
 		}
@@ -1213,6 +1247,18 @@ retry:
 	 */
 	count = ext4_blks_to_allocate(partial, indirect_blks,
 				      map->m_len, blocks_to_boundary);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+	if (move_count)
+		/* allocate new blocks for the whole run of moved blocks */
+		count = move_count;
+	/*
+	 * Only snapshot files interpret @flags as a snapshot map command.
+	 * Other callers may pass EXT4_GET_BLOCKS_DELALLOC_RESERVE, which
+	 * must not be mistaken for SNAPMAP_MOVE by the helpers below.
+	 */
+	if (!ext4_snapshot_file(inode))
+		flags &= EXT4_GET_BLOCKS_CREATE;
+#endif
 	/*
 	 * Block out ext4_truncate while we alter the tree
 	 */
@@ -1251,6 +1297,25 @@ retry:
 			/* prevent zero out of page in block_write_begin() */
 			SetPageUptodate(bh_result->b_page);
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+		/* move the run of old blocks to snapshot */
+		ret = ext4_snapshot_move(handle, inode,
+				le32_to_cpu(*(partial->p)), count, 1);
+		if (ret < 1) {
+			/* failed to move to snapshot - free new blocks */
+			ext4_free_blocks(handle, inode, NULL,
+				le32_to_cpu(partial->key), count, 0);
+			err = ret ? : -EIO;
+			goto out_mutex;
+		}
+		if (ret < count) {
+			/* free the new blocks that replace unmoved blocks */
+			ext4_free_blocks(handle, inode, NULL,
+				le32_to_cpu(partial->key) + ret,
+				count - ret, 0);
+			count = ret;
+		}
+#else
 		/* move old block to snapshot */
 		ret = ext4_snapshot_get_move_access(handle, inode,
 				le32_to_cpu(*(partial->p)), 1);
@@ -1261,6 +1326,7 @@ retry:
 			err = ret ? : -EIO;
 			goto out_mutex;
 		}
+#endif
 		/* block moved to snapshot - continue to splice new block */
 		err = 0;
 	}
@@ -1303,6 +1369,17 @@ cleanup:
 		partial--;
 	}
 out:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	if (ktime_to_ns(read_start)) {
+		s64 usec = ktime_us_delta(ktime_get(), read_start);
+
+		snapshot_stat_add(inode->i_sb, SNAPSTAT_READ_THROUGH_USEC, usec);
+		snapshot_stat_max(inode->i_sb, SNAPSTAT_READ_THROUGH_MAX_USEC,
+				  usec);
+	}
+#endif
+#endif
 	return err;
 }
 
@@ -1313,6 +1390,10 @@ qsize_t *ext4_get_reserved_space(struct inode *inode)
 }
 #endif
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+static void ext4_da_release_space(struct inode *inode, int to_free);
+
+#endif
 /*
  * Calculate the number of metadata blocks need to reserve
  * to allocate a new block at @lblocks for non extent file based file
@@ -1554,6 +1635,14 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 	 * with buffer head unmapped.
 	 */
 	if (retval > 0 && map->m_flags & EXT4_MAP_MAPPED)
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+		/*
+		 * Mapped blocks only reach here with DELALLOC_RESERVE when
+		 * ext4_da_get_block_move() deferred their move-on-write.
+		 */
+		if (!(flags & EXT4_GET_BLOCKS_DELALLOC_RESERVE) ||
+				!ext4_snapshot_should_move_data(inode))
+#endif
 		return retval;
 
 	/*
@@ -1608,6 +1697,17 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 		 * support fallocate for non extent files. So we can update
 		 * reserve space here.
 		 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+		if ((retval > 0) &&
+			(flags & EXT4_GET_BLOCKS_DELALLOC_RESERVE) &&
+			!(map->m_flags & EXT4_MAP_NEW))
+			/*
+			 * Block reserved for move-on-write was found mapped
+			 * and did not need to be moved to snapshot after all.
+			 */
+			ext4_da_release_space(inode, retval);
+		else
+#endif
 		if ((retval > 0) &&
 			(flags & EXT4_GET_BLOCKS_DELALLOC_RESERVE))
 			ext4_da_update_reserve_space(inode, retval, 1);
@@ -2327,10 +2427,8 @@ static int mpage_da_submit_io(struct mpage_da_data *mpd,
 	struct buffer_head *bh, *page_bufs = NULL;
 	int journal_data = ext4_should_journal_data(inode);
 	sector_t pblock = 0, cur_logical = 0;
-	struct ext4_io_submit io_submit;
 
 	BUG_ON(mpd->next_page <= mpd->first_page);
-	memset(&io_submit, 0, sizeof(io_submit));
 	/*
 	 * We need to start from the first_page to the next_page - 1
 	 * to make sure we also write the mapped dirty buffer_heads.
@@ -2430,8 +2528,8 @@ static int mpage_da_submit_io(struct mpage_da_data *mpd,
 			if (unlikely(journal_data && PageChecked(page)))
 				err = __ext4_journalled_writepage(page, len);
 			else
-				err = ext4_bio_write_page(&io_submit, page,
-							  len, mpd->wbc);
+				err = ext4_bio_write_page(&mpd->io_submit,
+							  page, len, mpd->wbc);
 
 			if (!err)
 				mpd->pages_written++;
@@ -2444,7 +2542,11 @@ static int mpage_da_submit_io(struct mpage_da_data *mpd,
 		}
 		pagevec_release(&pvec);
 	}
-	ext4_io_submit(&io_submit);
+	/*
+	 * The bio is left open for the next extent mapped under the same
+	 * handle, ext4_da_writepages() submits it once the handle is
+	 * stopped.
+	 */
 	return ret;
 }
 
@@ -2816,6 +2918,56 @@ static int __mpage_da_writepage(struct page *page,
 	return 0;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+/*
+ * ext4_da_get_block_move() - defer move-on-write of a mapped data block
+ * @inode:	owner of @pblk
+ * @iblock:	logical block number
+ * @pblk:	mapped physical block number
+ * @bh:		buffer head to map
+ *
+ * Called from ext4_da_get_block_prep() for an overwritten data block.
+ * If the block needs to be moved to snapshot, reserve space for the new
+ * block and mark the buffer delayed.  mpage_da_map_and_submit() collects
+ * contiguous delayed buffers into one extent, so the whole run of old
+ * blocks is moved to snapshot by a single call to ext4_map_blocks().
+ * On partial page write, the read of the old block data is started here,
+ * because __block_write_begin() doesn't read delayed buffers.
+ *
+ * Return values:
+ * = 1 - buffer was marked for delayed move-on-write
+ * = 0 - @pblk may be overwritten in-place
+ * < 0 - error
+ */
+static int ext4_da_get_block_move(struct inode *inode, sector_t iblock,
+		ext4_fsblk_t pblk, struct buffer_head *bh)
+{
+	handle_t *handle = ext4_journal_current_handle();
+	int ret;
+
+	if (!handle || !ext4_snapshot_should_move_data(inode) ||
+			!ext4_snapshot_has_active(inode->i_sb))
+		return 0;
+
+	/* should move data block to snapshot? */
+	ret = ext4_snapshot_get_move_access(handle, inode, pblk, 0);
+	if (ret <= 0)
+		return ret;
+
+	/* reserve space for the block that will replace the moved block */
+	ret = ext4_da_reserve_space(inode, iblock);
+	if (ret)
+		return ret;
+
+	map_bh(bh, inode->i_sb, pblk);
+	if (buffer_partial_write(bh) && !buffer_uptodate(bh))
+		/* start reading old block data, ext4_da_write_begin() waits */
+		ll_rw_block(READ, 1, &bh);
+	set_buffer_delay(bh);
+	return 1;
+}
+
+#endif
 /*
  * This is a special get_blocks_t callback which is used by
  * ext4_da_write_begin().  It will either return mapped block or
@@ -2869,6 +3021,15 @@ static int ext4_da_get_block_prep(struct inode *inode, sector_t iblock,
 		return 0;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+	if (!(map.m_flags & EXT4_MAP_UNWRITTEN)) {
+		/* defer move-on-write of old block to writeback */
+		ret = ext4_da_get_block_move(inode, iblock, map.m_pblk, bh);
+		if (ret)
+			return ret < 0 ? ret : 0;
+	}
+
+#endif
 	map_bh(bh, inode->i_sb, map.m_pblk);
 	bh->b_state = (bh->b_state & ~EXT4_MAP_FLAGS) | map.m_flags;
 
@@ -3313,6 +3474,7 @@ static int ext4_da_writepages(struct address_space *mapping,
 
 	mpd.wbc = wbc;
 	mpd.inode = mapping->host;
+	memset(&mpd.io_submit, 0, sizeof(mpd.io_submit));
 
 	pages_skipped = wbc->pages_skipped;
 
@@ -3372,6 +3534,12 @@ retry:
 		wbc->nr_to_write -= mpd.pages_written;
 
 		ext4_journal_stop(handle);
+		/*
+		 * Submit the bio built under this handle.  It must not be
+		 * held open while waiting for a new handle, as a commit may
+		 * wait on the writeback of its pages.
+		 */
+		ext4_io_submit(&mpd.io_submit);
 
 		if ((mpd.retval == -ENOSPC) && sbi->s_journal) {
 			/* commit the transaction which would
@@ -3470,6 +3638,9 @@ static int ext4_da_write_begin(struct file *file, struct address_space *mapping,
 	pgoff_t index;
 	struct inode *inode = mapping->host;
 	handle_t *handle;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+	struct buffer_head *bh = NULL;
+#endif
 
 	index = pos >> PAGE_CACHE_SHIFT;
 
@@ -3503,8 +3674,55 @@ retry:
 		goto out;
 	}
 	*pagep = page;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+	/*
+	 * A delayed move-on-write buffer may outlive the snapshot that was
+	 * active when it was dirtied.  ext4_map_blocks() checks the block
+	 * again against the active snapshot on writeback and releases the
+	 * reservation if it no longer needs to be moved.
+	 */
+	if (ext4_snapshot_should_move_data(inode) &&
+			ext4_snapshot_has_active(inode->i_sb)) {
+		if (!page_has_buffers(page))
+			create_empty_buffers(page, inode->i_sb->s_blocksize, 0);
+		/* snapshots only work when blocksize == pagesize */
+		bh = page_buffers(page);
+		if (len < PAGE_CACHE_SIZE)
+			/* read block before moving it to snapshot */
+			set_buffer_partial_write(bh);
+		else
+			clear_buffer_partial_write(bh);
+		/*
+		 * make sure that get_block() is called even if the buffer is
+		 * mapped, but not if it is already waiting for a delayed
+		 * move-on-write.
+		 */
+		if (buffer_mapped(bh) && !buffer_delay(bh))
+			clear_buffer_mapped(bh);
+	}
+#endif
 
 	ret = __block_write_begin(page, pos, len, ext4_da_get_block_prep);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_BATCH
+	if (bh && buffer_delay(bh) && buffer_partial_write(bh)) {
+		/* wait for the old block data read by ext4_da_get_block_move() */
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh)) {
+			clear_buffer_delay(bh);
+			clear_buffer_mapped(bh);
+			ext4_da_release_space(inode, 1);
+			if (!ret)
+				ret = -EIO;
+		}
+	}
+	/*
+	 * buffer_partial_write() is only used by this function to pass the
+	 * information to ext4_da_get_block_prep() and should be cleared on
+	 * exit.
+	 */
+	if (bh)
+		clear_buffer_partial_write(bh);
+#endif
 	if (ret < 0) {
 		unlock_page(page);
 		ext4_journal_stop(handle);
@@ -4146,9 +4364,6 @@ static void ext4_end_io_dio(struct kiocb *iocb, loff_t offset,
 			    bool is_async)
 {
         ext4_io_end_t *io_end = iocb->private;
-	struct workqueue_struct *wq;
-	unsigned long flags;
-	struct ext4_inode_info *ei;
 
 	/* if not async direct IO or dio with 0 bytes write, just return */
 	if (!io_end || !size)
@@ -4175,25 +4390,14 @@ out:
 		io_end->iocb = iocb;
 		io_end->result = ret;
 	}
-	wq = EXT4_SB(io_end->inode->i_sb)->dio_unwritten_wq;
-
-	/* Add the io_end to per-inode completed aio dio list*/
-	ei = EXT4_I(io_end->inode);
-	spin_lock_irqsave(&ei->i_completed_io_lock, flags);
-	list_add_tail(&io_end->list, &ei->i_completed_io_list);
-	spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
-
 	/* queue the work to convert unwritten extents to written */
-	queue_work(wq, &io_end->work);
+	ext4_add_complete_io(io_end);
 	iocb->private = NULL;
 }
 
 static void ext4_end_io_buffer_write(struct buffer_head *bh, int uptodate)
 {
 	ext4_io_end_t *io_end = bh->b_private;
-	struct workqueue_struct *wq;
-	struct inode *inode;
-	unsigned long flags;
 
 	if (!test_clear_buffer_uninit(bh) || !io_end)
 		goto out;
@@ -4206,16 +4410,8 @@ static void ext4_end_io_buffer_write(struct buffer_head *bh, int uptodate)
 	}
 
 	io_end->flag = EXT4_IO_END_UNWRITTEN;
-	inode = io_end->inode;
-
-	/* Add the io_end to per-inode completed io list*/
-	spin_lock_irqsave(&EXT4_I(inode)->i_completed_io_lock, flags);
-	list_add_tail(&io_end->list, &EXT4_I(inode)->i_completed_io_list);
-	spin_unlock_irqrestore(&EXT4_I(inode)->i_completed_io_lock, flags);
-
-	wq = EXT4_SB(inode->i_sb)->dio_unwritten_wq;
 	/* queue the work to convert unwritten extents to written */
-	queue_work(wq, &io_end->work);
+	ext4_add_complete_io(io_end);
 out:
 	bh->b_private = NULL;
 	bh->b_end_io = NULL;
@@ -4477,9 +4673,34 @@ static int ext4_no_writepage(struct page *page,
  * some snapshot data pages are written to disk by sync_dirty_buffer(), namely
  * the snapshot COW bitmaps and a few initial blocks copied on snapshot_take().
  */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+/*
+ * Packed snapshot blocks are not mapped in the snapshot file, so they are
+ * unpacked by page before falling back to normal (or read through) readpage.
+ */
+static int ext4_snapfile_readpage(struct file *file, struct page *page)
+{
+	int err = ext4_snapshot_pack_readpage(page->mapping->host, page);
+
+	if (!err)
+		return mpage_readpage(page, ext4_get_block);
+	if (err > 0) {
+		SetPageUptodate(page);
+		err = 0;
+	} else
+		SetPageError(page);
+	unlock_page(page);
+	return err;
+}
+
+#endif
 static const struct address_space_operations ext4_snapfile_aops = {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	.readpage		= ext4_snapfile_readpage,
+#else
 	.readpage		= ext4_readpage,
 	.readpages		= ext4_readpages,
+#endif
 	.writepage		= ext4_no_writepage,
 	.bmap			= ext4_bmap,
 	.invalidatepage		= ext4_invalidatepage,
@@ -4518,10 +4739,24 @@ void ext4_set_aops(struct inode *inode)
  */
 int ext4_block_truncate_page(handle_t *handle,
 		struct address_space *mapping, loff_t from)
+{
+	unsigned blocksize = mapping->host->i_sb->s_blocksize;
+	unsigned length = blocksize - (from & (blocksize - 1));
+
+	return ext4_block_zero_page_range(handle, mapping, from, length);
+}
+
+/*
+ * ext4_block_zero_page_range() zeroes out a mapping of `length' bytes
+ * from file offset `from' through the page cache.  The range must not
+ * cross a block boundary; holes in the range are left alone.
+ */
+int ext4_block_zero_page_range(handle_t *handle,
+		struct address_space *mapping, loff_t from, loff_t length)
 {
 	ext4_fsblk_t index = from >> PAGE_CACHE_SHIFT;
 	unsigned offset = from & (PAGE_CACHE_SIZE-1);
-	unsigned blocksize, length, pos;
+	unsigned blocksize, max, pos;
 	ext4_lblk_t iblock;
 	struct inode *inode = mapping->host;
 	struct buffer_head *bh;
@@ -4534,7 +4769,9 @@ int ext4_block_truncate_page(handle_t *handle,
 		return -EINVAL;
 
 	blocksize = inode->i_sb->s_blocksize;
-	length = blocksize - (offset & (blocksize - 1));
+	max = blocksize - (offset & (blocksize - 1));
+	if (length > max)
+		length = max;
 	iblock = index << (PAGE_CACHE_SHIFT - inode->i_sb->s_blocksize_bits);
 
 	if (!page_has_buffers(page))
@@ -4601,7 +4838,7 @@ int ext4_block_truncate_page(handle_t *handle,
 
 	zero_user(page, offset, length);
 
-	BUFFER_TRACE(bh, "zeroed end of block");
+	BUFFER_TRACE(bh, "zeroed block range");
 
 	err = 0;
 	if (ext4_should_journal_data(inode)) {
@@ -5516,7 +5753,7 @@ struct inode *ext4_iget(struct super_block *sb, unsigned long ino)
 	if (EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_64BIT))
 		ei->i_file_acl |=
 			((__u64)le16_to_cpu(raw_inode->i_file_acl_high)) << 32;
-	inode->i_size = ext4_isize(raw_inode);
+	inode->i_size = ext4_isize(sb, raw_inode);
 	ei->i_disksize = inode->i_size;
 #ifdef CONFIG_QUOTA
 	ei->i_reserved_quota = 0;
@@ -17,6 +17,7 @@
 #include <linux/compat.h>
 #include <linux/mount.h>
 #include <linux/file.h>
+#include <linux/falloc.h>
 #include <asm/uaccess.h>
 #include <linux/smp_lock.h>
 #include "ext4_jbd2.h"
@@ -212,6 +213,9 @@ flags_out:
 			ret = ext4_snapshot_update(inode->i_sb, cleanup, 0);
 			if (!err)
 				err = ret;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+			ext4_snapshot_cache_limit(inode->i_sb);
+#endif
 		}
 
 		if (snapflags)
@@ -356,6 +360,39 @@ mext_out:
 		return err;
 	}
 
+	case EXT4_IOC_ZERO_RANGE: {
+		struct ext4_zero_range zr;
+		int err;
+
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+
+		if (copy_from_user(&zr,
+			(struct ext4_zero_range __user *)arg, sizeof(zr)))
+			return -EFAULT;
+
+		if (zr.reserved || (zr.mode & ~FALLOC_FL_KEEP_SIZE))
+			return -EOPNOTSUPP;
+		if ((loff_t)zr.offset < 0 || (loff_t)zr.len <= 0)
+			return -EINVAL;
+		if (zr.offset + zr.len > inode->i_sb->s_maxbytes ||
+		    zr.offset + zr.len < zr.offset)
+			return -EFBIG;
+		if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
+			return -EPERM;
+
+		err = mnt_want_write(filp->f_path.mnt);
+		if (err)
+			return err;
+		err = ext4_fallocate(inode, EXT4_FALLOC_FL_ZERO_RANGE | zr.mode,
+				     zr.offset, zr.len);
+		mnt_drop_write(filp->f_path.mnt);
+		return err;
+	}
+
+	case EXT4_IOC_PRECACHE_EXTENTS:
+		return ext4_ext_precache(inode);
+
 	case EXT4_IOC_GROUP_ADD: {
 		struct ext4_new_group_data input;
 		struct super_block *sb = inode->i_sb;
@@ -546,6 +583,8 @@ long ext4_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return err;
 	}
 	case EXT4_IOC_MOVE_EXT:
+	case EXT4_IOC_ZERO_RANGE:
+	case EXT4_IOC_PRECACHE_EXTENTS:
 	case EXT4_IOC_DEBUG_DELALLOC:
 		break;
 	default:
@@ -24,6 +24,8 @@
 #include "mballoc.h"
 #include <linux/debugfs.h>
 #include <linux/slab.h>
+#include <linux/list_sort.h>
+#include <linux/delay.h>
 #include <trace/events/ext4.h>
 
 /*
@@ -91,6 +93,11 @@
  * The reason for having a per cpu locality group is to reduce the contention
  * between CPUs. It is possible to get scheduled at this point.
  *
+ * The locality group also holds the per cpu goal of stream allocation (for
+ * large files), so that concurrent streams don't contend on a single goal
+ * and each stream is laid out contiguously.  On mount, the stream goals of
+ * the cpus are spread over the flex groups.
+ *
  * The locality group prealloc space is used looking at whether we have
  * enough free space (pa_free) withing the prealloc space.
  *
@@ -351,6 +358,8 @@ static void ext4_mb_generate_from_pa(struct super_block *sb, void *bitmap,
 static void ext4_mb_generate_from_freelist(struct super_block *sb, void *bitmap,
 						ext4_group_t group);
 static void release_blocks_on_commit(journal_t *journal, transaction_t *txn);
+static void ext4_mb_discard_committed(struct super_block *sb);
+static void ext4_mb_discard_work(struct work_struct *work);
 
 static inline void *mb_correct_addr_and_bit(int *bit, void *addr)
 {
@@ -667,6 +676,30 @@ static void ext4_mb_mark_free_simple(struct super_block *sb,
 	}
 }
 
+/*
+ * Initialized groups are kept on lists indexed by the order of their
+ * largest free extent and on lists indexed by the order of their average
+ * free fragment size.  cr 0 and cr 1 allocations pick a group from these
+ * lists (see ext4_mb_choose_group()), instead of scanning all groups.
+ * The lists are updated under the group lock, when the buddy changes.
+ */
+static void
+mb_move_group_list(struct ext4_group_info *grp, struct list_head *node,
+		struct list_head *lists, spinlock_t *locks,
+		int old_order, int new_order)
+{
+	if (old_order >= 0) {
+		spin_lock(&locks[old_order]);
+		list_del_init(node);
+		spin_unlock(&locks[old_order]);
+	}
+	if (new_order >= 0) {
+		spin_lock(&locks[new_order]);
+		list_add_tail(node, &lists[new_order]);
+		spin_unlock(&locks[new_order]);
+	}
+}
+
 /*
  * Cache the order of the largest free extent we have available in this block
  * group.
@@ -674,18 +707,45 @@ static void ext4_mb_mark_free_simple(struct super_block *sb,
 static void
 mb_set_largest_free_order(struct super_block *sb, struct ext4_group_info *grp)
 {
-	int i;
-	int bits;
-
-	grp->bb_largest_free_order = -1; /* uninit */
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int i, order = -1; /* uninit */
 
-	bits = sb->s_blocksize_bits + 1;
-	for (i = bits; i >= 0; i--) {
+	for (i = MB_NUM_ORDERS(sb) - 1; i >= 0; i--) {
 		if (grp->bb_counters[i] > 0) {
-			grp->bb_largest_free_order = i;
+			order = i;
 			break;
 		}
 	}
+	if (order == grp->bb_largest_free_order)
+		return;
+
+	mb_move_group_list(grp, &grp->bb_largest_free_order_node,
+			   sbi->s_mb_largest_free_orders,
+			   sbi->s_mb_largest_free_orders_locks,
+			   grp->bb_largest_free_order, order);
+	grp->bb_largest_free_order = order;
+}
+
+/*
+ * Cache the order of the average free fragment size of this block group.
+ */
+static void
+mb_set_avg_fragment_size(struct super_block *sb, struct ext4_group_info *grp)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int order = -1; /* no free space */
+
+	if (grp->bb_fragments && grp->bb_free)
+		order = min_t(int, fls(grp->bb_free / grp->bb_fragments) - 1,
+			      MB_NUM_ORDERS(sb) - 1);
+	if (order == grp->bb_avg_fragment_size_order)
+		return;
+
+	mb_move_group_list(grp, &grp->bb_avg_fragment_size_node,
+			   sbi->s_mb_avg_fragment_size,
+			   sbi->s_mb_avg_fragment_size_locks,
+			   grp->bb_avg_fragment_size_order, order);
+	grp->bb_avg_fragment_size_order = order;
 }
 
 static noinline_for_stack
@@ -731,6 +791,7 @@ void ext4_mb_generate_buddy(struct super_block *sb,
 		grp->bb_free = free;
 	}
 	mb_set_largest_free_order(sb, grp);
+	mb_set_avg_fragment_size(sb, grp);
 
 	clear_bit(EXT4_GROUP_INFO_NEED_INIT_BIT, &(grp->bb_state));
 
@@ -1124,6 +1185,85 @@ err:
 	return ret;
 }
 
+/*
+ * Is @group worth prefetching? Only groups whose buddy still has to be
+ * built and which have free blocks the allocator can actually use.
+ */
+static int ext4_mb_prefetch_wanted(struct super_block *sb, ext4_group_t group,
+				   struct ext4_group_desc *gdp)
+{
+	struct ext4_group_info *grp = ext4_get_group_info(sb, group);
+
+	if (!EXT4_MB_GRP_NEED_INIT(grp))
+		return 0;
+	return ext4_free_blks_count(sb, gdp) != 0;
+}
+
+/*
+ * Start readahead of the block bitmaps of the next @nr groups from @group
+ * on, skipping full groups and groups whose bitmap is built in memory.
+ * The reads are submitted in batches and not waited for. Returns the
+ * first group not looked at.
+ */
+ext4_group_t ext4_mb_prefetch(struct super_block *sb, ext4_group_t group,
+			      unsigned int nr)
+{
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	struct buffer_head *bhs[MB_PREFETCH_BATCH];
+	struct ext4_group_desc *gdp;
+	struct buffer_head *bh;
+	int i, n = 0;
+
+	for (; nr && group < ngroups; group++, nr--) {
+		gdp = ext4_get_group_desc(sb, group, NULL);
+		if (!gdp)
+			break;
+		if (!ext4_mb_prefetch_wanted(sb, group, gdp) ||
+		    (gdp->bg_flags & cpu_to_le16(EXT4_BG_BLOCK_UNINIT)))
+			continue;
+		bh = sb_getblk(sb, ext4_block_bitmap(sb, gdp));
+		if (!bh)
+			continue;
+		if (buffer_uptodate(bh) || buffer_locked(bh)) {
+			brelse(bh);
+			continue;
+		}
+		bhs[n++] = bh;
+		if (n == MB_PREFETCH_BATCH) {
+			ll_rw_block(READA, n, bhs);
+			for (i = 0; i < n; i++)
+				brelse(bhs[i]);
+			n = 0;
+		}
+	}
+	if (n) {
+		ll_rw_block(READA, n, bhs);
+		for (i = 0; i < n; i++)
+			brelse(bhs[i]);
+	}
+	return group;
+}
+
+/*
+ * Build the buddy cache of the groups prefetched by ext4_mb_prefetch(),
+ * so the allocator finds them initialized and doesn't wait on the
+ * bitmap reads itself.
+ */
+void ext4_mb_prefetch_fini(struct super_block *sb, ext4_group_t group,
+			   unsigned int nr)
+{
+	struct ext4_group_desc *gdp;
+
+	for (; nr; group++, nr--) {
+		gdp = ext4_get_group_desc(sb, group, NULL);
+		if (!gdp)
+			break;
+		if (ext4_mb_prefetch_wanted(sb, group, gdp) &&
+		    ext4_mb_init_group(sb, group))
+			break;
+	}
+}
+
 /*
  * Locking note:  This routine calls ext4_mb_init_cache(), which takes the
  * block group lock of all groups for this page; do not hold the BG lock when
@@ -1308,42 +1448,6 @@ static int mb_find_order_for_block(struct ext4_buddy *e4b, int block)
 	return 0;
 }
 
-static void mb_clear_bits(void *bm, int cur, int len)
-{
-	__u32 *addr;
-
-	len = cur + len;
-	while (cur < len) {
-		if ((cur & 31) == 0 && (len - cur) >= 32) {
-			/* fast path: clear whole word at once */
-			addr = bm + (cur >> 3);
-			*addr = 0;
-			cur += 32;
-			continue;
-		}
-		mb_clear_bit(cur, bm);
-		cur++;
-	}
-}
-
-static void mb_set_bits(void *bm, int cur, int len)
-{
-	__u32 *addr;
-
-	len = cur + len;
-	while (cur < len) {
-		if ((cur & 31) == 0 && (len - cur) >= 32) {
-			/* fast path: set whole word at once */
-			addr = bm + (cur >> 3);
-			*addr = 0xffffffff;
-			cur += 32;
-			continue;
-		}
-		mb_set_bit(cur, bm);
-		cur++;
-	}
-}
-
 static void mb_free_blocks(struct inode *inode, struct ext4_buddy *e4b,
 			  int first, int count)
 {
@@ -1425,6 +1529,7 @@ static void mb_free_blocks(struct inode *inode, struct ext4_buddy *e4b,
 		} while (1);
 	}
 	mb_set_largest_free_order(sb, e4b->bd_info);
+	mb_set_avg_fragment_size(sb, e4b->bd_info);
 	mb_check_buddy(e4b);
 }
 
@@ -1554,8 +1659,9 @@ static int mb_mark_used(struct ext4_buddy *e4b, struct ext4_free_extent *ex)
 		e4b->bd_info->bb_counters[ord]++;
 	}
 	mb_set_largest_free_order(e4b->bd_sb, e4b->bd_info);
+	mb_set_avg_fragment_size(e4b->bd_sb, e4b->bd_info);
 
-	mb_set_bits(EXT4_MB_BITMAP(e4b), ex->fe_start, len0);
+	ext4_set_bits(EXT4_MB_BITMAP(e4b), ex->fe_start, len0);
 	mb_check_buddy(e4b);
 
 	return ret;
@@ -1601,10 +1707,11 @@ static void ext4_mb_use_best_found(struct ext4_allocation_context *ac,
 	e4b->alloc_semp = NULL;
 	/* store last allocated for subsequent stream allocation */
 	if (ac->ac_flags & EXT4_MB_STREAM_ALLOC) {
-		spin_lock(&sbi->s_md_lock);
-		sbi->s_mb_last_group = ac->ac_f_ex.fe_group;
-		sbi->s_mb_last_start = ac->ac_f_ex.fe_start;
-		spin_unlock(&sbi->s_md_lock);
+		struct ext4_locality_group *lg;
+
+		lg = __this_cpu_ptr(sbi->s_locality_groups);
+		lg->lg_stream_group = ac->ac_f_ex.fe_group;
+		lg->lg_stream_start = ac->ac_f_ex.fe_start;
 	}
 }
 
@@ -2002,15 +2109,80 @@ static int ext4_mb_good_group(struct ext4_allocation_context *ac,
 	return 0;
 }
 
+/*
+ * ext4_mb_choose_group() - pick a group for criteria @cr from group lists
+ * cr 0 picks from the largest free order lists, starting at the request
+ * order.  cr 1 picks from the average fragment size lists, starting at
+ * the order of the goal length.
+ * The picked group is moved to the tail of its list, so that retries and
+ * concurrent allocations spread over the suitable groups.
+ * Returns @ngroups if there is no suitable initialized group.
+ */
+static ext4_group_t
+ext4_mb_choose_group(struct ext4_allocation_context *ac, int cr,
+		ext4_group_t ngroups)
+{
+	struct super_block *sb = ac->ac_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_group_info *grp;
+	struct list_head *lists, *pos;
+	spinlock_t *locks;
+	int order;
+
+	if (cr == 0) {
+		lists = sbi->s_mb_largest_free_orders;
+		locks = sbi->s_mb_largest_free_orders_locks;
+		order = ac->ac_2order;
+	} else {
+		lists = sbi->s_mb_avg_fragment_size;
+		locks = sbi->s_mb_avg_fragment_size_locks;
+		order = fls(ac->ac_g_ex.fe_len) - 1;
+	}
+
+	for (; order < MB_NUM_ORDERS(sb); order++) {
+		if (list_empty(&lists[order]))
+			continue;
+		spin_lock(&locks[order]);
+		list_for_each(pos, &lists[order]) {
+			if (cr == 0)
+				grp = list_entry(pos, struct ext4_group_info,
+						 bb_largest_free_order_node);
+			else
+				grp = list_entry(pos, struct ext4_group_info,
+						 bb_avg_fragment_size_node);
+			/* don't do I/O under the list lock */
+			if (grp->bb_group >= ngroups ||
+			    EXT4_MB_GRP_NEED_INIT(grp) ||
+			    !ext4_mb_good_group(ac, grp->bb_group, cr))
+				continue;
+			list_move_tail(pos, &lists[order]);
+			spin_unlock(&locks[order]);
+			return grp->bb_group;
+		}
+		spin_unlock(&locks[order]);
+	}
+	return ngroups;
+}
+
+static inline void ext4_mb_stat_latency(struct ext4_sb_info *sbi, s64 usec)
+{
+	int bucket = usec > 0 ? fls64(usec) : 0;
+
+	if (bucket >= MB_LATENCY_BUCKETS)
+		bucket = MB_LATENCY_BUCKETS - 1;
+	this_cpu_inc(sbi->s_mb_pcpu_stats->ms_latency[bucket]);
+}
+
 static noinline_for_stack int
 ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 {
 	ext4_group_t ngroups, group, i;
-	int cr;
+	int cr, optimize, uninit_only;
 	int err = 0;
 	struct ext4_sb_info *sbi;
 	struct super_block *sb;
 	struct ext4_buddy e4b;
+	ktime_t start = ktime_get();
 
 	sb = ac->ac_sb;
 	sbi = EXT4_SB(sb);
@@ -2049,13 +2221,15 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 			ac->ac_2order = i - 1;
 	}
 
-	/* if stream allocation is enabled, use global goal */
+	/* if stream allocation is enabled, use per cpu goal */
 	if (ac->ac_flags & EXT4_MB_STREAM_ALLOC) {
-		/* TBD: may be hot point */
-		spin_lock(&sbi->s_md_lock);
-		ac->ac_g_ex.fe_group = sbi->s_mb_last_group;
-		ac->ac_g_ex.fe_start = sbi->s_mb_last_start;
-		spin_unlock(&sbi->s_md_lock);
+		struct ext4_locality_group *lg;
+
+		lg = __this_cpu_ptr(sbi->s_locality_groups);
+		if (lg->lg_stream_group < ngroups) {
+			ac->ac_g_ex.fe_group = lg->lg_stream_group;
+			ac->ac_g_ex.fe_start = lg->lg_stream_start;
+		}
 	}
 
 	/* Let's just scan groups to find more-less suitable blocks */
@@ -2072,10 +2246,29 @@ repeat:
 		 * from the goal value specified
 		 */
 		group = ac->ac_g_ex.fe_group;
+		/* try the goal group first, then pick from group lists */
+		optimize = sbi->s_mb_optimize_scan && cr < 2;
+		uninit_only = 0;
 
 		for (i = 0; i < ngroups; group++, i++) {
+			if (optimize && i > 0) {
+				group = ext4_mb_choose_group(ac, cr, ngroups);
+				if (group == ngroups) {
+					/*
+					 * No initialized group fits - only the
+					 * groups that need init are left to scan
+					 */
+					optimize = 0;
+					uninit_only = 1;
+					group = ac->ac_g_ex.fe_group;
+					i = 0;
+				}
+			}
 			if (group == ngroups)
 				group = 0;
+			if (uninit_only &&
+			    !EXT4_MB_GRP_NEED_INIT(ext4_get_group_info(sb, group)))
+				continue;
 
 			/* This now checks without needing the buddy page */
 			if (!ext4_mb_good_group(ac, group, cr))
@@ -2098,6 +2291,7 @@ repeat:
 			}
 
 			ac->ac_groups_scanned++;
+			this_cpu_inc(sbi->s_mb_pcpu_stats->ms_cr_groups[cr]);
 			if (cr == 0)
 				ext4_mb_simple_scan_group(ac, &e4b);
 			else if (cr == 1 && sbi->s_stripe &&
@@ -2139,7 +2333,10 @@ repeat:
 			goto repeat;
 		}
 	}
+	if (ac->ac_status == AC_STATUS_FOUND)
+		this_cpu_inc(sbi->s_mb_pcpu_stats->ms_cr_hits[ac->ac_criteria]);
 out:
+	ext4_mb_stat_latency(sbi, ktime_us_delta(ktime_get(), start));
 	return err;
 }
 
@@ -2242,6 +2439,53 @@ static const struct file_operations ext4_mb_seq_groups_fops = {
 	.release	= seq_release,
 };
 
+static int ext4_mb_seq_stats_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_mb_stats sum, *ms;
+	unsigned long *from, *to;
+	int cpu, i;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		ms = per_cpu_ptr(sbi->s_mb_pcpu_stats, cpu);
+		from = (unsigned long *)ms;
+		to = (unsigned long *)&sum;
+		for (i = 0; i < sizeof(sum) / sizeof(unsigned long); i++)
+			to[i] += from[i];
+	}
+
+	seq_printf(seq, "reqs: %lu\n", sum.ms_reqs);
+	seq_printf(seq, "failed: %lu\n", sum.ms_failed);
+	seq_printf(seq, "goal_hits: %lu\n", sum.ms_goal_hits);
+	seq_printf(seq, "inode_pa_hits: %lu\n", sum.ms_pa_hits[MB_INODE_PA]);
+	seq_printf(seq, "group_pa_hits: %lu\n", sum.ms_pa_hits[MB_GROUP_PA]);
+	for (i = 0; i < MB_NUM_CRITERIA; i++)
+		seq_printf(seq, "cr%d: hits %lu groups_scanned %lu\n", i,
+			   sum.ms_cr_hits[i], sum.ms_cr_groups[i]);
+	seq_printf(seq, "latency_us:\n");
+	/* bucket i < MB_LATENCY_BUCKETS - 1 holds latencies below 1 << i */
+	for (i = 0; i < MB_LATENCY_BUCKETS - 1; i++)
+		seq_printf(seq, "  <%-8lu %lu\n", 1UL << i, sum.ms_latency[i]);
+	seq_printf(seq, "  >=%-7lu %lu\n", 1UL << (MB_LATENCY_BUCKETS - 2),
+		   sum.ms_latency[i]);
+	return 0;
+}
+
+static int ext4_mb_seq_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ext4_mb_seq_stats_show, PDE(inode)->data);
+}
+
+static const struct file_operations ext4_mb_seq_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ext4_mb_seq_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static struct kmem_cache *get_groupinfo_cache(int blocksize_bits)
 {
 	int cache_index = blocksize_bits - EXT4_MIN_BLOCK_LOG_SIZE;
@@ -2308,6 +2552,10 @@ int ext4_mb_add_groupinfo(struct super_block *sb, ext4_group_t group,
 	init_rwsem(&meta_group_info[i]->alloc_sem);
 	meta_group_info[i]->bb_free_root = RB_ROOT;
 	meta_group_info[i]->bb_largest_free_order = -1;  /* uninit */
+	meta_group_info[i]->bb_avg_fragment_size_order = -1;  /* uninit */
+	meta_group_info[i]->bb_group = group;
+	INIT_LIST_HEAD(&meta_group_info[i]->bb_largest_free_order_node);
+	INIT_LIST_HEAD(&meta_group_info[i]->bb_avg_fragment_size_node);
 
 #ifdef DOUBLE_CHECK
 	{
@@ -2420,6 +2668,8 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 	unsigned i, j;
 	unsigned offset;
 	unsigned max;
+	unsigned flex_size;
+	ext4_group_t nflex, stream;
 	int ret;
 	int cache_index;
 	struct kmem_cache *cachep;
@@ -2440,6 +2690,28 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 		goto out;
 	}
 
+	sbi->s_mb_largest_free_orders = kmalloc(MB_NUM_ORDERS(sb) *
+			sizeof(struct list_head), GFP_KERNEL);
+	sbi->s_mb_largest_free_orders_locks = kmalloc(MB_NUM_ORDERS(sb) *
+			sizeof(spinlock_t), GFP_KERNEL);
+	sbi->s_mb_avg_fragment_size = kmalloc(MB_NUM_ORDERS(sb) *
+			sizeof(struct list_head), GFP_KERNEL);
+	sbi->s_mb_avg_fragment_size_locks = kmalloc(MB_NUM_ORDERS(sb) *
+			sizeof(spinlock_t), GFP_KERNEL);
+	if (!sbi->s_mb_largest_free_orders ||
+	    !sbi->s_mb_largest_free_orders_locks ||
+	    !sbi->s_mb_avg_fragment_size ||
+	    !sbi->s_mb_avg_fragment_size_locks) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < MB_NUM_ORDERS(sb); i++) {
+		INIT_LIST_HEAD(&sbi->s_mb_largest_free_orders[i]);
+		spin_lock_init(&sbi->s_mb_largest_free_orders_locks[i]);
+		INIT_LIST_HEAD(&sbi->s_mb_avg_fragment_size[i]);
+		spin_lock_init(&sbi->s_mb_avg_fragment_size_locks[i]);
+	}
+
 	cache_index = sb->s_blocksize_bits - EXT4_MIN_BLOCK_LOG_SIZE;
 	cachep = ext4_groupinfo_caches[cache_index];
 	if (!cachep) {
@@ -2488,6 +2760,9 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 
 	spin_lock_init(&sbi->s_md_lock);
 	spin_lock_init(&sbi->s_bal_lock);
+	spin_lock_init(&sbi->s_discard_lock);
+	INIT_LIST_HEAD(&sbi->s_discard_list);
+	INIT_WORK(&sbi->s_discard_work, ext4_mb_discard_work);
 
 	sbi->s_mb_max_to_scan = MB_DEFAULT_MAX_TO_SCAN;
 	sbi->s_mb_min_to_scan = MB_DEFAULT_MIN_TO_SCAN;
@@ -2495,12 +2770,18 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 	sbi->s_mb_stream_request = MB_DEFAULT_STREAM_THRESHOLD;
 	sbi->s_mb_order2_reqs = MB_DEFAULT_ORDER2_REQS;
 	sbi->s_mb_group_prealloc = MB_DEFAULT_GROUP_PREALLOC;
+	sbi->s_mb_optimize_scan = MB_DEFAULT_OPTIMIZE_SCAN;
+	sbi->s_mb_prefetch = MB_DEFAULT_PREFETCH;
 
 	sbi->s_locality_groups = alloc_percpu(struct ext4_locality_group);
 	if (sbi->s_locality_groups == NULL) {
 		ret = -ENOMEM;
 		goto out;
 	}
+	/* spread the stream goals of cpus over the flex groups */
+	flex_size = ext4_flex_bg_size(sbi);
+	nflex = max_t(ext4_group_t, ext4_get_groups_count(sb) / flex_size, 1);
+	stream = 0;
 	for_each_possible_cpu(i) {
 		struct ext4_locality_group *lg;
 		lg = per_cpu_ptr(sbi->s_locality_groups, i);
@@ -2508,11 +2789,32 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 		for (j = 0; j < PREALLOC_TB_SIZE; j++)
 			INIT_LIST_HEAD(&lg->lg_prealloc_list[j]);
 		spin_lock_init(&lg->lg_prealloc_lock);
+		lg->lg_stream_group = (stream++ % nflex) * flex_size;
+		lg->lg_stream_start = 0;
 	}
 
-	if (sbi->s_proc)
+	sbi->s_mb_pcpu_stats = alloc_percpu(struct ext4_mb_stats);
+	if (sbi->s_mb_pcpu_stats == NULL) {
+		free_percpu(sbi->s_locality_groups);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* discards may sleep for long, keep them off the system workqueue */
+	sbi->s_discard_wq = create_singlethread_workqueue("ext4-discard");
+	if (sbi->s_discard_wq == NULL) {
+		free_percpu(sbi->s_mb_pcpu_stats);
+		free_percpu(sbi->s_locality_groups);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (sbi->s_proc) {
 		proc_create_data("mb_groups", S_IRUGO, sbi->s_proc,
 				 &ext4_mb_seq_groups_fops, sb);
+		proc_create_data("mb_stats", S_IRUGO, sbi->s_proc,
+				 &ext4_mb_seq_stats_fops, sb);
+	}
 
 	if (sbi->s_journal)
 		sbi->s_journal->j_commit_callback = release_blocks_on_commit;
@@ -2520,6 +2822,10 @@ out:
 	if (ret) {
 		kfree(sbi->s_mb_offsets);
 		kfree(sbi->s_mb_maxs);
+		kfree(sbi->s_mb_largest_free_orders);
+		kfree(sbi->s_mb_largest_free_orders_locks);
+		kfree(sbi->s_mb_avg_fragment_size);
+		kfree(sbi->s_mb_avg_fragment_size_locks);
 		kfree(namep);
 	}
 	return ret;
@@ -2552,6 +2858,10 @@ int ext4_mb_release(struct super_block *sb)
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
 	struct kmem_cache *cachep = get_groupinfo_cache(sb->s_blocksize_bits);
 
+	/* discard and free the extents queued by the last commits */
+	destroy_workqueue(sbi->s_discard_wq);
+	ext4_mb_discard_committed(sb);
+
 	if (sbi->s_group_info) {
 		for (i = 0; i < ngroups; i++) {
 			grinfo = ext4_get_group_info(sb, i);
@@ -2572,6 +2882,10 @@ int ext4_mb_release(struct super_block *sb)
 	}
 	kfree(sbi->s_mb_offsets);
 	kfree(sbi->s_mb_maxs);
+	kfree(sbi->s_mb_largest_free_orders);
+	kfree(sbi->s_mb_largest_free_orders_locks);
+	kfree(sbi->s_mb_avg_fragment_size);
+	kfree(sbi->s_mb_avg_fragment_size_locks);
 	if (sbi->s_buddy_cache)
 		iput(sbi->s_buddy_cache);
 	if (sbi->s_mb_stats) {
@@ -2599,8 +2913,11 @@ int ext4_mb_release(struct super_block *sb)
 	}
 
 	free_percpu(sbi->s_locality_groups);
-	if (sbi->s_proc)
+	if (sbi->s_proc) {
+		remove_proc_entry("mb_stats", sbi->s_proc);
 		remove_proc_entry("mb_groups", sbi->s_proc);
+	}
+	free_percpu(sbi->s_mb_pcpu_stats);
 
 	return 0;
 }
@@ -2623,51 +2940,135 @@ static inline int ext4_issue_discard(struct super_block *sb,
 }
 
 /*
- * This function is called by the jbd2 layer once the commit has finished,
- * so we know we can free the blocks that were released with that commit.
+ * Put the blocks of a committed free extent @entry in the buddy,
+ * to make them really free, and release @entry.
  */
-static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
+static void ext4_mb_free_committed(struct super_block *sb,
+		struct ext4_free_data *entry)
 {
-	struct super_block *sb = journal->j_private;
 	struct ext4_buddy e4b;
 	struct ext4_group_info *db;
-	int err, count = 0, count2 = 0;
-	struct ext4_free_data *entry;
-	struct list_head *l, *ltmp;
+	int err;
+
+	mb_debug(1, "gonna free %u blocks in group %u (0x%p):",
+		 entry->count, entry->group, entry);
+
+	err = ext4_mb_load_buddy(sb, entry->group, &e4b);
+	/* we expect to find existing buddy because it's pinned */
+	BUG_ON(err != 0);
+
+	db = e4b.bd_info;
+	ext4_lock_group(sb, entry->group);
+	/* Take it out of per group rb tree */
+	rb_erase(&entry->node, &(db->bb_free_root));
+	mb_free_blocks(NULL, &e4b, entry->start_blk, entry->count);
+
+	if (!db->bb_free_root.rb_node) {
+		/* No more items in the per group rb tree
+		 * balance refcounts from ext4_mb_free_metadata()
+		 */
+		page_cache_release(e4b.bd_buddy_page);
+		page_cache_release(e4b.bd_bitmap_page);
+	}
+	ext4_unlock_group(sb, entry->group);
+	kmem_cache_free(ext4_free_ext_cachep, entry);
+	ext4_mb_unload_buddy(&e4b);
+}
+
+static int ext4_free_data_cmp(void *priv, struct list_head *a,
+		struct list_head *b)
+{
+	struct ext4_free_data *fa, *fb;
+
+	fa = list_entry(a, struct ext4_free_data, list);
+	fb = list_entry(b, struct ext4_free_data, list);
+	if (fa->group != fb->group)
+		return fa->group < fb->group ? -1 : 1;
+	return fa->start_blk - fb->start_blk;
+}
+
+/*
+ * ext4_mb_discard_committed() - discard and free committed extents
+ *
+ * With the 'discard' mount option, extents freed by a committed
+ * transaction are queued on s_discard_list instead of being discarded
+ * from the commit callback.  They stay in the per group rb tree, so they
+ * cannot be reallocated until they are discarded.  This function sorts
+ * the queued extents, merges adjacent extents (also from different
+ * transactions) into a single discard request and then puts the extents
+ * in the buddy.
+ * Called from the discard work and on umount.
+ */
+static void ext4_mb_discard_committed(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_free_data *entry, *tmp, *first = NULL;
+	ext4_grpblk_t count = 0;
+	LIST_HEAD(list);
+
+	spin_lock(&sbi->s_discard_lock);
+	list_splice_init(&sbi->s_discard_list, &list);
+	spin_unlock(&sbi->s_discard_lock);
+	if (list_empty(&list))
+		return;
 
-	list_for_each_safe(l, ltmp, &txn->t_private_list) {
-		entry = list_entry(l, struct ext4_free_data, list);
+	list_sort(NULL, &list, ext4_free_data_cmp);
+	list_for_each_entry(entry, &list, list) {
+		if (first && entry->group == first->group &&
+		    entry->start_blk == first->start_blk + count) {
+			count += entry->count;
+			continue;
+		}
+		if (first && test_opt(sb, DISCARD))
+			ext4_issue_discard(sb, first->group,
+					   first->start_blk, count);
+		first = entry;
+		count = entry->count;
+	}
+	if (first && test_opt(sb, DISCARD))
+		ext4_issue_discard(sb, first->group, first->start_blk, count);
+
+	list_for_each_entry_safe(entry, tmp, &list, list)
+		ext4_mb_free_committed(sb, entry);
+}
+
+static void ext4_mb_discard_work(struct work_struct *work)
+{
+	struct ext4_sb_info *sbi = container_of(work, struct ext4_sb_info,
+						s_discard_work);
+
+	ext4_mb_discard_committed(sbi->s_sb);
+}
 
-		mb_debug(1, "gonna free %u blocks in group %u (0x%p):",
-			 entry->count, entry->group, entry);
+/*
+ * This function is called by the jbd2 layer once the commit has finished,
+ * so we know we can free the blocks that were released with that commit.
+ */
+static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
+{
+	struct super_block *sb = journal->j_private;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_free_data *entry, *tmp;
+	int count = 0, count2 = 0;
 
-		if (test_opt(sb, DISCARD))
-			ext4_issue_discard(sb, entry->group,
-					entry->start_blk, entry->count);
+	if (list_empty(&txn->t_private_list))
+		return;
 
-		err = ext4_mb_load_buddy(sb, entry->group, &e4b);
-		/* we expect to find existing buddy because it's pinned */
-		BUG_ON(err != 0);
+	if (test_opt(sb, DISCARD)) {
+		/* discard and free the blocks from the discard work */
+		spin_lock(&sbi->s_discard_lock);
+		list_splice_tail_init(&txn->t_private_list,
+				      &sbi->s_discard_list);
+		spin_unlock(&sbi->s_discard_lock);
+		queue_work(sbi->s_discard_wq, &sbi->s_discard_work);
+		return;
+	}
 
-		db = e4b.bd_info;
+	list_for_each_entry_safe(entry, tmp, &txn->t_private_list, list) {
 		/* there are blocks to put in buddy to make them really free */
 		count += entry->count;
 		count2++;
-		ext4_lock_group(sb, entry->group);
-		/* Take it out of per group rb tree */
-		rb_erase(&entry->node, &(db->bb_free_root));
-		mb_free_blocks(NULL, &e4b, entry->start_blk, entry->count);
-
-		if (!db->bb_free_root.rb_node) {
-			/* No more items in the per group rb tree
-			 * balance refcounts from ext4_mb_free_metadata()
-			 */
-			page_cache_release(e4b.bd_buddy_page);
-			page_cache_release(e4b.bd_bitmap_page);
-		}
-		ext4_unlock_group(sb, entry->group);
-		kmem_cache_free(ext4_free_ext_cachep, entry);
-		ext4_mb_unload_buddy(&e4b);
+		ext4_mb_free_committed(sb, entry);
 	}
 
 	mb_debug(1, "freed %u blocks in %u structures\n", count, count2);
@@ -2810,7 +3211,7 @@ ext4_mb_mark_diskspace_used(struct ext4_allocation_context *ac,
 		 * We leak some of the blocks here.
 		 */
 		ext4_lock_group(sb, ac->ac_b_ex.fe_group);
-		mb_set_bits(bitmap_bh->b_data, ac->ac_b_ex.fe_start,
+		ext4_set_bits(bitmap_bh->b_data, ac->ac_b_ex.fe_start,
 			    ac->ac_b_ex.fe_len);
 		ext4_unlock_group(sb, ac->ac_b_ex.fe_group);
 		err = ext4_handle_dirty_metadata(handle, NULL, bitmap_bh);
@@ -2829,7 +3230,7 @@ ext4_mb_mark_diskspace_used(struct ext4_allocation_context *ac,
 		}
 	}
 #endif
-	mb_set_bits(bitmap_bh->b_data, ac->ac_b_ex.fe_start,ac->ac_b_ex.fe_len);
+	ext4_set_bits(bitmap_bh->b_data, ac->ac_b_ex.fe_start,ac->ac_b_ex.fe_len);
 	if (gdp->bg_flags & cpu_to_le16(EXT4_BG_BLOCK_UNINIT)) {
 		gdp->bg_flags &= cpu_to_le16(~EXT4_BG_BLOCK_UNINIT);
 		ext4_free_blks_set(sb, gdp,
@@ -3079,6 +3480,14 @@ static void ext4_mb_collect_stats(struct ext4_allocation_context *ac)
 {
 	struct ext4_sb_info *sbi = EXT4_SB(ac->ac_sb);
 
+	this_cpu_inc(sbi->s_mb_pcpu_stats->ms_reqs);
+	if (ac->ac_status != AC_STATUS_FOUND)
+		this_cpu_inc(sbi->s_mb_pcpu_stats->ms_failed);
+	else if (ac->ac_op == EXT4_MB_HISTORY_ALLOC &&
+		 ac->ac_g_ex.fe_start == ac->ac_b_ex.fe_start &&
+		 ac->ac_g_ex.fe_group == ac->ac_b_ex.fe_group)
+		this_cpu_inc(sbi->s_mb_pcpu_stats->ms_goal_hits);
+
 	if (sbi->s_mb_stats && ac->ac_g_ex.fe_len > 1) {
 		atomic_inc(&sbi->s_bal_reqs);
 		atomic_add(ac->ac_b_ex.fe_len, &sbi->s_bal_allocated);
@@ -3301,7 +3710,7 @@ static void ext4_mb_generate_from_freelist(struct super_block *sb, void *bitmap,
 
 	while (n) {
 		entry = rb_entry(n, struct ext4_free_data, node);
-		mb_set_bits(bitmap, entry->start_blk, entry->count);
+		ext4_set_bits(bitmap, entry->start_blk, entry->count);
 		n = rb_next(n);
 	}
 	return;
@@ -3343,7 +3752,7 @@ void ext4_mb_generate_from_pa(struct super_block *sb, void *bitmap,
 		if (unlikely(len == 0))
 			continue;
 		BUG_ON(groupnr != group);
-		mb_set_bits(bitmap, start, len);
+		ext4_set_bits(bitmap, start, len);
 		preallocated += len;
 		count++;
 	}
@@ -4325,7 +4734,9 @@ ext4_fsblk_t ext4_mb_new_blocks(handle_t *handle,
 	}
 
 	ac->ac_op = EXT4_MB_HISTORY_PREALLOC;
-	if (!ext4_mb_use_preallocated(ac)) {
+	if (ext4_mb_use_preallocated(ac)) {
+		this_cpu_inc(sbi->s_mb_pcpu_stats->ms_pa_hits[ac->ac_pa->pa_type]);
+	} else {
 		ac->ac_op = EXT4_MB_HISTORY_ALLOC;
 		ext4_mb_normalize_request(ac, ar);
 repeat:
@@ -4633,7 +5044,7 @@ do_more:
 		new_entry->t_tid = handle->h_transaction->t_tid;
 
 		ext4_lock_group(sb, block_group);
-		mb_clear_bits(bitmap_bh->b_data, bit, count);
+		ext4_clear_bits(bitmap_bh->b_data, bit, count);
 		ext4_mb_free_metadata(handle, &e4b, new_entry);
 	} else {
 		/* need to update group_info->bb_free and bitmap
@@ -4641,7 +5052,7 @@ do_more:
 		 * them with group lock_held
 		 */
 		ext4_lock_group(sb, block_group);
-		mb_clear_bits(bitmap_bh->b_data, bit, count);
+		ext4_clear_bits(bitmap_bh->b_data, bit, count);
 		mb_free_blocks(inode, &e4b, bit, count);
 		ext4_mb_return_to_preallocation(inode, &e4b, block, count);
 	}
@@ -4800,6 +5211,31 @@ ext4_grpblk_t ext4_trim_all_free(struct super_block *sb, struct ext4_buddy *e4b,
 	return count;
 }
 
+/*
+ * ext4_trim_throttle -- sleep to keep FITRIM under the rate limit
+ * @sb:			superblock for filesystem
+ * @trimmed:		no. of blocks trimmed since @start_time
+ * @start_time:		jiffies when the trim started
+ *
+ * A bulk trim of a large file system can saturate the device with discard
+ * requests.  Sleep until @trimmed blocks are within s_trim_max_mbps MB/s.
+ */
+static int ext4_trim_throttle(struct super_block *sb, uint64_t trimmed,
+		unsigned long start_time)
+{
+	uint64_t mbytes = trimmed >> (20 - sb->s_blocksize_bits);
+	unsigned long elapsed = jiffies_to_msecs(jiffies - start_time);
+	uint64_t msecs;
+
+	/* time to trim @trimmed blocks at the rate limit */
+	msecs = div_u64(mbytes * MSEC_PER_SEC, EXT4_SB(sb)->s_trim_max_mbps);
+	if (msecs > elapsed)
+		msleep_interruptible(msecs - elapsed);
+	if (fatal_signal_pending(current))
+		return -ERESTARTSYS;
+	return 0;
+}
+
 /**
  * ext4_trim_fs() -- trim ioctl handle function
  * @sb:			superblock for filesystem
@@ -4819,6 +5255,7 @@ int ext4_trim_fs(struct super_block *sb, struct fstrim_range *range)
 	ext4_group_t group, ngroups = ext4_get_groups_count(sb);
 	ext4_grpblk_t cnt = 0, first_block, last_block;
 	uint64_t start, len, minlen, trimmed;
+	unsigned long start_time = jiffies;
 	int ret = 0;
 
 	start = range->start >> sb->s_blocksize_bits;
@@ -4865,6 +5302,12 @@ int ext4_trim_fs(struct super_block *sb, struct fstrim_range *range)
 		ext4_mb_unload_buddy(&e4b);
 		trimmed += cnt;
 		first_block = 0;
+
+		if (cnt > 0 && EXT4_SB(sb)->s_trim_max_mbps) {
+			ret = ext4_trim_throttle(sb, trimmed, start_time);
+			if (ret)
+				break;
+		}
 	}
 	range->len = trimmed * sb->s_blocksize;
 
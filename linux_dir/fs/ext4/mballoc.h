@@ -94,6 +94,23 @@ extern u8 mb_enable_debug;
  */
 #define MB_DEFAULT_GROUP_PREALLOC	512
 
+/*
+ * pick cr 0 and cr 1 groups from the group lists instead of scanning
+ * We can tune the same via /sys/fs/ext4/<partition>/mb_optimize_scan
+ */
+#define MB_DEFAULT_OPTIMIZE_SCAN	1
+
+/*
+ * number of groups whose block bitmaps the lazyinit thread reads ahead
+ * and builds the buddy for in one go after mount, 0 disables it
+ * We can tune the same via /sys/fs/ext4/<partition>/mb_prefetch
+ */
+#define MB_DEFAULT_PREFETCH		32
+#define MB_PREFETCH_BATCH		16
+
+/* no. of buddy orders, including order 0 (the block bitmap) */
+#define MB_NUM_ORDERS(sb)		((sb)->s_blocksize_bits + 2)
+
 
 struct ext4_free_data {
 	/* this links the free block information from group_info */
@@ -160,6 +177,26 @@ struct ext4_locality_group {
 	/* list of preallocations */
 	struct list_head	lg_prealloc_list[PREALLOC_TB_SIZE];
 	spinlock_t		lg_prealloc_lock;
+	/* where last stream allocation was done on this cpu */
+	ext4_group_t		lg_stream_group;
+	ext4_grpblk_t		lg_stream_start;
+};
+
+/*
+ * Per cpu allocator statistics, always collected and summed up for
+ * /proc/fs/ext4/<partition>/mb_stats
+ */
+#define MB_NUM_CRITERIA		4
+#define MB_LATENCY_BUCKETS	16	/* log2 of usec, last one open ended */
+
+struct ext4_mb_stats {
+	unsigned long	ms_reqs;		/* allocation requests */
+	unsigned long	ms_failed;		/* requests not satisfied */
+	unsigned long	ms_goal_hits;		/* served at the goal */
+	unsigned long	ms_pa_hits[2];		/* served from inode/group pa */
+	unsigned long	ms_cr_hits[MB_NUM_CRITERIA];	/* found at cr */
+	unsigned long	ms_cr_groups[MB_NUM_CRITERIA];	/* scanned at cr */
+	unsigned long	ms_latency[MB_LATENCY_BUCKETS];	/* regular allocator */
 };
 
 struct ext4_allocation_context {
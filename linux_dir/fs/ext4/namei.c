@@ -356,7 +356,7 @@ dx_probe(const struct qstr *d_name, struct inode *dir,
 	struct dx_frame *frame = frame_in;
 	u32 hash;
 
-	frame->bh = NULL;
+	memset(frame_in, 0, EXT4_HTREE_LEVEL * sizeof(frame_in[0]));
 	if (!(bh = ext4_bread (NULL,dir, 0, 0, err)))
 		goto fail;
 	root = (struct dx_root *) bh->b_data;
@@ -385,9 +385,14 @@ dx_probe(const struct qstr *d_name, struct inode *dir,
 		goto fail;
 	}
 
-	if ((indirect = root->info.indirect_levels) > 1) {
-		ext4_warning(dir->i_sb, "Unimplemented inode hash depth: %#06x",
-			     root->info.indirect_levels);
+	indirect = root->info.indirect_levels;
+	if (indirect >= ext4_dir_htree_level(dir->i_sb)) {
+		ext4_warning(dir->i_sb,
+			     "Directory (ino: %lu) htree depth %#06x exceed "
+			     "supported value", dir->i_ino, indirect);
+		if (ext4_dir_htree_level(dir->i_sb) < EXT4_HTREE_LEVEL)
+			ext4_warning(dir->i_sb, "Enable large directory "
+				     "feature to access it");
 		brelse(bh);
 		*err = ERR_BAD_DX_DIR;
 		goto fail;
@@ -478,12 +483,13 @@ fail:
 
 static void dx_release (struct dx_frame *frames)
 {
-	if (frames[0].bh == NULL)
-		return;
+	int i;
 
-	if (((struct dx_root *) frames[0].bh->b_data)->info.indirect_levels)
-		brelse(frames[1].bh);
-	brelse(frames[0].bh);
+	/* dx_probe() clears all frames, the path ends at the first hole */
+	for (i = 0; i < EXT4_HTREE_LEVEL && frames[i].bh; i++) {
+		brelse(frames[i].bh);
+		frames[i].bh = NULL;
+	}
 }
 
 /*
@@ -562,9 +568,9 @@ static int ext4_htree_next_block(struct inode *dir, __u32 hash,
 
 
 /*
- * This function fills a red-black tree with information from a
- * directory block.  It returns the number directory entries loaded
- * into the tree.  If there is an error it is returned in err.
+ * This function stores the entries of a directory block for readdir,
+ * see ext4_htree_store_dirent().  It returns the number directory entries
+ * loaded.  If there is an error it is returned in err.
  */
 static int htree_dirblock_to_tree(struct file *dir_file,
 				  struct inode *dir, ext4_lblk_t block,
@@ -614,11 +620,11 @@ static int htree_dirblock_to_tree(struct file *dir_file,
 
 
 /*
- * This function fills a red-black tree with information from a
- * directory.  We start scanning the directory in hash order, starting
- * at start_hash and start_minor_hash.
+ * This function loads the next batch of entries of a directory for
+ * readdir, see ext4_htree_store_dirent().  We start scanning the
+ * directory in hash order, starting at start_hash and start_minor_hash.
  *
- * This function returns the number of entries inserted into the tree,
+ * This function returns the number of entries stored,
  * or a negative error code.
  */
 int ext4_htree_fill_tree(struct file *dir_file, __u32 start_hash,
@@ -626,7 +632,7 @@ int ext4_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 {
 	struct dx_hash_info hinfo;
 	struct ext4_dir_entry_2 *de;
-	struct dx_frame frames[2], *frame;
+	struct dx_frame frames[EXT4_HTREE_LEVEL], *frame;
 	struct inode *dir;
 	ext4_lblk_t block;
 	int count = 0;
@@ -841,6 +847,64 @@ static inline int search_dirblock(struct buffer_head *bh,
 }
 
 
+/*
+ * Look @d_name up in the name cache of a linear directory.  Returns 1 and
+ * the buffer of the entry if it is cached, 0 if the name does not exist
+ * and -1 if the directory has to be scanned.
+ */
+static int ext4_dc_find_entry(struct inode *dir, const struct qstr *d_name,
+			      struct buffer_head **res_bh,
+			      struct ext4_dir_entry_2 **res_dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ext4_dir_entry_2 *de;
+	struct buffer_head *bh;
+	ext4_lblk_t block;
+	unsigned int offset;
+	int err, ret;
+
+	ret = ext4_dc_lookup(dir, d_name, &block, &offset);
+	if (ret <= 0)
+		return ret;
+	bh = ext4_bread(NULL, dir, block, 0, &err);
+	if (!bh)
+		goto stale;
+	de = (struct ext4_dir_entry_2 *) (bh->b_data + offset);
+	if (offset + EXT4_DIR_REC_LEN(d_name->len) > sb->s_blocksize ||
+	    !ext4_check_dir_entry(dir, de, bh,
+				  (block << EXT4_BLOCK_SIZE_BITS(sb)) + offset) ||
+	    !ext4_match(d_name->len, d_name->name, de)) {
+		brelse(bh);
+		goto stale;
+	}
+	*res_bh = bh;
+	*res_dir = de;
+	return 1;
+
+stale:
+	ext4_dc_drop(dir);
+	return -1;
+}
+
+/*
+ * Add the entry just created for @d_name in @bh, block @block of @dir,
+ * to the name cache of @dir, if it has one.
+ */
+static void ext4_dc_add_entry(struct inode *dir, const struct qstr *d_name,
+			      struct buffer_head *bh, ext4_lblk_t block)
+{
+	struct ext4_dir_entry_2 *de;
+
+	if (!EXT4_I(dir)->i_dir_cache)
+		return;
+	if (search_dirblock(bh, dir, d_name,
+			    block << EXT4_BLOCK_SIZE_BITS(dir->i_sb), &de) == 1)
+		ext4_dc_insert(dir, d_name->name, d_name->len, block,
+			       (char *) de - bh->b_data);
+	else
+		ext4_dc_drop(dir);
+}
+
 /*
  *	ext4_find_entry()
  *
@@ -896,6 +960,10 @@ static struct buffer_head * ext4_find_entry (struct inode *dir,
 			return bh;
 		dxtrace(printk(KERN_DEBUG "ext4_find_entry: dx failed, "
 			       "falling back\n"));
+	} else {
+		i = ext4_dc_find_entry(dir, d_name, &bh, res_dir);
+		if (i >= 0)
+			return i ? bh : NULL;
 	}
 	nblocks = dir->i_size >> EXT4_BLOCK_SIZE_BITS(sb);
 	start = EXT4_I(dir)->i_dir_start_lookup;
@@ -977,7 +1045,7 @@ static struct buffer_head * ext4_dx_find_entry(struct inode *dir, const struct q
 {
 	struct super_block * sb = dir->i_sb;
 	struct dx_hash_info	hinfo;
-	struct dx_frame frames[2], *frame;
+	struct dx_frame frames[EXT4_HTREE_LEVEL], *frame;
 	struct buffer_head *bh;
 	ext4_lblk_t block;
 	int retval;
@@ -1345,7 +1413,7 @@ static int make_indexed_dir(handle_t *handle, struct dentry *dentry,
 	int		namelen = dentry->d_name.len;
 	struct buffer_head *bh2;
 	struct dx_root	*root;
-	struct dx_frame	frames[2], *frame;
+	struct dx_frame	frames[EXT4_HTREE_LEVEL], *frame;
 	struct dx_entry *entries;
 	struct ext4_dir_entry_2	*de, *de2;
 	char		*data1, *top;
@@ -1365,6 +1433,8 @@ static int make_indexed_dir(handle_t *handle, struct dentry *dentry,
 		return retval;
 	}
 	root = (struct dx_root *) bh->b_data;
+	/* the dirents of block 0 move and lookups no longer scan the dir */
+	ext4_dc_drop(dir);
 
 	/* The 0th block becomes the root, move the dirents out */
 	fde = &root->dotdot;
@@ -1411,6 +1481,7 @@ static int make_indexed_dir(handle_t *handle, struct dentry *dentry,
 		hinfo.hash_version += EXT4_SB(dir->i_sb)->s_hash_unsigned;
 	hinfo.seed = EXT4_SB(dir->i_sb)->s_hash_seed;
 	ext4fs_dirhash(name, namelen, &hinfo);
+	memset(frames, 0, sizeof(frames));
 	frame = frames;
 	frame->entries = entries;
 	frame->at = entries;
@@ -1467,6 +1538,9 @@ static int ext4_add_entry(handle_t *handle, struct dentry *dentry,
 			return retval;
 		retval = add_dirent_to_buf(handle, dentry, inode, NULL, bh);
 		if (retval != -ENOSPC) {
+			if (!retval)
+				ext4_dc_add_entry(dir, &dentry->d_name, bh,
+						  block);
 			brelse(bh);
 			return retval;
 		}
@@ -1483,6 +1557,9 @@ static int ext4_add_entry(handle_t *handle, struct dentry *dentry,
 	de->inode = 0;
 	de->rec_len = ext4_rec_len_to_disk(blocksize, blocksize);
 	retval = add_dirent_to_buf(handle, dentry, inode, de, bh);
+	if (retval == 0)
+		ext4_dc_insert(dir, dentry->d_name.name, dentry->d_name.len,
+			       block, 0);
 	brelse(bh);
 	if (retval == 0)
 		ext4_set_inode_state(inode, EXT4_STATE_NEWENTRY);
@@ -1495,15 +1572,18 @@ static int ext4_add_entry(handle_t *handle, struct dentry *dentry,
 static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 			     struct inode *inode)
 {
-	struct dx_frame frames[2], *frame;
+	struct dx_frame frames[EXT4_HTREE_LEVEL], *frame;
 	struct dx_entry *entries, *at;
 	struct dx_hash_info hinfo;
 	struct buffer_head *bh;
 	struct inode *dir = dentry->d_parent->d_inode;
 	struct super_block *sb = dir->i_sb;
 	struct ext4_dir_entry_2 *de;
+	int restart;
 	int err;
 
+again:
+	restart = 0;
 	frame = dx_probe(&dentry->d_name, dir, &hinfo, frames, &err);
 	if (!frame)
 		return err;
@@ -1528,18 +1608,40 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 	/* Need to split index? */
 	if (dx_get_count(entries) == dx_get_limit(entries)) {
 		ext4_lblk_t newblock;
-		unsigned icount = dx_get_count(entries);
-		int levels = frame - frames;
+		int levels = frame - frames + 1;
+		unsigned icount;
+		int add_level = 1;
 		struct dx_entry *entries2;
 		struct dx_node *node2;
 		struct buffer_head *bh2;
 
-		if (levels && (dx_get_count(frames->entries) ==
-			       dx_get_limit(frames->entries))) {
-			ext4_warning(sb, "Directory index full!");
+		/*
+		 * Find the lowest full index block whose parent has room.
+		 * If that is not the one above the leaf, the path below it
+		 * is stale after the split, so look the name up again.
+		 */
+		while (frame > frames) {
+			if (dx_get_count((frame - 1)->entries) <
+			    dx_get_limit((frame - 1)->entries)) {
+				add_level = 0;
+				break;
+			}
+			frame--; /* split higher index block */
+			at = frame->at;
+			entries = frame->entries;
+			restart = 1;
+		}
+		if (add_level && levels == ext4_dir_htree_level(sb)) {
+			ext4_warning(sb, "Directory (ino: %lu) index full, "
+				     "reach max htree level :%d",
+				     dir->i_ino, levels);
+			if (levels < EXT4_HTREE_LEVEL)
+				ext4_warning(sb, "Large directory feature is "
+					     "not enabled on this filesystem");
 			err = -ENOSPC;
 			goto cleanup;
 		}
+		icount = dx_get_count(entries);
 		bh2 = ext4_append (handle, dir, &newblock, &err);
 		if (!(bh2))
 			goto cleanup;
@@ -1552,7 +1654,7 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 		err = ext4_journal_get_write_access(handle, frame->bh);
 		if (err)
 			goto journal_error;
-		if (levels) {
+		if (!add_level) {
 			unsigned icount1 = icount/2, icount2 = icount - icount1;
 			unsigned hash2 = dx_get_hash(entries + icount1);
 			dxtrace(printk(KERN_DEBUG "Split index %i/%i\n",
@@ -1560,7 +1662,7 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 
 			BUFFER_TRACE(frame->bh, "get_write_access"); /* index root */
 			err = ext4_journal_get_write_access(handle,
-							     frames[0].bh);
+							     (frame - 1)->bh);
 			if (err)
 				goto journal_error;
 
@@ -1576,17 +1678,29 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 				frame->entries = entries = entries2;
 				swap(frame->bh, bh2);
 			}
-			dx_insert_block(frames + 0, hash2, newblock);
-			dxtrace(dx_show_index("node", frames[1].entries));
+			dx_insert_block(frame - 1, hash2, newblock);
+			dxtrace(dx_show_index("node", frame->entries));
 			dxtrace(dx_show_index("node",
 			       ((struct dx_node *) bh2->b_data)->entries));
 			err = ext4_handle_dirty_metadata(handle, inode, bh2);
 			if (err)
 				goto journal_error;
 			brelse (bh2);
+			err = ext4_handle_dirty_metadata(handle, inode,
+							 (frame - 1)->bh);
+			if (err)
+				goto journal_error;
+			if (restart) {
+				err = ext4_handle_dirty_metadata(handle, inode,
+								 frame->bh);
+				goto journal_error;
+			}
 		} else {
+			struct dx_root *dxroot;
+
 			dxtrace(printk(KERN_DEBUG
-				       "Creating second level index...\n"));
+				       "Creating %d level index...\n",
+				       levels + 1));
 			memcpy((char *) entries2, (char *) entries,
 			       icount * sizeof(struct dx_entry));
 			dx_set_limit(entries2, dx_node_limit(dir));
@@ -1594,19 +1708,18 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 			/* Set up root */
 			dx_set_count(entries, 1);
 			dx_set_block(entries + 0, newblock);
-			((struct dx_root *) frames[0].bh->b_data)->info.indirect_levels = 1;
-
-			/* Add new access path frame */
-			frame = frames + 1;
-			frame->at = at = at - entries + entries2;
-			frame->entries = entries = entries2;
-			frame->bh = bh2;
-			err = ext4_journal_get_write_access(handle,
-							     frame->bh);
+			dxroot = (struct dx_root *) frames[0].bh->b_data;
+			dxroot->info.indirect_levels += 1;
+			err = ext4_handle_dirty_metadata(handle, inode,
+							 frame->bh);
 			if (err)
 				goto journal_error;
+			err = ext4_handle_dirty_metadata(handle, inode, bh2);
+			brelse(bh2);
+			/* the whole path moved down, look it up again */
+			restart = 1;
+			goto journal_error;
 		}
-		ext4_handle_dirty_metadata(handle, inode, frames[0].bh);
 	}
 	de = do_split(handle, dir, &bh, frame, &hinfo, &err);
 	if (!de)
@@ -1615,11 +1728,14 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 	goto cleanup;
 
 journal_error:
-	ext4_std_error(dir->i_sb, err);
+	ext4_std_error(dir->i_sb, err); /* this is a no-op if err == 0 */
 cleanup:
 	if (bh)
 		brelse(bh);
 	dx_release(frames);
+	/* the split changed the index path, probe it again */
+	if (restart && err == 0)
+		goto again;
 	return err;
 }
 
@@ -1663,6 +1779,7 @@ static int ext4_delete_entry(handle_t *handle,
 					blocksize);
 			else
 				de->inode = 0;
+			ext4_dc_remove(dir, de->name, de->name_len);
 			dir->i_version++;
 			BUFFER_TRACE(bh, "call ext4_handle_dirty_metadata");
 			ext4_handle_dirty_metadata(handle, dir, bh);
@@ -24,13 +24,24 @@
 #include <linux/workqueue.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/bit_spinlock.h>
+#include <linux/list_sort.h>
 
 #include "ext4_jbd2.h"
 #include "xattr.h"
 #include "acl.h"
 #include "ext4_extents.h"
 
-static struct kmem_cache *io_page_cachep, *io_end_cachep;
+/*
+ * io_ends are allocated for every writeback bio, so they come from a
+ * mempool to make sure writeback can always make progress.  The slab
+ * behind it keeps per-cpu caches of free objects.
+ */
+#define IO_END_POOL_SIZE	16
+
+static struct kmem_cache *io_end_cachep;
+static mempool_t *io_end_pool;
 
 #define WQ_HASH_SZ		37
 #define to_ioend_wq(v)	(&ioend_wq[((unsigned long)v) % WQ_HASH_SZ])
@@ -40,12 +51,13 @@ int __init ext4_init_pageio(void)
 {
 	int i;
 
-	io_page_cachep = KMEM_CACHE(ext4_io_page, SLAB_RECLAIM_ACCOUNT);
-	if (io_page_cachep == NULL)
-		return -ENOMEM;
 	io_end_cachep = KMEM_CACHE(ext4_io_end, SLAB_RECLAIM_ACCOUNT);
-	if (io_page_cachep == NULL) {
-		kmem_cache_destroy(io_page_cachep);
+	if (io_end_cachep == NULL)
+		return -ENOMEM;
+	io_end_pool = mempool_create_slab_pool(IO_END_POOL_SIZE,
+					       io_end_cachep);
+	if (io_end_pool == NULL) {
+		kmem_cache_destroy(io_end_cachep);
 		return -ENOMEM;
 	}
 	for (i = 0; i < WQ_HASH_SZ; i++)
@@ -56,8 +68,8 @@ int __init ext4_init_pageio(void)
 
 void ext4_exit_pageio(void)
 {
+	mempool_destroy(io_end_pool);
 	kmem_cache_destroy(io_end_cachep);
-	kmem_cache_destroy(io_page_cachep);
 }
 
 void ext4_ioend_wait(struct inode *inode)
@@ -67,105 +79,181 @@ void ext4_ioend_wait(struct inode *inode)
 	wait_event(*wq, (atomic_read(&EXT4_I(inode)->i_ioend_count) == 0));
 }
 
-static void put_io_page(struct ext4_io_page *io_page)
-{
-	if (atomic_dec_and_test(&io_page->p_count)) {
-		end_page_writeback(io_page->p_page);
-		put_page(io_page->p_page);
-		kmem_cache_free(io_page_cachep, io_page);
-	}
-}
-
 void ext4_free_io_end(ext4_io_end_t *io)
 {
-	int i;
 	wait_queue_head_t *wq;
 
 	BUG_ON(!io);
 	if (io->page)
 		put_page(io->page);
-	for (i = 0; i < io->num_io_pages; i++)
-		put_io_page(io->pages[i]);
-	io->num_io_pages = 0;
 	wq = to_ioend_wq(io->inode);
 	if (atomic_dec_and_test(&EXT4_I(io->inode)->i_ioend_count) &&
 	    waitqueue_active(wq))
 		wake_up_all(wq);
-	kmem_cache_free(io_end_cachep, io);
+	mempool_free(io, io_end_pool);
+}
+
+static void dump_completed_IO(struct inode * inode)
+{
+#ifdef	EXT4_DEBUG
+	struct list_head *cur, *before, *after;
+	ext4_io_end_t *io, *io0, *io1;
+	unsigned long flags;
+
+	if (list_empty(&EXT4_I(inode)->i_completed_io_list)){
+		ext4_debug("inode %lu completed_io list is empty\n", inode->i_ino);
+		return;
+	}
+
+	ext4_debug("Dump inode %lu completed_io list \n", inode->i_ino);
+	spin_lock_irqsave(&EXT4_I(inode)->i_completed_io_lock, flags);
+	list_for_each_entry(io, &EXT4_I(inode)->i_completed_io_list, list){
+		cur = &io->list;
+		before = cur->prev;
+		io0 = container_of(before, ext4_io_end_t, list);
+		after = cur->next;
+		io1 = container_of(after, ext4_io_end_t, list);
+
+		ext4_debug("io 0x%p from inode %lu,prev 0x%p,next 0x%p\n",
+			    io, inode->i_ino, io0, io1);
+	}
+	spin_unlock_irqrestore(&EXT4_I(inode)->i_completed_io_lock, flags);
+#endif
 }
 
 /*
- * check a range of space and convert unwritten extents to written.
+ * Queue a completed io_end for unwritten extent conversion.  All io_ends
+ * of an inode are handled by a single work item, so io_ends completing
+ * close together are converted in one go.  Can be called from irq context.
  */
-int ext4_end_io_nolock(ext4_io_end_t *io)
+void ext4_add_complete_io(ext4_io_end_t *io_end)
 {
-	struct inode *inode = io->inode;
-	loff_t offset = io->offset;
-	ssize_t size = io->size;
-	int ret = 0;
+	struct ext4_inode_info *ei = EXT4_I(io_end->inode);
+	struct workqueue_struct *wq;
+	unsigned long flags;
 
-	ext4_debug("ext4_end_io_nolock: io 0x%p from inode %lu,list->next 0x%p,"
-		   "list->prev 0x%p\n",
-		   io, inode->i_ino, io->list.next, io->list.prev);
+	wq = EXT4_SB(io_end->inode->i_sb)->dio_unwritten_wq;
+	spin_lock_irqsave(&ei->i_completed_io_lock, flags);
+	list_add_tail(&io_end->list, &ei->i_completed_io_list);
+	spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
+	queue_work(wq, &ei->i_unwritten_work);
+}
 
-	if (list_empty(&io->list))
-		return ret;
+static int ext4_io_end_cmp(void *priv, struct list_head *a,
+			   struct list_head *b)
+{
+	ext4_io_end_t *ia = list_entry(a, ext4_io_end_t, list);
+	ext4_io_end_t *ib = list_entry(b, ext4_io_end_t, list);
 
-	if (!(io->flag & EXT4_IO_END_UNWRITTEN))
-		return ret;
+	if (ia->offset < ib->offset)
+		return -1;
+	return ia->offset > ib->offset;
+}
 
-	ret = ext4_convert_unwritten_extents(inode, offset, size);
-	if (ret < 0) {
-		printk(KERN_EMERG "%s: failed to convert unwritten "
-			"extents to written extents, error is %d "
-			"io is still on inode %lu aio dio list\n",
-		       __func__, ret, inode->i_ino);
-		return ret;
+/*
+ * Convert the unwritten extents of all completed io_ends of @inode to
+ * written extents and release the io_ends.  The io_ends are sorted by
+ * offset and each run of adjacent or overlapping ranges is converted
+ * with a single ext4_convert_unwritten_extents() call, so that parallel
+ * writes into a preallocated range end up splitting the extent once
+ * instead of once per I/O.  io_ends that fail to convert stay on the
+ * list.
+ *
+ * Called with i_mutex held, from ext4_sync_file() and the inode's
+ * conversion work.
+ */
+int ext4_flush_completed_IO(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	ext4_io_end_t *io, *tmp;
+	LIST_HEAD(complete);
+	LIST_HEAD(run);
+	LIST_HEAD(failed);
+	unsigned long flags;
+	loff_t start, end;
+	int ret, err = 0;
+
+	if (list_empty(&ei->i_completed_io_list))
+		return 0;
+
+	dump_completed_IO(inode);
+	spin_lock_irqsave(&ei->i_completed_io_lock, flags);
+	list_splice_init(&ei->i_completed_io_list, &complete);
+	spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
+	list_sort(NULL, &complete, ext4_io_end_cmp);
+
+	while (!list_empty(&complete)) {
+		io = list_first_entry(&complete, ext4_io_end_t, list);
+		list_move_tail(&io->list, &run);
+		if (io->flag & EXT4_IO_END_UNWRITTEN) {
+			start = io->offset;
+			end = io->offset + io->size;
+			while (!list_empty(&complete)) {
+				io = list_first_entry(&complete, ext4_io_end_t,
+						      list);
+				if (!(io->flag & EXT4_IO_END_UNWRITTEN) ||
+				    io->offset > end)
+					break;
+				end = max_t(loff_t, end, io->offset + io->size);
+				list_move_tail(&io->list, &run);
+			}
+
+			ret = ext4_convert_unwritten_extents(inode, start,
+							     end - start);
+			if (ret < 0) {
+				printk(KERN_EMERG "%s: failed to convert "
+				       "unwritten extents to written extents, "
+				       "error is %d io is still on inode %lu "
+				       "aio dio list\n",
+				       __func__, ret, inode->i_ino);
+				list_splice_tail_init(&run, &failed);
+				err = ret;
+				continue;
+			}
+		}
+
+		list_for_each_entry_safe(io, tmp, &run, list) {
+			list_del_init(&io->list);
+			if ((io->flag & EXT4_IO_END_UNWRITTEN) && io->iocb)
+				aio_complete(io->iocb, io->result, 0);
+			/* clear the DIO AIO unwritten flag */
+			io->flag &= ~EXT4_IO_END_UNWRITTEN;
+			ext4_free_io_end(io);
+		}
 	}
 
-	if (io->iocb)
-		aio_complete(io->iocb, io->result, 0);
-	/* clear the DIO AIO unwritten flag */
-	io->flag &= ~EXT4_IO_END_UNWRITTEN;
-	return ret;
+	if (!list_empty(&failed)) {
+		spin_lock_irqsave(&ei->i_completed_io_lock, flags);
+		list_splice(&failed, &ei->i_completed_io_list);
+		spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
+	}
+	return err;
 }
 
 /*
  * work on completed aio dio IO, to convert unwritten extents to extents
  */
-static void ext4_end_io_work(struct work_struct *work)
+void ext4_end_io_work(struct work_struct *work)
 {
-	ext4_io_end_t		*io = container_of(work, ext4_io_end_t, work);
-	struct inode		*inode = io->inode;
-	struct ext4_inode_info	*ei = EXT4_I(inode);
-	unsigned long		flags;
-	int			ret;
+	struct ext4_inode_info	*ei = container_of(work,
+						   struct ext4_inode_info,
+						   i_unwritten_work);
+	struct inode		*inode = &ei->vfs_inode;
 
 	mutex_lock(&inode->i_mutex);
-	ret = ext4_end_io_nolock(io);
-	if (ret < 0) {
-		mutex_unlock(&inode->i_mutex);
-		return;
-	}
-
-	spin_lock_irqsave(&ei->i_completed_io_lock, flags);
-	if (!list_empty(&io->list))
-		list_del_init(&io->list);
-	spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
+	ext4_flush_completed_IO(inode);
 	mutex_unlock(&inode->i_mutex);
-	ext4_free_io_end(io);
 }
 
 ext4_io_end_t *ext4_init_io_end(struct inode *inode, gfp_t flags)
 {
 	ext4_io_end_t *io = NULL;
 
-	io = kmem_cache_alloc(io_end_cachep, flags);
+	io = mempool_alloc(io_end_pool, flags);
 	if (io) {
 		memset(io, 0, sizeof(*io));
 		atomic_inc(&EXT4_I(inode)->i_ioend_count);
 		io->inode = inode;
-		INIT_WORK(&io->work, ext4_end_io_work);
 		INIT_LIST_HEAD(&io->list);
 	}
 	return io;
@@ -186,72 +274,72 @@ static void buffer_io_error(struct buffer_head *bh)
 			(unsigned long long)bh->b_blocknr);
 }
 
+/*
+ * Finish writeback of the buffers of @page covered by @bvec.  A page may
+ * be split over several bios; the buffers still under I/O are those with
+ * BH_Async_Write set, and whoever clears the last of them ends writeback
+ * of the page.  The buffer state is checked under BH_Uptodate_Lock of the
+ * first buffer, like end_buffer_async_write() does.
+ */
+static void ext4_finish_page_write(struct bio_vec *bvec, int error)
+{
+	struct page *page = bvec->bv_page;
+	struct buffer_head *bh, *head;
+	unsigned int start = bvec->bv_offset;
+	unsigned int end = start + bvec->bv_len;
+	int under_io = 0, partial = 0;
+	unsigned long flags;
+
+	if (error)
+		SetPageError(page);
+	bh = head = page_buffers(page);
+	local_irq_save(flags);
+	bit_spin_lock(BH_Uptodate_Lock, &head->b_state);
+	do {
+		if (bh_offset(bh) < start || bh_offset(bh) + bh->b_size > end) {
+			if (buffer_async_write(bh))
+				under_io = 1;
+		} else {
+			if (error)
+				buffer_io_error(bh);
+			clear_buffer_async_write(bh);
+		}
+		if (!buffer_uptodate(bh))
+			partial = 1;
+		bh = bh->b_this_page;
+	} while (bh != head);
+	bit_spin_unlock(BH_Uptodate_Lock, &head->b_state);
+	local_irq_restore(flags);
+
+	if (under_io)
+		return;
+	/*
+	 * If this was a partial write which happened to make all buffers
+	 * uptodate then we can optimize away a bogus readpage() for the
+	 * next read().
+	 */
+	if (!partial)
+		SetPageUptodate(page);
+	end_page_writeback(page);
+}
+
 static void ext4_end_bio(struct bio *bio, int error)
 {
 	ext4_io_end_t *io_end = bio->bi_private;
-	struct workqueue_struct *wq;
 	struct inode *inode;
-	unsigned long flags;
+	sector_t bi_sector = bio->bi_sector;
 	int i;
 
 	BUG_ON(!io_end);
-	bio->bi_private = NULL;
-	bio->bi_end_io = NULL;
 	if (test_bit(BIO_UPTODATE, &bio->bi_flags))
 		error = 0;
+	for (i = 0; i < bio->bi_vcnt; i++)
+		ext4_finish_page_write(&bio->bi_io_vec[i], error);
+	bio->bi_private = NULL;
+	bio->bi_end_io = NULL;
 	bio_put(bio);
 
-	for (i = 0; i < io_end->num_io_pages; i++) {
-		struct page *page = io_end->pages[i]->p_page;
-		struct buffer_head *bh, *head;
-		int partial_write = 0;
-
-		head = page_buffers(page);
-		if (error)
-			SetPageError(page);
-		BUG_ON(!head);
-		if (head->b_size == PAGE_CACHE_SIZE)
-			clear_buffer_dirty(head);
-		else {
-			loff_t offset;
-			loff_t io_end_offset = io_end->offset + io_end->size;
-
-			offset = (sector_t) page->index << PAGE_CACHE_SHIFT;
-			bh = head;
-			do {
-				if ((offset >= io_end->offset) &&
-				    (offset+bh->b_size <= io_end_offset)) {
-					if (error)
-						buffer_io_error(bh);
-
-					clear_buffer_dirty(bh);
-				}
-				if (buffer_delay(bh))
-					partial_write = 1;
-				else if (!buffer_mapped(bh))
-					clear_buffer_dirty(bh);
-				else if (buffer_dirty(bh))
-					partial_write = 1;
-				offset += bh->b_size;
-				bh = bh->b_this_page;
-			} while (bh != head);
-		}
-
-		put_io_page(io_end->pages[i]);
-
-		/*
-		 * If this is a partial write which happened to make
-		 * all buffers uptodate then we can optimize away a
-		 * bogus readpage() for the next read(). Here we
-		 * 'discover' whether the page went uptodate as a
-		 * result of this (potentially partial) write.
-		 */
-		if (!partial_write)
-			SetPageUptodate(page);
-	}
-	io_end->num_io_pages = 0;
 	inode = io_end->inode;
-
 	if (error) {
 		io_end->flag |= EXT4_IO_END_ERROR;
 		ext4_warning(inode->i_sb, "I/O error writing to inode %lu "
@@ -260,17 +348,15 @@ static void ext4_end_bio(struct bio *bio, int error)
 			     (unsigned long long) io_end->offset,
 			     (long) io_end->size,
 			     (unsigned long long)
-			     bio->bi_sector >> (inode->i_blkbits - 9));
+			     bi_sector >> (inode->i_blkbits - 9));
 	}
 
-	/* Add the io_end to per-inode completed io list*/
-	spin_lock_irqsave(&EXT4_I(inode)->i_completed_io_lock, flags);
-	list_add_tail(&io_end->list, &EXT4_I(inode)->i_completed_io_list);
-	spin_unlock_irqrestore(&EXT4_I(inode)->i_completed_io_lock, flags);
-
-	wq = EXT4_SB(inode->i_sb)->dio_unwritten_wq;
+	if (!(io_end->flag & EXT4_IO_END_UNWRITTEN)) {
+		ext4_free_io_end(io_end);
+		return;
+	}
 	/* queue the work to convert unwritten extents to written */
-	queue_work(wq, &io_end->work);
+	ext4_add_complete_io(io_end);
 }
 
 void ext4_io_submit(struct ext4_io_submit *io)
@@ -321,27 +407,12 @@ static int io_submit_init(struct ext4_io_submit *io,
 }
 
 static int io_submit_add_bh(struct ext4_io_submit *io,
-			    struct ext4_io_page *io_page,
 			    struct inode *inode,
 			    struct writeback_control *wbc,
 			    struct buffer_head *bh)
 {
-	ext4_io_end_t *io_end;
 	int ret;
 
-	if (buffer_new(bh)) {
-		clear_buffer_new(bh);
-		unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
-	}
-
-	if (!buffer_mapped(bh) || buffer_delay(bh)) {
-		if (!buffer_mapped(bh))
-			clear_buffer_dirty(bh);
-		if (io->io_bio)
-			ext4_io_submit(io);
-		return 0;
-	}
-
 	if (io->io_bio && bh->b_blocknr != io->io_next_block) {
 submit_and_retry:
 		ext4_io_submit(io);
@@ -351,25 +422,23 @@ submit_and_retry:
 		if (ret)
 			return ret;
 	}
-	io_end = io->io_end;
-	if ((io_end->num_io_pages >= MAX_IO_PAGES) &&
-	    (io_end->pages[io_end->num_io_pages-1] != io_page))
+	ret = bio_add_page(io->io_bio, bh->b_page, bh->b_size, bh_offset(bh));
+	if (ret != bh->b_size)
 		goto submit_and_retry;
 	if (buffer_uninit(bh))
 		io->io_end->flag |= EXT4_IO_END_UNWRITTEN;
 	io->io_end->size += bh->b_size;
 	io->io_next_block++;
-	ret = bio_add_page(io->io_bio, bh->b_page, bh->b_size, bh_offset(bh));
-	if (ret != bh->b_size)
-		goto submit_and_retry;
-	if ((io_end->num_io_pages == 0) ||
-	    (io_end->pages[io_end->num_io_pages-1] != io_page)) {
-		io_end->pages[io_end->num_io_pages++] = io_page;
-		atomic_inc(&io_page->p_count);
-	}
 	return 0;
 }
 
+/*
+ * Add the mapped buffers of @page to the bio being built in @io.  The bio
+ * is only submitted when the next buffer is not contiguous on disk or the
+ * bio is full, so the caller has to call ext4_io_submit() once it is done
+ * adding pages.  Each buffer under I/O is marked BH_Async_Write, which
+ * ext4_end_bio() uses to tell when the whole page has been written.
+ */
 int ext4_bio_write_page(struct ext4_io_submit *io,
 			struct page *page,
 			int len,
@@ -377,8 +446,9 @@ int ext4_bio_write_page(struct ext4_io_submit *io,
 {
 	struct inode *inode = page->mapping->host;
 	unsigned block_start, block_end, blocksize;
-	struct ext4_io_page *io_page;
 	struct buffer_head *bh, *head;
+	unsigned long flags;
+	int nr_submitted = 0, under_io = 0;
 	int ret = 0;
 
 	blocksize = 1 << inode->i_blkbits;
@@ -387,16 +457,7 @@ int ext4_bio_write_page(struct ext4_io_submit *io,
 	set_page_writeback(page);
 	ClearPageError(page);
 
-	io_page = kmem_cache_alloc(io_page_cachep, GFP_NOFS);
-	if (!io_page) {
-		set_page_dirty(page);
-		unlock_page(page);
-		return -ENOMEM;
-	}
-	io_page->p_page = page;
-	atomic_set(&io_page->p_count, 1);
-	get_page(page);
-
+	/* mark all buffers to write before submitting any of them */
 	for (bh = head = page_buffers(page), block_start = 0;
 	     bh != head || !block_start;
 	     block_start = block_end, bh = bh->b_this_page) {
@@ -406,7 +467,27 @@ int ext4_bio_write_page(struct ext4_io_submit *io,
 			set_buffer_uptodate(bh);
 			continue;
 		}
-		ret = io_submit_add_bh(io, io_page, inode, wbc, bh);
+		if (!buffer_mapped(bh) || buffer_delay(bh)) {
+			if (!buffer_mapped(bh))
+				clear_buffer_dirty(bh);
+			continue;
+		}
+		if (buffer_new(bh)) {
+			clear_buffer_new(bh);
+			unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+		}
+		set_buffer_async_write(bh);
+	}
+
+	bh = head;
+	do {
+		if (!buffer_async_write(bh)) {
+			/* a hole or delayed buffer ends the bio */
+			if (io->io_bio && bh_offset(bh) < len)
+				ext4_io_submit(io);
+			continue;
+		}
+		ret = io_submit_add_bh(io, inode, wbc, bh);
 		if (ret) {
 			/*
 			 * We only get here on ENOMEM.  Not much else
@@ -416,16 +497,39 @@ int ext4_bio_write_page(struct ext4_io_submit *io,
 			set_page_dirty(page);
 			break;
 		}
-	}
+		clear_buffer_dirty(bh);
+		nr_submitted++;
+	} while ((bh = bh->b_this_page) != head);
 	unlock_page(page);
+
 	/*
-	 * If the page was truncated before we could do the writeback,
-	 * or we had a memory allocation error while trying to write
-	 * the first buffer head, we won't have submitted any pages for
-	 * I/O.  In that case we need to make sure we've cleared the
-	 * PageWriteback bit from the page to prevent the system from
-	 * wedging later on.
+	 * If the page was truncated before we could do the writeback, or
+	 * has no mapped buffers, nothing was submitted and we end writeback
+	 * here.  Otherwise the completion of the last buffer does it.
 	 */
-	put_io_page(io_page);
+	if (!ret) {
+		if (!nr_submitted)
+			end_page_writeback(page);
+		return 0;
+	}
+
+	/*
+	 * On error drop the buffers that were not added.  Buffers that
+	 * completed meanwhile saw those still marked and left the page
+	 * alone, so end writeback here unless some are still under I/O.
+	 */
+	local_irq_save(flags);
+	bit_spin_lock(BH_Uptodate_Lock, &head->b_state);
+	do {
+		clear_buffer_async_write(bh);
+	} while ((bh = bh->b_this_page) != head);
+	do {
+		if (buffer_async_write(bh))
+			under_io = 1;
+	} while ((bh = bh->b_this_page) != head);
+	bit_spin_unlock(BH_Uptodate_Lock, &head->b_state);
+	local_irq_restore(flags);
+	if (!under_io)
+		end_page_writeback(page);
 	return ret;
 }
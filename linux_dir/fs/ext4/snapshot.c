@@ -40,7 +40,7 @@ int ext4_snapshot_map_blocks(handle_t *handle, struct inode *inode,
 	int err;
 	struct ext4_map_blocks map;
 	map.m_len = maxblocks;
-	map.m_pblk = SNAPSHOT_IBLOCK(block);
+	map.m_lblk = SNAPSHOT_IBLOCK(block);
 #ifdef WARNING_NOT_IMPLEMENTED
 	map.m_flag = ?;
 #endif
@@ -72,6 +72,8 @@ int ext4_snapshot_map_blocks(handle_t *handle, struct inode *inode,
  * return value 1 indicates snapshot inode read through access
  * in which case 'prev_snapshot' is pointed to the previous snapshot
  * on the list or set to NULL to indicate read through to block device.
+ * The decision itself is made by ext4_snapshot_read_access() from a
+ * single read of the snapshot flags and list pointer.
  */
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
 /*
@@ -119,6 +121,7 @@ int ext4_snapshot_get_inode_access(handle_t *handle, struct inode *inode,
 {
 	struct ext4_inode_info *ei = EXT4_I(inode);
 	unsigned int flags = ei->i_flags;
+	unsigned int access = 0;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
 	struct list_head *prev = ei->i_snaplist.prev;
 #endif
@@ -146,68 +149,56 @@ int ext4_snapshot_get_inode_access(handle_t *handle, struct inode *inode,
 		BUG_ON(handle && IS_COWING(handle));
 #endif
 
-	if (!(flags & EXT4_SNAPFILE_LIST_FL))
+	/*
+	 * Sample the snapshot state once and decide between normal access,
+	 * denied access and snapshot image read through access, which is
+	 * (!cmd && !handle) from ext4_snapshot_readpage() calling
+	 * ext4_snapshot_get_block().
+	 */
+	if (flags & EXT4_SNAPFILE_LIST_FL)
+		access |= SNAPSHOT_ACCESS_LIST;
+	if (cmd)
+		access |= SNAPSHOT_ACCESS_WRITE;
+	if (handle)
+		access |= SNAPSHOT_ACCESS_HANDLE;
+	if (ext4_snapshot_is_active(inode) || (flags & EXT4_SNAPFILE_ACTIVE_FL))
+		access |= SNAPSHOT_ACCESS_ACTIVE;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
-		if (prev && prev == &EXT4_SB(inode->i_sb)->s_snapshot_list)
-			/* normal access to snapshot being taken */
-			return 0;
-		/* snapshot not on the list - read/write access denied */
-		return -EPERM;
-#else
-		return 0;
+	if (prev && prev == &EXT4_SB(inode->i_sb)->s_snapshot_list)
+		/* snapshot being taken or active snapshot not found */
+		access |= SNAPSHOT_ACCESS_PREV_HEAD;
+	else if (!prev || list_empty(prev))
+		access |= SNAPSHOT_ACCESS_UNLISTED;
 #endif
 
-	if (cmd) {
-		/* snapshot inode write access */
-		snapshot_debug(1, "snapshot (%u) is read-only"
-				" - write access denied!\n",
-				inode->i_generation);
+	switch (ext4_snapshot_read_access(access, iblock)) {
+	case SNAPSHOT_READ_NORMAL:
+		return 0;
+	case SNAPSHOT_READ_DENY:
+		if (cmd)
+			snapshot_debug(1, "snapshot (%u) is read-only"
+					" - write access denied!\n",
+					inode->i_generation);
 		return -EPERM;
-	} else {
-		/* snapshot inode read access */
-		if (iblock < SNAPSHOT_BLOCK_OFFSET)
-			/* snapshot reserved blocks */
-			return 0;
-		/*
-		 * non NULL handle indicates this is test_and_cow()
-		 * checking if snapshot block is mapped
-		 */
-		if (handle)
-			return 0;
-	}
-
-	/*
-	 * Snapshot image read through access: (!cmd && !handle)
-	 * indicates this is ext4_snapshot_readpage()
-	 * calling ext4_snapshot_get_block()
-	 */
-	*prev_snapshot = NULL;
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
-	if (ext4_snapshot_is_active(inode) ||
-			(flags & EXT4_SNAPFILE_ACTIVE_FL))
+	case SNAPSHOT_READ_BDEV:
 		/* read through from active snapshot to block device */
+		*prev_snapshot = NULL;
+		return 1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
+	case SNAPSHOT_READ_PREV:
+		/* read through to prev snapshot on the list */
+		ei = list_entry(prev, struct ext4_inode_info, i_snaplist);
+		*prev_snapshot = &ei->vfs_inode;
+		if (!ext4_snapshot_file(*prev_snapshot))
+			/* non snapshot file on the list? */
+			return -EIO;
 		return 1;
-
-	if (list_empty(prev))
-		/* not on snapshots list? */
-		return -EIO;
-
-	if (prev == &EXT4_SB(inode->i_sb)->s_snapshot_list)
-		/* active snapshot not found on list? */
-		return -EIO;
-
-	/* read through to prev snapshot on the list */
-	ei = list_entry(prev, struct ext4_inode_info, i_snaplist);
-	*prev_snapshot = &ei->vfs_inode;
-
-	if (!ext4_snapshot_file(*prev_snapshot))
-		/* non snapshot file on the list? */
-		return -EIO;
-
-	return 1;
-#else
-	return ext4_snapshot_is_active(inode) ? 1 : 0;
 #endif
+	default:
+		/* not on snapshots list or active snapshot not found */
+		*prev_snapshot = NULL;
+		return -EIO;
+	}
 }
 #endif
 
@@ -236,14 +227,9 @@ static inline void
 __ext4_snapshot_copy_bitmap(struct buffer_head *sbh,
 		char *dst, const char *src, const char *mask)
 {
-	const u32 *ps = (const u32 *)src, *pm = (const u32 *)mask;
-	u32 *pd = (u32 *)dst;
-	int i;
-
-	if (mask) {
-		for (i = 0; i < SNAPSHOT_ADDR_PER_BLOCK; i++)
-			*pd++ = *ps++ & ~*pm++;
-	} else
+	if (mask)
+		ext4_snapshot_mask_bitmap(dst, src, mask);
+	else
 		memcpy(dst, src, SNAPSHOT_BLOCK_SIZE);
 
 	set_buffer_uptodate(sbh);
@@ -519,7 +505,6 @@ ext4_snapshot_test_cow_bitmap(handle_t *handle, struct inode *snapshot,
 	unsigned long block_group = SNAPSHOT_BLOCK_GROUP(block);
 	ext4_grpblk_t bit = SNAPSHOT_BLOCK_GROUP_OFFSET(block);
 	ext4_fsblk_t snapshot_blocks = SNAPSHOT_BLOCKS(snapshot);
-	int inuse;
 
 	if (block >= snapshot_blocks)
 		/*
@@ -536,13 +521,7 @@ ext4_snapshot_test_cow_bitmap(handle_t *handle, struct inode *snapshot,
 	 * if the bit is set in the COW bitmap,
 	 * then the block is in use by snapshot
 	 */
-	for (inuse = 0; inuse < maxblocks && bit+inuse <
-			 SNAPSHOT_BLOCKS_PER_GROUP; inuse++) {
-		if (!ext4_test_bit(bit+inuse, cow_bh->b_data))
-			break;
-	}
-
-	return inuse;
+	return ext4_snapshot_count_inuse(cow_bh->b_data, bit, maxblocks);
 }
 #endif
 
@@ -777,6 +756,7 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 		snapshot_debug_hl(4, "active snapshot access denied!\n");
 		return -EPERM;
 	}
+	snapshot_stat_inc(sb, SNAPSTAT_COW_TESTED);
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
 	/* check if the buffer was COWed in the current transaction */
@@ -819,6 +799,18 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 		goto cowed;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_READAHEAD
+	if (cow && bh && buffer_mapped(bh) && !buffer_uptodate(bh))
+		/*
+		 * The block is in use by snapshot.  Start reading the source
+		 * buffer now, so the read overlaps with the snapshot mapping
+		 * lookups below.  If the block needs to be COWed, we wait for
+		 * the read before copying.  ll_rw_block() skips the buffer
+		 * while it is locked.
+		 */
+		ll_rw_block(READ, 1, &bh);
+
+#endif
 	/* block is in use by snapshot - check if it is mapped */
 	err = ext4_snapshot_map_blocks(handle, active_snapshot, block, 1, &blk,
 					SNAPMAP_READ);
@@ -827,9 +819,22 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 	if (err > 0) {
 		sbh = sb_find_get_block(sb, blk);
 		trace_cow_inc(handle, ok_mapped);
+		snapshot_stat_inc(sb, SNAPSTAT_COW_MAPPED);
 		err = 0;
 		goto test_pending_cow;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	/* not mapped - check if it is packed */
+	err = ext4_snapshot_pack_test(active_snapshot, block);
+	if (err < 0)
+		goto out;
+	if (err > 0) {
+		trace_cow_inc(handle, ok_mapped);
+		snapshot_stat_inc(sb, SNAPSTAT_COW_MAPPED);
+		err = 0;
+		goto cowed;
+	}
+#endif
 
 	/* block needs to be COWed */
 	err = -EIO;
@@ -850,6 +855,19 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 			goto out;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	/* try to pack a compressed copy in a shared snapshot block */
+	err = ext4_snapshot_pack_cow(handle, active_snapshot, bh);
+	if (err < 0)
+		goto out;
+	if (err > 0) {
+		trace_cow_inc(handle, copied);
+		snapshot_stat_inc(sb, SNAPSTAT_COW_PACKED);
+		err = 0;
+		goto cowed;
+	}
+	err = -EIO;
+#endif
 	/* try to allocate snapshot block to make a backup copy */
 	sbh = ext4_getblk(handle, active_snapshot, SNAPSHOT_IBLOCK(block),
 			   SNAPMAP_COW, &err);
@@ -863,6 +881,7 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 		 * another COWing task must have allocated it
 		 */
 		trace_cow_inc(handle, ok_mapped);
+		snapshot_stat_inc(sb, SNAPSTAT_COW_MAPPED);
 		goto test_pending_cow;
 	}
 
@@ -880,6 +899,7 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 			SNAPSHOT_BLOCK_TUPLE(sbh->b_blocknr));
 
 	trace_cow_inc(handle, copied);
+	snapshot_stat_inc(sb, SNAPSTAT_COW_COPIED);
 test_pending_cow:
 
 cowed:
@@ -979,9 +999,22 @@ int ext4_snapshot_test_and_move(const char *where, handle_t *handle,
 	if (err > 0) {
 		/* block already mapped in snapshot - no need to move */
 		trace_cow_inc(handle, ok_mapped);
+		snapshot_stat_inc(sb, SNAPSTAT_COW_MAPPED);
 		err = 0;
 		goto out;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	err = ext4_snapshot_pack_test(active_snapshot, block);
+	if (err < 0)
+		goto out;
+	if (err > 0) {
+		/* block already packed in snapshot - no need to move */
+		trace_cow_inc(handle, ok_mapped);
+		snapshot_stat_inc(sb, SNAPSTAT_COW_MAPPED);
+		err = 0;
+		goto out;
+	}
+#endif
 
 	/* @count blocks need to be moved */
 	err = count;
@@ -1003,6 +1036,7 @@ int ext4_snapshot_test_and_move(const char *where, handle_t *handle,
 	if (inode)
 		dquot_free_block(inode, count);
 	trace_cow_add(handle, moved, count);
+	snapshot_stat_add(sb, SNAPSTAT_COW_MOVED, count);
 out:
 	/* END moving */
 	ext4_snapshot_cow_end(where, handle, block, err);
@@ -19,16 +19,11 @@
 #include <linux/delay.h>
 #include "ext4_jbd2.h"
 #include "snapshot_debug.h"
+#include "snapshot_map.h"
 
 
 #define EXT4_SNAPSHOT_VERSION "ext4 snapshot v1.0.13-rc3 (1-Nov-2010)"
 
-/*
- * use signed 64bit for snapshot image addresses
- * negative addresses are used to reference snapshot meta blocks
- */
-#define ext4_snapblk_t long long
-
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 34))
 /* one snapshot patch fits all kernel versions */
 #define dquot_file_open generic_file_open
@@ -36,53 +31,6 @@
 #define dquot_free_block vfs_dq_free_block
 #endif
 
-/*
- * We assert that snapshot must use a file system with block size == page
- * size (4K) and that the first file system block is block 0.
- * Snapshot inode direct blocks are reserved for snapshot meta blocks.
- * Snapshot inode single indirect blocks are not used.
- * Snapshot image starts at the first double indirect block.
- * This way, a snapshot image block group can be mapped with 1 double
- * indirect block + 32 indirect blocks.
- */
-#define SNAPSHOT_BLOCK_SIZE		PAGE_SIZE
-#define SNAPSHOT_BLOCK_SIZE_BITS	PAGE_SHIFT
-#define	SNAPSHOT_ADDR_PER_BLOCK		(SNAPSHOT_BLOCK_SIZE / sizeof(__u32))
-#define SNAPSHOT_ADDR_PER_BLOCK_BITS	(SNAPSHOT_BLOCK_SIZE_BITS - 2)
-#define SNAPSHOT_DIR_BLOCKS		EXT4_NDIR_BLOCKS
-#define SNAPSHOT_IND_BLOCKS		SNAPSHOT_ADDR_PER_BLOCK
-
-#define SNAPSHOT_BLOCKS_PER_GROUP_BITS	15
-#define SNAPSHOT_BLOCKS_PER_GROUP					\
-	(1<<SNAPSHOT_BLOCKS_PER_GROUP_BITS) /* 32K */
-#define SNAPSHOT_BLOCK_GROUP(block)		\
-	((block)>>SNAPSHOT_BLOCKS_PER_GROUP_BITS)
-#define SNAPSHOT_BLOCK_GROUP_OFFSET(block)	\
-	((block)&(SNAPSHOT_BLOCKS_PER_GROUP-1))
-#define SNAPSHOT_BLOCK_TUPLE(block)		\
-	(ext4_fsblk_t)SNAPSHOT_BLOCK_GROUP_OFFSET(block), \
-	(ext4_fsblk_t)SNAPSHOT_BLOCK_GROUP(block)
-#define SNAPSHOT_IND_PER_BLOCK_GROUP_BITS				\
-	(SNAPSHOT_BLOCKS_PER_GROUP_BITS-SNAPSHOT_ADDR_PER_BLOCK_BITS)
-#define SNAPSHOT_IND_PER_BLOCK_GROUP			\
-	(1<<SNAPSHOT_IND_PER_BLOCK_GROUP_BITS) /* 32 */
-#define SNAPSHOT_DIND_BLOCK_GROUPS_BITS					\
-	(SNAPSHOT_ADDR_PER_BLOCK_BITS-SNAPSHOT_IND_PER_BLOCK_GROUP_BITS)
-#define SNAPSHOT_DIND_BLOCK_GROUPS			\
-	(1<<SNAPSHOT_DIND_BLOCK_GROUPS_BITS) /* 32 */
-
-#define SNAPSHOT_BLOCK_OFFSET				\
-	(SNAPSHOT_DIR_BLOCKS+SNAPSHOT_IND_BLOCKS)
-#define SNAPSHOT_BLOCK(iblock)					\
-	((ext4_snapblk_t)(iblock) - SNAPSHOT_BLOCK_OFFSET)
-#define SNAPSHOT_IBLOCK(block)						\
-	(ext4_fsblk_t)((block) + SNAPSHOT_BLOCK_OFFSET)
-
-#define SNAPSHOT_BYTES_OFFSET					\
-	(SNAPSHOT_BLOCK_OFFSET << SNAPSHOT_BLOCK_SIZE_BITS)
-#define SNAPSHOT_ISIZE(size)			\
-	((size) + SNAPSHOT_BYTES_OFFSET)
-
 #define SNAPSHOT_SET_SIZE(inode, size)				\
 	(EXT4_I(inode)->i_disksize = SNAPSHOT_ISIZE(size))
 #define SNAPSHOT_SIZE(inode)					\
@@ -177,6 +125,23 @@ extern int ext4_snapshot_test_and_cow(const char *where,
 #define ext4_snapshot_cow(handle, inode, bh, cow) 0
 #endif
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+/*
+ * Packed snapshot functions (snapshot_pack.c)
+ */
+extern int ext4_snapshot_pack_test(struct inode *snapshot,
+		ext4_fsblk_t block);
+extern int ext4_snapshot_pack_cow(handle_t *handle, struct inode *snapshot,
+		struct buffer_head *bh);
+extern int ext4_snapshot_pack_readpage(struct inode *inode,
+		struct page *page);
+extern void ext4_snapshot_pack_free(struct inode *inode);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+extern unsigned long ext4_snapshot_pack_usage(struct inode *inode);
+extern unsigned long ext4_snapshot_pack_shrink(struct inode *inode);
+#endif
+
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE
 extern int ext4_snapshot_test_and_move(const char *where,
 		handle_t *handle, struct inode *inode,
@@ -326,6 +291,68 @@ extern int ext4_snapshot_load(struct super_block *sb,
 extern int ext4_snapshot_update(struct super_block *sb, int cleanup,
 		int read_only);
 extern void ext4_snapshot_destroy(struct super_block *sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+extern void ext4_snapshot_cache_init(struct super_block *sb);
+extern void ext4_snapshot_cache_exit(struct super_block *sb);
+extern void ext4_snapshot_cache_limit(struct super_block *sb);
+extern void ext4_snapshot_cache_release(struct inode *inode);
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+/*
+ * Snapshot statistics, summed over all cpus by
+ * /proc/fs/ext4/<dev>/snapshot_stats.  The *_MAX_USEC counters are
+ * maximums, which are kept per-cpu and reported as the maximum of all cpus.
+ */
+#define SNAPSTAT_COW_TESTED		0	/* ext4_snapshot_test_and_cow() */
+#define SNAPSTAT_COW_MAPPED		1	/* blocks found already COWed */
+#define SNAPSTAT_COW_COPIED		2	/* blocks copied to snapshot */
+#define SNAPSTAT_COW_PACKED		3	/* blocks packed to snapshot */
+#define SNAPSTAT_COW_MOVED		4	/* blocks moved to snapshot */
+#define SNAPSTAT_READ_THROUGH		5	/* snapshot read through maps */
+#define SNAPSTAT_READ_THROUGH_HOPS	6	/* ... to a newer snapshot */
+#define SNAPSTAT_READ_THROUGH_USEC	7	/* time spent mapping them */
+#define SNAPSTAT_READ_THROUGH_MAX_USEC	8
+#define SNAPSTAT_TAKE			9	/* snapshots taken */
+#define SNAPSTAT_TAKE_USEC		10	/* time handles were blocked */
+#define SNAPSTAT_TAKE_MAX_USEC		11
+#define SNAPSHOT_STATS_NUM		12
+
+struct ext4_snapshot_stats {
+	s64 ss_stat[SNAPSHOT_STATS_NUM];
+};
+
+extern void ext4_snapshot_stats_init(struct super_block *sb);
+extern void ext4_snapshot_stats_exit(struct super_block *sb);
+
+/* counters are allocated at the end of mount - don't count until then */
+static inline void snapshot_stat_add(struct super_block *sb, int i, s64 n)
+{
+	struct ext4_snapshot_stats __percpu *stats = EXT4_SB(sb)->s_snapshot_stats;
+
+	if (stats)
+		this_cpu_add(stats->ss_stat[i], n);
+}
+
+static inline void snapshot_stat_max(struct super_block *sb, int i, s64 val)
+{
+	struct ext4_snapshot_stats __percpu *stats = EXT4_SB(sb)->s_snapshot_stats;
+	s64 *max;
+
+	if (!stats)
+		return;
+	max = &per_cpu_ptr(stats, get_cpu())->ss_stat[i];
+	if (*max < val)
+		*max = val;
+	put_cpu();
+}
+
+#define snapshot_stat_inc(sb, i)	snapshot_stat_add(sb, i, 1)
+#else
+#define snapshot_stat_add(sb, i, n)
+#define snapshot_stat_max(sb, i, val)
+#define snapshot_stat_inc(sb, i)
+#endif
 
 static inline int init_ext4_snapshot(void)
 {
@@ -382,6 +409,14 @@ static inline int ext4_snapshot_list(struct inode *inode)
 {
 	return EXT4_I(inode)->i_flags & EXT4_SNAPFILE_LIST_FL;
 }
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+
+/* tests if COWed blocks of @inode snapshot are packed */
+static inline int ext4_snapshot_packed(struct inode *inode)
+{
+	return EXT4_I(inode)->i_flags & EXT4_SNAPFILE_PACKED_FL;
+}
+#endif
 #endif
 
 
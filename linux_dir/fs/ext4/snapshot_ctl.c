@@ -15,6 +15,10 @@
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
 #include <linux/statfs.h>
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#endif
 #include "snapshot.h"
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
@@ -466,6 +470,11 @@ static int ext4_snapshot_create(struct inode *inode)
 	/* record the file system size in the snapshot inode disksize field */
 	SNAPSHOT_SET_BLOCKS(inode, snapshot_blocks);
 	SNAPSHOT_SET_DISABLED(inode);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	/* pack COWed blocks of new snapshot? */
+	if (sbi->s_snapshot_pack)
+		ei->i_flags |= EXT4_SNAPFILE_PACKED_FL;
+#endif
 
 	if (!EXT4_HAS_RO_COMPAT_FEATURE(sb,
 		EXT4_FEATURE_RO_COMPAT_HAS_SNAPSHOT))
@@ -759,6 +768,30 @@ static char *copy_inode_block_name[COPY_INODE_BLOCKS_NUM] = {
 };
 #endif
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_NOFREEZE
+/*
+ * ext4_snapshot_lock_updates() - block new transaction handles and flush
+ * the journal before the active snapshot is switched.
+ * The journal has to be checkpointed first: until checkpoint, the home
+ * location of a committed block holds stale data, which snapshot read
+ * through would return, and the checkpoint write itself is not seen by
+ * the COW hooks.  Writers therefore stall for the same journal flush as
+ * with freeze_fs().  Only the super block write and the clearing of the
+ * journal RECOVER flag are skipped.
+ */
+static int ext4_snapshot_lock_updates(struct super_block *sb)
+{
+	journal_t *journal = EXT4_SB(sb)->s_journal;
+	int err;
+
+	jbd2_journal_lock_updates(journal);
+	err = jbd2_journal_flush(journal);
+	if (err)
+		jbd2_journal_unlock_updates(journal);
+	return err;
+}
+
+#endif
 /*
  * ext4_snapshot_take() makes a new snapshot file
  * into the active snapshot
@@ -794,6 +827,10 @@ int ext4_snapshot_take(struct inode *inode)
 	u64 snapshot_r_blocks;
 	struct kstatfs statfs;
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	ktime_t stall = ktime_set(0, 0);
+	s64 usec;
+#endif
 
 	if (!sbi->s_sbh)
 		goto out_err;
@@ -851,11 +888,25 @@ int ext4_snapshot_take(struct inode *inode)
 	}
 #endif
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	stall = ktime_get();
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_NOFREEZE
+	/*
+	 * block new handles and flush the journal
+	 * before taking the snapshot
+	 */
+	err = ext4_snapshot_lock_updates(sb);
+	if (err)
+		goto out_err;
+	err = -EIO;
+#else
 	/*
 	 * flush journal to disk and clear the RECOVER flag
 	 * before taking the snapshot
 	 */
 	sb->s_op->freeze_fs(sb);
+#endif
 	lock_super(sb);
 
 #ifdef CONFIG_EXT4_FS_DEBUG
@@ -884,6 +935,14 @@ int ext4_snapshot_take(struct inode *inode)
 	es->s_snapshot_inum = 0;
 	es->s_snapshot_list = 0;
 	es->s_flags |= cpu_to_le32(EXT4_FLAGS_IS_SNAPSHOT);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_NOFREEZE
+	/*
+	 * The journal was committed, but RECOVER flag was not cleared.
+	 * The snapshot image is a consistent image with no journal to replay.
+	 */
+	es->s_feature_incompat &=
+		~cpu_to_le32(EXT4_FEATURE_INCOMPAT_RECOVER);
 #endif
 	set_buffer_uptodate(sbh);
 	unlock_buffer(sbh);
@@ -1007,10 +1066,20 @@ fix_inode_copy:
 	err = 0;
 out_unlockfs:
 	unlock_super(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_NOFREEZE
+	jbd2_journal_unlock_updates(sbi->s_journal);
+#else
 	sb->s_op->unfreeze_fs(sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	usec = ktime_us_delta(ktime_get(), stall);
+	snapshot_stat_add(sb, SNAPSTAT_TAKE_USEC, usec);
+	snapshot_stat_max(sb, SNAPSTAT_TAKE_MAX_USEC, usec);
+#endif
 
 	if (err)
 		goto out_err;
+	snapshot_stat_inc(sb, SNAPSTAT_TAKE);
 
 	snapshot_debug(1, "snapshot (%u) has been taken\n",
 			inode->i_generation);
@@ -1565,6 +1634,219 @@ prev_snapshot:
 #endif
 	return err;
 }
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+/*
+ * Snapshot cache:
+ * Reading a snapshot image fills the page cache of the snapshot file and,
+ * for packed snapshots, the in-memory pack index.  Snapshots are rarely
+ * read, and usually only the newest snapshots are, so the cached data of
+ * old snapshots should be the first to go on memory pressure.
+ * A per-sb shrinker and a tunable soft limit (snapshot_cache_kb) drop the
+ * cached data of the inactive snapshots, starting from the oldest.
+ * The active snapshot cache is never dropped, because it is used by COW.
+ *
+ * Other snapshot metadata is deliberately left out:
+ * - Snapshot indirect blocks and COW bitmaps are read with sb_bread() into
+ *   the block device page cache and are not pinned after use, so the VM
+ *   already reclaims them from its LRU like any other clean metadata.
+ *   They are not indexed by snapshot, so counting them per snapshot would
+ *   mean walking every snapshot's block map.  COW bitmaps only exist for
+ *   the active snapshot anyway.
+ * - Snapshot inodes are pinned by igrab() while on the snapshots list,
+ *   because the list is chained through the in-memory inodes and read
+ *   through follows it.  That costs one inode per snapshot, which is
+ *   bounded by the no. of snapshots and not by their size.
+ */
+
+/* no. of bytes cached by snapshot @inode */
+static unsigned long ext4_snapshot_cache_usage(struct inode *inode)
+{
+	unsigned long bytes = inode->i_mapping->nrpages << PAGE_CACHE_SHIFT;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	bytes += ext4_snapshot_pack_usage(inode);
+#endif
+	return bytes;
+}
+
+/*
+ * ext4_snapshot_cache_total() - no. of bytes cached by inactive snapshots
+ * Called under snapshot_mutex.
+ */
+static unsigned long ext4_snapshot_cache_total(struct super_block *sb)
+{
+	struct ext4_inode_info *ei;
+	unsigned long bytes = 0;
+
+	list_for_each_entry(ei, &EXT4_SB(sb)->s_snapshot_list, i_snaplist) {
+		if (!ext4_snapshot_is_active(&ei->vfs_inode))
+			bytes += ext4_snapshot_cache_usage(&ei->vfs_inode);
+	}
+	return bytes;
+}
+
+/*
+ * ext4_snapshot_shrink_cache() - drop cached data of inactive snapshots
+ * @nr: no. of bytes to free
+ * Snapshots are shrunk from the oldest backwards.  Pages that are dirty,
+ * locked or mapped are skipped.
+ * Called under snapshot_mutex.
+ * Returns the no. of bytes freed.
+ */
+static unsigned long ext4_snapshot_shrink_cache(struct super_block *sb,
+		unsigned long nr)
+{
+	struct ext4_inode_info *ei;
+	struct inode *inode;
+	unsigned long freed = 0;
+
+	list_for_each_entry_reverse(ei, &EXT4_SB(sb)->s_snapshot_list,
+				    i_snaplist) {
+		if (freed >= nr)
+			break;
+		inode = &ei->vfs_inode;
+		if (ext4_snapshot_is_active(inode))
+			continue;
+		freed += invalidate_mapping_pages(inode->i_mapping, 0, -1) <<
+			PAGE_CACHE_SHIFT;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+		freed += ext4_snapshot_pack_shrink(inode);
+#endif
+		snapshot_debug(4, "snapshot (%u) cache shrunk (%lu KB freed)\n",
+			       inode->i_generation, freed >> 10);
+	}
+	return freed;
+}
+
+/*
+ * ext4_snapshot_cache_limit() - shrink snapshots cache to the soft limit
+ * Called under snapshot_mutex.
+ */
+void ext4_snapshot_cache_limit(struct super_block *sb)
+{
+	unsigned long limit = EXT4_SB(sb)->s_snapshot_cache_kb;
+	unsigned long usage;
+
+	if (!limit)
+		return;
+	usage = ext4_snapshot_cache_total(sb);
+	if (usage > (limit << 10))
+		ext4_snapshot_shrink_cache(sb, usage - (limit << 10));
+}
+
+/*
+ * ext4_snapshot_cache_release() - enforce the soft limit on snapshot close
+ * Called from ext4_release_file() on close of snapshot @inode (i.e., on
+ * snapshot unmount), after which its cache is likely to be cold.
+ */
+void ext4_snapshot_cache_release(struct inode *inode)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+
+	if (!sbi->s_snapshot_cache_kb ||
+	    !mutex_trylock(&sbi->s_snapshot_mutex))
+		return;
+	ext4_snapshot_cache_limit(inode->i_sb);
+	mutex_unlock(&sbi->s_snapshot_mutex);
+}
+
+static int ext4_snapshot_cache_shrink(struct shrinker *shrink,
+		int nr_to_scan, gfp_t gfp_mask)
+{
+	struct ext4_sb_info *sbi = container_of(shrink, struct ext4_sb_info,
+						s_snapshot_shrinker);
+	unsigned long pages;
+
+	if (nr_to_scan && !(gfp_mask & __GFP_FS))
+		return -1;
+	/* don't wait for snapshot control operations */
+	if (!mutex_trylock(&sbi->s_snapshot_mutex))
+		return nr_to_scan ? -1 : 0;
+	if (nr_to_scan)
+		ext4_snapshot_shrink_cache(sbi->s_sb,
+			(unsigned long)nr_to_scan << PAGE_CACHE_SHIFT);
+	pages = ext4_snapshot_cache_total(sbi->s_sb) >>
+		PAGE_CACHE_SHIFT;
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+#ifdef CONFIG_PROC_FS
+/* /proc/fs/ext4/<dev>/snapshots - cache usage of each snapshot in KB */
+static int ext4_snapshot_cache_seq_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct ext4_inode_info *ei;
+	struct inode *inode;
+
+	seq_puts(seq, "#id ino flags cache_kb\n");
+	mutex_lock(&EXT4_SB(sb)->s_snapshot_mutex);
+	list_for_each_entry(ei, &EXT4_SB(sb)->s_snapshot_list, i_snaplist) {
+		char packed = '-';
+
+		inode = &ei->vfs_inode;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+		if (ext4_snapshot_packed(inode))
+			packed = 'p';
+#endif
+		seq_printf(seq, "%u %lu %c%c %lu\n", inode->i_generation,
+			   inode->i_ino,
+			   ext4_snapshot_is_active(inode) ? 'a' : '-', packed,
+			   ext4_snapshot_cache_usage(inode) >> 10);
+	}
+	mutex_unlock(&EXT4_SB(sb)->s_snapshot_mutex);
+	return 0;
+}
+
+static int ext4_snapshot_cache_seq_open(struct inode *inode,
+		struct file *file)
+{
+	return single_open(file, ext4_snapshot_cache_seq_show, PDE(inode)->data);
+}
+
+static const struct file_operations ext4_snapshot_cache_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ext4_snapshot_cache_seq_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
+/*
+ * ext4_snapshot_cache_init() - register the snapshot cache shrinker
+ * Called from ext4_fill_super() at the end of a successful mount.
+ */
+void ext4_snapshot_cache_init(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	sbi->s_snapshot_shrinker.shrink = ext4_snapshot_cache_shrink;
+	sbi->s_snapshot_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sbi->s_snapshot_shrinker);
+#ifdef CONFIG_PROC_FS
+	if (sbi->s_proc)
+		proc_create_data("snapshots", S_IRUGO, sbi->s_proc,
+				 &ext4_snapshot_cache_fops, sb);
+#endif
+}
+
+/*
+ * ext4_snapshot_cache_exit() - unregister the snapshot cache shrinker
+ * Called from ext4_put_super() before the snapshot list is destroyed.
+ */
+void ext4_snapshot_cache_exit(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+#ifdef CONFIG_PROC_FS
+	if (sbi->s_proc)
+		remove_proc_entry("snapshots", sbi->s_proc);
+#endif
+	unregister_shrinker(&sbi->s_snapshot_shrinker);
+}
+#endif
+
 #else
 int ext4_snapshot_load(struct super_block *sb, struct ext4_super_block *es,
 		int read_only)
@@ -1576,3 +1858,114 @@ void ext4_snapshot_destroy(struct super_block *sb)
 {
 }
 #endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+static const char *ext4_snapshot_stat_names[SNAPSHOT_STATS_NUM] = {
+	[SNAPSTAT_COW_TESTED]		= "cow_tested",
+	[SNAPSTAT_COW_MAPPED]		= "cow_mapped",
+	[SNAPSTAT_COW_COPIED]		= "cow_copied",
+	[SNAPSTAT_COW_PACKED]		= "cow_packed",
+	[SNAPSTAT_COW_MOVED]		= "cow_moved",
+	[SNAPSTAT_READ_THROUGH]		= "read_through",
+	[SNAPSTAT_READ_THROUGH_HOPS]	= "read_through_hops",
+	[SNAPSTAT_READ_THROUGH_USEC]	= "read_through_usec",
+	[SNAPSTAT_READ_THROUGH_MAX_USEC] = "read_through_max_usec",
+	[SNAPSTAT_TAKE]			= "take",
+	[SNAPSTAT_TAKE_USEC]		= "take_usec",
+	[SNAPSTAT_TAKE_MAX_USEC]	= "take_max_usec",
+};
+
+static inline int ext4_snapshot_stat_is_max(int i)
+{
+	return i == SNAPSTAT_READ_THROUGH_MAX_USEC ||
+		i == SNAPSTAT_TAKE_MAX_USEC;
+}
+
+/* /proc/fs/ext4/<dev>/snapshot_stats - one "name value" pair per line */
+static int ext4_snapshot_stats_seq_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct ext4_snapshot_stats sum, *ss;
+	int cpu, i;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		ss = per_cpu_ptr(EXT4_SB(sb)->s_snapshot_stats, cpu);
+		for (i = 0; i < SNAPSHOT_STATS_NUM; i++) {
+			if (!ext4_snapshot_stat_is_max(i))
+				sum.ss_stat[i] += ss->ss_stat[i];
+			else if (sum.ss_stat[i] < ss->ss_stat[i])
+				sum.ss_stat[i] = ss->ss_stat[i];
+		}
+	}
+	for (i = 0; i < SNAPSHOT_STATS_NUM; i++)
+		seq_printf(seq, "%s %lld\n", ext4_snapshot_stat_names[i],
+			   (long long)sum.ss_stat[i]);
+	return 0;
+}
+
+static int ext4_snapshot_stats_seq_open(struct inode *inode,
+		struct file *file)
+{
+	return single_open(file, ext4_snapshot_stats_seq_show, PDE(inode)->data);
+}
+
+/* any write resets the counters, so a benchmark can measure a single run */
+static ssize_t ext4_snapshot_stats_seq_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct super_block *sb = seq->private;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(EXT4_SB(sb)->s_snapshot_stats, cpu), 0,
+		       sizeof(struct ext4_snapshot_stats));
+	return count;
+}
+
+static const struct file_operations ext4_snapshot_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ext4_snapshot_stats_seq_open,
+	.read		= seq_read,
+	.write		= ext4_snapshot_stats_seq_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * ext4_snapshot_stats_init() - allocate the snapshot statistics counters
+ * Called from ext4_fill_super() at the end of a successful mount.
+ * Snapshot operations are not counted if allocation fails.
+ */
+void ext4_snapshot_stats_init(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	sbi->s_snapshot_stats = alloc_percpu(struct ext4_snapshot_stats);
+	if (!sbi->s_snapshot_stats) {
+		ext4_msg(sb, KERN_WARNING,
+			 "failed to allocate snapshot statistics");
+		return;
+	}
+	if (sbi->s_proc)
+		proc_create_data("snapshot_stats", S_IRUGO | S_IWUSR,
+				 sbi->s_proc, &ext4_snapshot_stats_fops, sb);
+}
+
+/*
+ * ext4_snapshot_stats_exit() - free the snapshot statistics counters
+ * Called from ext4_put_super().
+ */
+void ext4_snapshot_stats_exit(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (!sbi->s_snapshot_stats)
+		return;
+	if (sbi->s_proc)
+		remove_proc_entry("snapshot_stats", sbi->s_proc);
+	free_percpu(sbi->s_snapshot_stats);
+	sbi->s_snapshot_stats = NULL;
+}
+#endif
@@ -0,0 +1,167 @@
+/*
+ * linux/fs/ext4/snapshot_map.h
+ *
+ * Copyright (C) 2008-2010 CTERA Networks
+ *
+ * This file is part of the Linux kernel and is made available under
+ * the terms of the GNU General Public License, version 2, or at your
+ * option, any later version, incorporated herein by reference.
+ *
+ * Ext4 snapshot image block mapping and COW bitmap logic.  The COW bitmap
+ * test is built on the generic bitmap helpers in bitmap.c.
+ *
+ * Nothing in this file depends on inodes, buffers or locks, so it can also
+ * be built outside of the kernel (e.g., for profiling the hot path logic),
+ * given definitions of PAGE_SIZE, PAGE_SHIFT, EXT4_NDIR_BLOCKS, __u32,
+ * ext4_fsblk_t and the bitmap.c declarations.
+ */
+
+#ifndef _LINUX_EXT4_SNAPSHOT_MAP_H
+#define _LINUX_EXT4_SNAPSHOT_MAP_H
+
+/*
+ * use signed 64bit for snapshot image addresses
+ * negative addresses are used to reference snapshot meta blocks
+ */
+#define ext4_snapblk_t long long
+
+/*
+ * We assert that snapshot must use a file system with block size == page
+ * size (4K) and that the first file system block is block 0.
+ * Snapshot inode direct blocks are reserved for snapshot meta blocks.
+ * Snapshot inode single indirect blocks are not used.
+ * Snapshot image starts at the first double indirect block.
+ * This way, a snapshot image block group can be mapped with 1 double
+ * indirect block + 32 indirect blocks.
+ */
+#define SNAPSHOT_BLOCK_SIZE		PAGE_SIZE
+#define SNAPSHOT_BLOCK_SIZE_BITS	PAGE_SHIFT
+#define	SNAPSHOT_ADDR_PER_BLOCK		(SNAPSHOT_BLOCK_SIZE / sizeof(__u32))
+#define SNAPSHOT_ADDR_PER_BLOCK_BITS	(SNAPSHOT_BLOCK_SIZE_BITS - 2)
+#define SNAPSHOT_DIR_BLOCKS		EXT4_NDIR_BLOCKS
+#define SNAPSHOT_IND_BLOCKS		SNAPSHOT_ADDR_PER_BLOCK
+
+#define SNAPSHOT_BLOCKS_PER_GROUP_BITS	15
+#define SNAPSHOT_BLOCKS_PER_GROUP					\
+	(1<<SNAPSHOT_BLOCKS_PER_GROUP_BITS) /* 32K */
+#define SNAPSHOT_BLOCK_GROUP(block)		\
+	((block)>>SNAPSHOT_BLOCKS_PER_GROUP_BITS)
+#define SNAPSHOT_BLOCK_GROUP_OFFSET(block)	\
+	((block)&(SNAPSHOT_BLOCKS_PER_GROUP-1))
+#define SNAPSHOT_BLOCK_TUPLE(block)		\
+	(ext4_fsblk_t)SNAPSHOT_BLOCK_GROUP_OFFSET(block), \
+	(ext4_fsblk_t)SNAPSHOT_BLOCK_GROUP(block)
+#define SNAPSHOT_IND_PER_BLOCK_GROUP_BITS				\
+	(SNAPSHOT_BLOCKS_PER_GROUP_BITS-SNAPSHOT_ADDR_PER_BLOCK_BITS)
+#define SNAPSHOT_IND_PER_BLOCK_GROUP			\
+	(1<<SNAPSHOT_IND_PER_BLOCK_GROUP_BITS) /* 32 */
+#define SNAPSHOT_DIND_BLOCK_GROUPS_BITS					\
+	(SNAPSHOT_ADDR_PER_BLOCK_BITS-SNAPSHOT_IND_PER_BLOCK_GROUP_BITS)
+#define SNAPSHOT_DIND_BLOCK_GROUPS			\
+	(1<<SNAPSHOT_DIND_BLOCK_GROUPS_BITS) /* 32 */
+
+#define SNAPSHOT_BLOCK_OFFSET				\
+	(SNAPSHOT_DIR_BLOCKS+SNAPSHOT_IND_BLOCKS)
+/* SNAPSHOT_BLOCK_OFFSET is unsigned long - keep meta block addresses signed */
+#define SNAPSHOT_BLOCK(iblock)					\
+	((ext4_snapblk_t)(iblock) - (ext4_snapblk_t)SNAPSHOT_BLOCK_OFFSET)
+#define SNAPSHOT_IBLOCK(block)						\
+	(ext4_fsblk_t)((block) + SNAPSHOT_BLOCK_OFFSET)
+
+#define SNAPSHOT_BYTES_OFFSET					\
+	(SNAPSHOT_BLOCK_OFFSET << SNAPSHOT_BLOCK_SIZE_BITS)
+#define SNAPSHOT_ISIZE(size)			\
+	((size) + SNAPSHOT_BYTES_OFFSET)
+
+/*
+ * ext4_snapshot_mask_bitmap() - clear exclude bitmap bits from block bitmap
+ * @dst:	COW bitmap
+ * @src:	block bitmap
+ * @mask:	exclude bitmap
+ * All bitmaps are block buffers, so they are word aligned.  The loop has
+ * a constant trip count, so it is kept inline for the compiler to unroll.
+ */
+static inline void ext4_snapshot_mask_bitmap(void *dst,
+		const void *src, const void *mask)
+{
+	unsigned long *d = dst;
+	const unsigned long *s = src, *m = mask;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_BLOCK_SIZE / sizeof(long); i++)
+		d[i] = s[i] & ~m[i];
+}
+
+/*
+ * ext4_snapshot_count_inuse() - count blocks in use by snapshot
+ * @bitmap:	COW bitmap of a block group (ext4 little endian bit order)
+ * @bit:	first block group offset to test
+ * @maxblocks:	max. no. of blocks to test
+ *
+ * Returns the no. of subsequent set bits in @bitmap starting at @bit,
+ * up to @maxblocks or the end of the block group.
+ */
+static inline int ext4_snapshot_count_inuse(const void *bitmap, int bit,
+		int maxblocks)
+{
+	if (maxblocks > SNAPSHOT_BLOCKS_PER_GROUP - bit)
+		maxblocks = SNAPSHOT_BLOCKS_PER_GROUP - bit;
+	return ext4_count_set_run(bitmap, bit, bit + maxblocks);
+}
+
+/*
+ * Snapshot file access state, as sampled by ext4_snapshot_get_inode_access()
+ */
+#define SNAPSHOT_ACCESS_LIST		0x01	/* snapshot is on the list */
+#define SNAPSHOT_ACCESS_WRITE		0x02	/* map blocks for write */
+#define SNAPSHOT_ACCESS_HANDLE		0x04	/* test_and_cow() lookup */
+#define SNAPSHOT_ACCESS_ACTIVE		0x08	/* snapshot is active */
+#define SNAPSHOT_ACCESS_PREV_HEAD	0x10	/* prev on list is list head */
+#define SNAPSHOT_ACCESS_UNLISTED	0x20	/* not on snapshots list */
+
+enum ext4_snapshot_read {
+	SNAPSHOT_READ_DENY,		/* access denied (-EPERM) */
+	SNAPSHOT_READ_BROKEN,		/* snapshot list is broken (-EIO) */
+	SNAPSHOT_READ_NORMAL,		/* normal file access */
+	SNAPSHOT_READ_BDEV,		/* read through to block device */
+	SNAPSHOT_READ_PREV,		/* read through to prev snapshot */
+};
+
+/*
+ * ext4_snapshot_read_access() - snapshot file access decision
+ * @access:	SNAPSHOT_ACCESS_* state of the snapshot file
+ * @iblock:	snapshot file block being mapped
+ *
+ * Returns how blocks of a snapshot file should be mapped.  Reserved
+ * blocks and test_and_cow() lookups get normal access.  Other reads of
+ * a snapshot on the list read through holes to the block device (active
+ * snapshot) or to the previous (newer) snapshot on the list.
+ */
+static inline enum ext4_snapshot_read
+ext4_snapshot_read_access(unsigned int access, long long iblock)
+{
+	if (!(access & SNAPSHOT_ACCESS_LIST))
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
+		/* normal access to snapshot being taken, else denied */
+		return (access & SNAPSHOT_ACCESS_PREV_HEAD) ?
+			SNAPSHOT_READ_NORMAL : SNAPSHOT_READ_DENY;
+#else
+		return SNAPSHOT_READ_NORMAL;
+#endif
+	if (access & SNAPSHOT_ACCESS_WRITE)
+		/* snapshot is read-only */
+		return SNAPSHOT_READ_DENY;
+	if (iblock < SNAPSHOT_BLOCK_OFFSET || (access & SNAPSHOT_ACCESS_HANDLE))
+		return SNAPSHOT_READ_NORMAL;
+	if (access & SNAPSHOT_ACCESS_ACTIVE)
+		return SNAPSHOT_READ_BDEV;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
+	if (access & (SNAPSHOT_ACCESS_PREV_HEAD|SNAPSHOT_ACCESS_UNLISTED))
+		return SNAPSHOT_READ_BROKEN;
+	return SNAPSHOT_READ_PREV;
+#else
+	return SNAPSHOT_READ_NORMAL;
+#endif
+}
+
+#endif	/* _LINUX_EXT4_SNAPSHOT_MAP_H */
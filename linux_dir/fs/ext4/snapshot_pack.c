@@ -0,0 +1,742 @@
+/*
+ * linux/fs/ext4/snapshot_pack.c
+ *
+ * Copyright (C) 2008-2010 CTERA Networks
+ *
+ * This file is part of the Linux kernel and is made available under
+ * the terms of the GNU General Public License, version 2, or at your
+ * option, any later version, incorporated herein by reference.
+ *
+ * Ext4 snapshots packed (compressed) COWed blocks.
+ */
+
+#include <linux/crypto.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include "snapshot.h"
+#include "ext4.h"
+
+/*
+ * Most COWed blocks are metadata blocks (inode tables, directory and
+ * indirect blocks), which compress very well.  In a packed snapshot,
+ * COWed blocks are compressed and several pre-images are stored in a
+ * single snapshot 'pack' block.  The snapshot image block of a packed
+ * block is left unmapped.
+ *
+ * Pack blocks are allocated sequentially in the snapshot file, starting
+ * right after the end of the snapshot image, which is never accessed by
+ * COW (blocks added to the file system after snapshot take are not in
+ * the snapshot COW bitmap).  Each pack block is owned by the snapshot file
+ * like any other COWed block, so it is freed and shrunk with the snapshot.
+ *
+ * Pack block layout:
+ * [header][entry 0]...[entry N-1] ... free ... [data N-1]...[data 0]
+ * Entries grow from the start of the block, compressed data grows from
+ * the end of the block.  An entry with no data is either a zero block
+ * (a hole, which is not read through) or a duplicate of a block, whose
+ * data is stored by another entry (see pe_ref) of the same snapshot.
+ * Pack blocks of the first layout ("SPCK" magic, without pe_ref) are
+ * still read, but new entries are only added to "SPK2" pack blocks.
+ *
+ * The in-memory index, which maps a snapshot image block to its pack
+ * slot, is built on first access by scanning the snapshot pack blocks.
+ */
+#define EXT4_SNAPSHOT_PACK_MAGIC	0x324b5053 /* "SPK2" */
+#define EXT4_SNAPSHOT_PACK_SLOTS	64
+/* first pack layout: 8 byte entries without pe_ref, up to 16 per block */
+#define EXT4_SNAPSHOT_PACK_MAGIC_V1	0x4b435053 /* "SPCK" */
+#define EXT4_SNAPSHOT_PACK_SLOTS_V1	16
+/* don't pack blocks that compress to more than half a block */
+#define EXT4_SNAPSHOT_PACK_MAX_LEN	(SNAPSHOT_BLOCK_SIZE / 2)
+
+struct ext4_snapshot_pack_header {
+	__le32	ph_magic;
+	__le16	ph_count;	/* no. of used entries */
+	__le16	ph_used;	/* no. of compressed data bytes */
+};
+
+struct ext4_snapshot_pack_entry {
+	__le32	pe_block;	/* snapshot image block */
+	__le16	pe_offset;	/* compressed data offset in pack block */
+	__le16	pe_len;		/* compressed data length */
+	__le32	pe_ref;		/* data slot + 1 of duplicate or 0 */
+};
+
+struct ext4_snapshot_pack_entry_v1 {
+	__le32	pe_block;
+	__le16	pe_offset;
+	__le16	pe_len;
+};
+
+#define EXT4_SNAPSHOT_PACK_HEADER(bh)					\
+	((struct ext4_snapshot_pack_header *)(bh)->b_data)
+#define EXT4_SNAPSHOT_PACK_ENTRY(bh, i)					\
+	((struct ext4_snapshot_pack_entry *)((bh)->b_data +		\
+		sizeof(struct ext4_snapshot_pack_header)) + (i))
+
+/* in-memory index node: slot = pack block no. * PACK_SLOTS + entry no. */
+struct ext4_snapshot_pack_node {
+	struct rb_node	pn_node;
+	__u32		pn_block;	/* snapshot image block */
+	__u32		pn_slot;	/* slot of entry holding the data */
+};
+/* index slot of zero blocks */
+#define EXT4_SNAPSHOT_PACK_ZERO		(~0U)
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+/*
+ * Table of recently packed block hashes - a direct mapped cache of
+ * data slots, indexed by a hash of the uncompressed block.
+ * A hit is verified by comparing the compressed data.
+ *
+ * The table only covers the pack blocks of the active snapshot.  A
+ * reference into the pack blocks of another snapshot would dangle once
+ * that snapshot is deleted and shrunk, and there is no reference count
+ * for pack slots to prevent it.  Blocks that are not packed (copied to
+ * a snapshot block of their own) are not hashed either, because a pack
+ * entry can only reference data in a pack slot.
+ */
+#define EXT4_SNAPSHOT_DEDUP_BITS	10
+#define EXT4_SNAPSHOT_DEDUP_SIZE	(1 << EXT4_SNAPSHOT_DEDUP_BITS)
+
+struct ext4_snapshot_dedup {
+	__u32		dd_hash;
+	__u32		dd_slot;	/* data slot + 1 or 0 if unused */
+};
+#endif
+
+struct ext4_snapshot_pack {
+	struct mutex		sp_mutex;	/* protects all fields below */
+	int			sp_loaded;	/* index was loaded from disk */
+	struct rb_root		sp_index;	/* image block -> pack slot */
+	unsigned int		sp_nodes;	/* no. of index nodes */
+	ext4_fsblk_t		sp_base;	/* first pack logical block */
+	unsigned int		sp_count;	/* no. of pack blocks */
+	struct buffer_head	*sp_bh;		/* last pack block */
+	struct crypto_comp	*sp_tfm;
+	void			*sp_buf;	/* compression buffer */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+	struct ext4_snapshot_dedup *sp_dedup;
+#endif
+};
+
+/*
+ * pack blocks are mapped with a non NULL handle to get normal snapshot
+ * file access, so holes in the pack area are not read through
+ */
+static handle_t pack_handle;
+
+static void ext4_snapshot_pack_drop_index(struct ext4_snapshot_pack *sp)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(&sp->sp_index))) {
+		rb_erase(n, &sp->sp_index);
+		kfree(rb_entry(n, struct ext4_snapshot_pack_node, pn_node));
+	}
+	sp->sp_nodes = 0;
+}
+
+static void __ext4_snapshot_pack_free(struct ext4_snapshot_pack *sp)
+{
+	ext4_snapshot_pack_drop_index(sp);
+	if (sp->sp_tfm && !IS_ERR(sp->sp_tfm))
+		crypto_free_comp(sp->sp_tfm);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+	kfree(sp->sp_dedup);
+#endif
+	kfree(sp->sp_buf);
+	kfree(sp);
+}
+
+/*
+ * ext4_snapshot_pack_get() - get the pack state of a packed snapshot
+ * Returns NULL if @inode is not a packed snapshot.
+ */
+static struct ext4_snapshot_pack *ext4_snapshot_pack_get(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_snapshot_pack *sp = ei->i_snapshot_pack;
+
+	if (sp || !ext4_snapshot_packed(inode))
+		return sp;
+
+	sp = kzalloc(sizeof(*sp), GFP_NOFS);
+	if (!sp)
+		return ERR_PTR(-ENOMEM);
+	sp->sp_buf = kmalloc(SNAPSHOT_BLOCK_SIZE, GFP_NOFS);
+	sp->sp_tfm = crypto_alloc_comp("deflate", 0, 0);
+	if (!sp->sp_buf || IS_ERR(sp->sp_tfm)) {
+		int err = IS_ERR(sp->sp_tfm) ? PTR_ERR(sp->sp_tfm) : -ENOMEM;
+
+		__ext4_snapshot_pack_free(sp);
+		return ERR_PTR(err);
+	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+	/* dedup is only used by the active snapshot, so it may fail */
+	if (ext4_snapshot_is_active(inode))
+		sp->sp_dedup = kzalloc(EXT4_SNAPSHOT_DEDUP_SIZE *
+				sizeof(*sp->sp_dedup), GFP_NOFS);
+#endif
+	mutex_init(&sp->sp_mutex);
+	sp->sp_index = RB_ROOT;
+	sp->sp_base = SNAPSHOT_IBLOCK(SNAPSHOT_BLOCKS(inode));
+
+	if (cmpxchg(&ei->i_snapshot_pack, NULL, sp))
+		/* lost the race with another task */
+		__ext4_snapshot_pack_free(sp);
+	return ei->i_snapshot_pack;
+}
+
+/*
+ * ext4_snapshot_pack_insert() - add image @block in pack @slot to the index
+ * Called with sp_mutex held.
+ */
+static int ext4_snapshot_pack_insert(struct ext4_snapshot_pack *sp,
+		__u32 block, __u32 slot)
+{
+	struct rb_node **p = &sp->sp_index.rb_node, *parent = NULL;
+	struct ext4_snapshot_pack_node *pn;
+
+	while (*p) {
+		parent = *p;
+		pn = rb_entry(parent, struct ext4_snapshot_pack_node, pn_node);
+		if (block < pn->pn_block)
+			p = &parent->rb_left;
+		else if (block > pn->pn_block)
+			p = &parent->rb_right;
+		else
+			return -EEXIST;
+	}
+
+	pn = kmalloc(sizeof(*pn), GFP_NOFS);
+	if (!pn)
+		return -ENOMEM;
+	pn->pn_block = block;
+	pn->pn_slot = slot;
+	rb_link_node(&pn->pn_node, parent, p);
+	rb_insert_color(&pn->pn_node, &sp->sp_index);
+	sp->sp_nodes++;
+	return 0;
+}
+
+/*
+ * ext4_snapshot_pack_read() - read pack block @n of snapshot @inode
+ * Returns NULL if pack block is not allocated.
+ */
+static struct buffer_head *ext4_snapshot_pack_read(struct inode *inode,
+		struct ext4_snapshot_pack *sp, unsigned int n, int *err)
+{
+	struct ext4_snapshot_pack_header *ph;
+	struct buffer_head *bh;
+	unsigned int max = 0;
+
+	*err = 0;
+	bh = ext4_bread(&pack_handle, inode, sp->sp_base + n, 0, err);
+	if (!bh)
+		return NULL;
+	ph = EXT4_SNAPSHOT_PACK_HEADER(bh);
+	if (ph->ph_magic == cpu_to_le32(EXT4_SNAPSHOT_PACK_MAGIC))
+		max = EXT4_SNAPSHOT_PACK_SLOTS;
+	else if (ph->ph_magic == cpu_to_le32(EXT4_SNAPSHOT_PACK_MAGIC_V1))
+		max = EXT4_SNAPSHOT_PACK_SLOTS_V1;
+	if (!max || le16_to_cpu(ph->ph_count) > max) {
+		snapshot_debug(1, "snapshot (%u) pack block (%u) is corrupted\n",
+				inode->i_generation, n);
+		brelse(bh);
+		*err = -EIO;
+		return NULL;
+	}
+	return bh;
+}
+
+/*
+ * ext4_snapshot_pack_entry() - copy entry @i of pack block @bh to @pe
+ * Entries of first layout pack blocks are converted, they have no
+ * duplicates.
+ */
+static void ext4_snapshot_pack_entry(struct buffer_head *bh, int i,
+		struct ext4_snapshot_pack_entry *pe)
+{
+	struct ext4_snapshot_pack_entry_v1 *pe1;
+
+	if (EXT4_SNAPSHOT_PACK_HEADER(bh)->ph_magic ==
+			cpu_to_le32(EXT4_SNAPSHOT_PACK_MAGIC)) {
+		*pe = *EXT4_SNAPSHOT_PACK_ENTRY(bh, i);
+		return;
+	}
+	pe1 = (struct ext4_snapshot_pack_entry_v1 *)(bh->b_data +
+		sizeof(struct ext4_snapshot_pack_header)) + i;
+	pe->pe_block = pe1->pe_block;
+	pe->pe_offset = pe1->pe_offset;
+	pe->pe_len = pe1->pe_len;
+	pe->pe_ref = 0;
+}
+
+/*
+ * ext4_snapshot_pack_load() - build the in-memory index of snapshot @inode
+ * from its pack blocks.  Called with sp_mutex held.
+ */
+static int ext4_snapshot_pack_load(struct inode *inode,
+		struct ext4_snapshot_pack *sp)
+{
+	struct ext4_snapshot_pack_entry entry, *pe = &entry;
+	struct buffer_head *bh;
+	int i, count, err = 0;
+
+	if (sp->sp_loaded)
+		return 0;
+
+	while ((bh = ext4_snapshot_pack_read(inode, sp, sp->sp_count, &err))) {
+		count = le16_to_cpu(EXT4_SNAPSHOT_PACK_HEADER(bh)->ph_count);
+		for (i = 0; i < count && !err; i++) {
+			__u32 slot = sp->sp_count * EXT4_SNAPSHOT_PACK_SLOTS + i;
+
+			ext4_snapshot_pack_entry(bh, i, pe);
+			if (pe->pe_ref)
+				/* duplicate block */
+				slot = le32_to_cpu(pe->pe_ref) - 1;
+			else if (!pe->pe_len)
+				/* zero block */
+				slot = EXT4_SNAPSHOT_PACK_ZERO;
+			err = ext4_snapshot_pack_insert(sp,
+					le32_to_cpu(pe->pe_block), slot);
+		}
+		brelse(sp->sp_bh);
+		sp->sp_bh = bh;
+		sp->sp_count++;
+		if (err)
+			break;
+	}
+	if (err)
+		return err;
+
+	sp->sp_loaded = 1;
+	snapshot_debug(4, "snapshot (%u) pack index loaded (%u blocks)\n",
+			inode->i_generation, sp->sp_count);
+	return 0;
+}
+
+/*
+ * ext4_snapshot_pack_lookup() - find the pack slot of image @block.
+ * Called with sp_mutex held.
+ * Returns 1 and sets @slot if @block is packed, 0 if not and < 0 on error.
+ */
+static int ext4_snapshot_pack_lookup(struct inode *inode,
+		struct ext4_snapshot_pack *sp, ext4_fsblk_t block,
+		unsigned long *slot)
+{
+	struct rb_node *n;
+	struct ext4_snapshot_pack_node *pn;
+	int err;
+
+	err = ext4_snapshot_pack_load(inode, sp);
+	if (err)
+		return err;
+	n = sp->sp_index.rb_node;
+	while (n) {
+		pn = rb_entry(n, struct ext4_snapshot_pack_node, pn_node);
+		if (block < pn->pn_block)
+			n = n->rb_left;
+		else if (block > pn->pn_block)
+			n = n->rb_right;
+		else {
+			*slot = pn->pn_slot;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * ext4_snapshot_pack_test() - test if @block is packed in @snapshot
+ *
+ * Return values:
+ * = 1 - @block is packed
+ * = 0 - @block is not packed
+ * < 0 - error
+ */
+int ext4_snapshot_pack_test(struct inode *snapshot, ext4_fsblk_t block)
+{
+	struct ext4_snapshot_pack *sp = ext4_snapshot_pack_get(snapshot);
+	unsigned long slot;
+	int ret;
+
+	if (IS_ERR_OR_NULL(sp))
+		return PTR_ERR(sp);
+
+	mutex_lock(&sp->sp_mutex);
+	ret = ext4_snapshot_pack_lookup(snapshot, sp, block, &slot);
+	mutex_unlock(&sp->sp_mutex);
+	return ret;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+/* tests if all bytes of a snapshot block are zero */
+static int ext4_snapshot_zero_block(const char *data)
+{
+	const unsigned long *p = (const unsigned long *)data;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_BLOCK_SIZE / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * ext4_snapshot_pack_match() - test if the compressed data in @buf
+ * is identical to the data stored in pack @slot.
+ * Called with sp_mutex held.
+ */
+static int ext4_snapshot_pack_match(struct inode *inode,
+		struct ext4_snapshot_pack *sp, unsigned long slot,
+		const void *buf, unsigned int len)
+{
+	struct ext4_snapshot_pack_entry entry, *pe = &entry;
+	struct buffer_head *pbh;
+	int err, match;
+
+	pbh = ext4_snapshot_pack_read(inode, sp,
+			slot / EXT4_SNAPSHOT_PACK_SLOTS, &err);
+	if (!pbh)
+		return 0;
+	ext4_snapshot_pack_entry(pbh, slot % EXT4_SNAPSHOT_PACK_SLOTS, pe);
+	match = (!pe->pe_ref && le16_to_cpu(pe->pe_len) == len &&
+		 le16_to_cpu(pe->pe_offset) + len <= SNAPSHOT_BLOCK_SIZE &&
+		 !memcmp(pbh->b_data + le16_to_cpu(pe->pe_offset), buf, len));
+	brelse(pbh);
+	return match;
+}
+
+#endif
+/*
+ * ext4_snapshot_pack_cow() - pack a COWed block in the active snapshot
+ * @handle:	JBD handle (COWing)
+ * @snapshot:	active snapshot
+ * @bh:		uptodate buffer of the block to COW
+ *
+ * Called from ext4_snapshot_test_and_cow() instead of copying @bh to a
+ * new snapshot block.  Pack blocks are journaled as metadata, so the
+ * pre-image is committed in the same transaction as the overwrite.
+ * With dedup, zero blocks and blocks identical to a recently packed block
+ * are stored as pack entries with no data.
+ *
+ * Return values:
+ * = 1 - @bh was packed (or found packed)
+ * = 0 - @bh should be copied to a new snapshot block
+ * < 0 - error
+ */
+int ext4_snapshot_pack_cow(handle_t *handle, struct inode *snapshot,
+		struct buffer_head *bh)
+{
+	struct ext4_snapshot_pack *sp = ext4_snapshot_pack_get(snapshot);
+	struct ext4_snapshot_pack_header *ph;
+	struct ext4_snapshot_pack_entry *pe;
+	struct buffer_head *pbh;
+	unsigned int dlen = SNAPSHOT_BLOCK_SIZE;
+	unsigned int count, used, offset;
+	unsigned long slot;
+	__u32 data_slot = 0, ref = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+	struct ext4_snapshot_dedup *dd = NULL;
+	__u32 hash = 0;
+#endif
+	int err;
+
+	if (IS_ERR_OR_NULL(sp))
+		return PTR_ERR(sp);
+
+	mutex_lock(&sp->sp_mutex);
+	/* another COWing task may have packed this block */
+	err = ext4_snapshot_pack_lookup(snapshot, sp, bh->b_blocknr, &slot);
+	if (err)
+		goto out;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+	if (ext4_snapshot_zero_block(bh->b_data)) {
+		/* store zero block as a pack entry with no data */
+		data_slot = EXT4_SNAPSHOT_PACK_ZERO;
+		dlen = 0;
+		goto find_pack;
+	}
+#endif
+	if (crypto_comp_compress(sp->sp_tfm, bh->b_data, SNAPSHOT_BLOCK_SIZE,
+				 sp->sp_buf, &dlen) ||
+	    dlen > EXT4_SNAPSHOT_PACK_MAX_LEN)
+		/* not compressible - copy block to snapshot */
+		goto out;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+	if (sp->sp_dedup) {
+		hash = jhash2((const u32 *)bh->b_data,
+			      SNAPSHOT_BLOCK_SIZE / sizeof(u32), 0);
+		dd = &sp->sp_dedup[hash & (EXT4_SNAPSHOT_DEDUP_SIZE - 1)];
+		if (dd->dd_slot && dd->dd_hash == hash &&
+		    ext4_snapshot_pack_match(snapshot, sp, dd->dd_slot - 1,
+					     sp->sp_buf, dlen)) {
+			/* store a reference to the identical block data */
+			data_slot = dd->dd_slot - 1;
+			ref = dd->dd_slot;
+			dlen = 0;
+			dd = NULL;
+		}
+	}
+
+find_pack:
+#endif
+	pbh = sp->sp_bh;
+	if (pbh) {
+		ph = EXT4_SNAPSHOT_PACK_HEADER(pbh);
+		count = le16_to_cpu(ph->ph_count);
+		used = le16_to_cpu(ph->ph_used);
+		/* first layout pack blocks are never appended to */
+		if (ph->ph_magic != cpu_to_le32(EXT4_SNAPSHOT_PACK_MAGIC) ||
+		    count >= EXT4_SNAPSHOT_PACK_SLOTS ||
+		    (void *)EXT4_SNAPSHOT_PACK_ENTRY(pbh, count + 1) >
+		    (void *)(pbh->b_data + SNAPSHOT_BLOCK_SIZE - used - dlen))
+			/* last pack block is full */
+			pbh = NULL;
+	}
+
+	if (!pbh) {
+		/* allocate a new pack block */
+		pbh = ext4_getblk(handle, snapshot, sp->sp_base + sp->sp_count,
+				   SNAPMAP_COW, &err);
+		if (!pbh) {
+			err = err ? : -EIO;
+			goto out;
+		}
+		brelse(sp->sp_bh);
+		sp->sp_bh = pbh;
+		sp->sp_count++;
+		count = used = 0;
+	}
+
+	err = ext4_journal_get_write_access(handle, pbh);
+	if (err)
+		goto out;
+	slot = (sp->sp_count - 1) * EXT4_SNAPSHOT_PACK_SLOTS + count;
+	ph = EXT4_SNAPSHOT_PACK_HEADER(pbh);
+	pe = EXT4_SNAPSHOT_PACK_ENTRY(pbh, count);
+	offset = 0;
+	if (dlen) {
+		/* store compressed data */
+		offset = SNAPSHOT_BLOCK_SIZE - used - dlen;
+		memcpy(pbh->b_data + offset, sp->sp_buf, dlen);
+		data_slot = slot;
+	}
+	pe->pe_block = cpu_to_le32(bh->b_blocknr);
+	pe->pe_offset = cpu_to_le16(offset);
+	pe->pe_len = cpu_to_le16(dlen);
+	pe->pe_ref = cpu_to_le32(ref);
+	ph->ph_magic = cpu_to_le32(EXT4_SNAPSHOT_PACK_MAGIC);
+	ph->ph_count = cpu_to_le16(count + 1);
+	ph->ph_used = cpu_to_le16(used + dlen);
+	err = ext4_handle_dirty_metadata(handle, snapshot, pbh);
+	if (err)
+		goto out;
+
+	err = ext4_snapshot_pack_insert(sp, bh->b_blocknr, data_slot);
+	if (err)
+		goto out;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+	if (dd) {
+		/* remember the newest block data with this hash */
+		dd->dd_hash = hash;
+		dd->dd_slot = data_slot + 1;
+	}
+#endif
+
+	snapshot_debug(3, "block [%lld/%lld] of snapshot (%u) "
+			"packed in slot (%lu) of pack block (%u), len=%u, "
+			"ref=%u\n", SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr),
+			snapshot->i_generation, slot % EXT4_SNAPSHOT_PACK_SLOTS,
+			sp->sp_count - 1, dlen, ref);
+	err = 1;
+out:
+	mutex_unlock(&sp->sp_mutex);
+	return err;
+}
+
+/*
+ * ext4_snapshot_pack_unpack() - decompress a packed block into @page
+ * Returns 1 if @block is packed in @snapshot, 0 if not and < 0 on error.
+ */
+static int ext4_snapshot_pack_unpack(struct inode *snapshot,
+		ext4_fsblk_t block, struct page *page)
+{
+	struct ext4_snapshot_pack *sp = ext4_snapshot_pack_get(snapshot);
+	struct ext4_snapshot_pack_entry entry, *pe = &entry;
+	struct buffer_head *pbh = NULL;
+	unsigned int dlen = SNAPSHOT_BLOCK_SIZE;
+	unsigned long slot;
+	char *kaddr;
+	int err;
+
+	if (IS_ERR_OR_NULL(sp))
+		return PTR_ERR(sp);
+
+	mutex_lock(&sp->sp_mutex);
+	err = ext4_snapshot_pack_lookup(snapshot, sp, block, &slot);
+	if (err <= 0)
+		goto out;
+
+	if (slot == EXT4_SNAPSHOT_PACK_ZERO) {
+		zero_user(page, 0, PAGE_CACHE_SIZE);
+		goto out;
+	}
+
+	pbh = ext4_snapshot_pack_read(snapshot, sp,
+			slot / EXT4_SNAPSHOT_PACK_SLOTS, &err);
+	if (!pbh) {
+		err = err ? : -EIO;
+		goto out;
+	}
+	err = -EIO;
+	ext4_snapshot_pack_entry(pbh, slot % EXT4_SNAPSHOT_PACK_SLOTS, pe);
+	/* duplicate blocks reference the data of another block */
+	if (pe->pe_ref || !pe->pe_len ||
+	    le16_to_cpu(pe->pe_offset) + le16_to_cpu(pe->pe_len) >
+	    SNAPSHOT_BLOCK_SIZE)
+		goto out;
+
+	kaddr = kmap(page);
+	if (!crypto_comp_decompress(sp->sp_tfm,
+				pbh->b_data + le16_to_cpu(pe->pe_offset),
+				le16_to_cpu(pe->pe_len), kaddr, &dlen) &&
+	    dlen == SNAPSHOT_BLOCK_SIZE)
+		err = 1;
+	flush_dcache_page(page);
+	kunmap(page);
+out:
+	mutex_unlock(&sp->sp_mutex);
+	brelse(pbh);
+	if (err < 0)
+		snapshot_debug(1, "failed to unpack block [%lld/%lld] of "
+				"snapshot (%u) (err=%d)\n",
+				SNAPSHOT_BLOCK_TUPLE(block),
+				snapshot->i_generation, err);
+	return err;
+}
+
+/*
+ * ext4_snapshot_pack_readpage() - read a packed block of snapshot image
+ * @inode:	snapshot file
+ * @page:	locked page of snapshot image block
+ *
+ * A snapshot image block is packed in @inode or, if it is not mapped in
+ * @inode, it may be packed in a newer snapshot on the list (read through).
+ * Walks the list the same way ext4_snapshot_get_inode_access() does.
+ *
+ * Return values:
+ * = 1 - @page was filled with the unpacked block
+ * = 0 - block is not packed - read @page normally
+ * < 0 - error
+ */
+int ext4_snapshot_pack_readpage(struct inode *inode, struct page *page)
+{
+	struct list_head *list = &EXT4_SB(inode->i_sb)->s_snapshot_list;
+	struct list_head *prev;
+	struct inode *snapshot = inode;
+	ext4_fsblk_t block;
+	int err;
+
+	if (page->index < SNAPSHOT_BLOCK_OFFSET)
+		/* snapshot reserved blocks */
+		return 0;
+	block = SNAPSHOT_BLOCK(page->index);
+	if (block >= SNAPSHOT_BLOCKS(inode))
+		/* beyond snapshot image */
+		return 0;
+
+	for (;;) {
+		err = ext4_snapshot_pack_unpack(snapshot, block, page);
+		if (err)
+			return err;
+		err = ext4_snapshot_map_blocks(&pack_handle, snapshot, block,
+				1, NULL, SNAPMAP_READ);
+		if (err)
+			/* block is mapped in snapshot - not packed */
+			return err < 0 ? err : 0;
+		if (ext4_snapshot_is_active(snapshot) ||
+		    (EXT4_I(snapshot)->i_flags & EXT4_SNAPFILE_ACTIVE_FL))
+			/* read through to block device */
+			return 0;
+		/* read through to prev (newer) snapshot on the list */
+		prev = EXT4_I(snapshot)->i_snaplist.prev;
+		if (list_empty(prev) || prev == list)
+			return 0;
+		snapshot = &list_entry(prev, struct ext4_inode_info,
+				       i_snaplist)->vfs_inode;
+		if (!ext4_snapshot_file(snapshot))
+			return -EIO;
+	}
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+/*
+ * ext4_snapshot_pack_usage() - memory used by pack state of snapshot @inode
+ * Returns the no. of bytes used by the pack index and dedup table.
+ */
+unsigned long ext4_snapshot_pack_usage(struct inode *inode)
+{
+	struct ext4_snapshot_pack *sp = EXT4_I(inode)->i_snapshot_pack;
+	unsigned long bytes;
+
+	if (!sp)
+		return 0;
+
+	bytes = sizeof(*sp) + SNAPSHOT_BLOCK_SIZE +
+		sp->sp_nodes * sizeof(struct ext4_snapshot_pack_node);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_DEDUP
+	if (sp->sp_dedup)
+		bytes += EXT4_SNAPSHOT_DEDUP_SIZE * sizeof(*sp->sp_dedup);
+#endif
+	return bytes;
+}
+
+/*
+ * ext4_snapshot_pack_shrink() - drop the pack index of snapshot @inode
+ * The index is reloaded from the pack blocks on next access.
+ * The active snapshot index is never dropped, because COW adds entries
+ * to the index without reloading it.
+ * Returns the no. of bytes freed.
+ */
+unsigned long ext4_snapshot_pack_shrink(struct inode *inode)
+{
+	struct ext4_snapshot_pack *sp = EXT4_I(inode)->i_snapshot_pack;
+	unsigned long bytes;
+
+	if (!sp || ext4_snapshot_is_active(inode) ||
+	    !mutex_trylock(&sp->sp_mutex))
+		return 0;
+
+	bytes = sp->sp_nodes * sizeof(struct ext4_snapshot_pack_node);
+	ext4_snapshot_pack_drop_index(sp);
+	brelse(sp->sp_bh);
+	sp->sp_bh = NULL;
+	sp->sp_count = 0;
+	sp->sp_loaded = 0;
+	mutex_unlock(&sp->sp_mutex);
+	return bytes;
+}
+
+#endif
+/*
+ * ext4_snapshot_pack_free() - free the pack state of snapshot @inode
+ * Called on inode destroy.
+ */
+void ext4_snapshot_pack_free(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_snapshot_pack *sp = ei->i_snapshot_pack;
+
+	if (!sp)
+		return;
+
+	ei->i_snapshot_pack = NULL;
+	brelse(sp->sp_bh);
+	__ext4_snapshot_pack_free(sp);
+}
@@ -285,8 +285,14 @@ handle_t *ext4_journal_start_sb(struct super_block *sb, int nblocks)
 	if (sizeof(ext4_handle_t) != sizeof(handle_t))
 		return ERR_PTR(-EINVAL);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_ADAPTIVE
+	handle = (ext4_handle_t *)jbd2_journal_start(journal,
+			ext4_snapshot_trans_credits(sb, nblocks) +
+			EXT4_SNAPSHOT_CREDITS);
+#else
 	handle = (ext4_handle_t *)jbd2_journal_start(journal,
 			       EXT4_SNAPSHOT_START_TRANS_BLOCKS(nblocks));
+#endif
 	if (!IS_ERR(handle)) {
 		if (handle->h_ref == 1) {
 			handle->h_base_credits = nblocks;
@@ -849,6 +855,12 @@ static void ext4_put_super(struct super_block *sb)
 	lock_super(sb);
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	ext4_snapshot_stats_exit(sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+	ext4_snapshot_cache_exit(sb);
+#endif
 	ext4_snapshot_destroy(sb);
 #endif
 
@@ -863,6 +875,8 @@ static void ext4_put_super(struct super_block *sb)
 	}
 
 	del_timer(&sbi->s_err_report);
+	ext4_es_unregister_shrinker(sb);
+	ext4_dc_unregister_shrinker(sb);
 	ext4_release_system_zone(sb);
 	ext4_mb_release(sb);
 	ext4_ext_release(sb);
@@ -895,6 +909,8 @@ static void ext4_put_super(struct super_block *sb)
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
 	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+	percpu_counter_destroy(&sbi->s_extent_cache_cnt);
+	percpu_counter_destroy(&sbi->s_dir_cache_bytes);
 	brelse(sbi->s_sbh);
 #ifdef CONFIG_QUOTA
 	for (i = 0; i < MAXQUOTAS; i++)
@@ -947,7 +963,14 @@ static struct inode *ext4_alloc_inode(struct super_block *sb)
 
 	ei->vfs_inode.i_version = 1;
 	ei->vfs_inode.i_data.writeback_index = 0;
-	memset(&ei->i_cached_extent, 0, sizeof(struct ext4_ext_cache));
+	rwlock_init(&ei->i_es_lock);
+	ext4_es_init_tree(&ei->i_es_tree);
+	INIT_LIST_HEAD(&ei->i_es_lru);
+	ei->i_es_nr = 0;
+	ei->i_ext_ra_next = 0;
+	spin_lock_init(&ei->i_dc_lock);
+	ei->i_dir_cache = NULL;
+	INIT_LIST_HEAD(&ei->i_dc_lru);
 	INIT_LIST_HEAD(&ei->i_prealloc_list);
 	spin_lock_init(&ei->i_prealloc_lock);
 	/*
@@ -966,11 +989,15 @@ static struct inode *ext4_alloc_inode(struct super_block *sb)
 	ei->i_reserved_quota = 0;
 #endif
 	INIT_LIST_HEAD(&ei->i_completed_io_list);
+	INIT_WORK(&ei->i_unwritten_work, ext4_end_io_work);
 	spin_lock_init(&ei->i_completed_io_lock);
 	ei->cur_aio_dio = NULL;
 	ei->i_sync_tid = 0;
 	ei->i_datasync_tid = 0;
 	atomic_set(&ei->i_ioend_count, 0);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	ei->i_snapshot_pack = NULL;
+#endif
 
 	return &ei->vfs_inode;
 }
@@ -986,6 +1013,11 @@ static int ext4_drop_inode(struct inode *inode)
 static void ext4_destroy_inode(struct inode *inode)
 {
 	ext4_ioend_wait(inode);
+	/* the conversion work may still run (or be queued) after that */
+	cancel_work_sync(&EXT4_I(inode)->i_unwritten_work);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	ext4_snapshot_pack_free(inode);
+#endif
 	if (!list_empty(&(EXT4_I(inode)->i_orphan))) {
 		ext4_msg(inode->i_sb, KERN_ERR,
 			 "Inode %lu (%p): orphan list check failed!",
@@ -1033,6 +1065,9 @@ void ext4_clear_inode(struct inode *inode)
 	end_writeback(inode);
 	dquot_drop(inode);
 	ext4_discard_preallocations(inode);
+	ext4_es_evict_inode(inode);
+	if (S_ISDIR(inode->i_mode))
+		ext4_dc_drop(inode);
 	if (EXT4_JOURNAL(inode))
 		jbd2_journal_release_jbd_inode(EXT4_SB(inode->i_sb)->s_journal,
 				       &EXT4_I(inode)->jinode);
@@ -2641,8 +2676,19 @@ EXT4_RW_ATTR_SBI_UI(mb_min_to_scan, s_mb_min_to_scan);
 EXT4_RW_ATTR_SBI_UI(mb_order2_req, s_mb_order2_reqs);
 EXT4_RW_ATTR_SBI_UI(mb_stream_req, s_mb_stream_request);
 EXT4_RW_ATTR_SBI_UI(mb_group_prealloc, s_mb_group_prealloc);
+EXT4_RW_ATTR_SBI_UI(mb_optimize_scan, s_mb_optimize_scan);
+EXT4_RW_ATTR_SBI_UI(mb_prefetch, s_mb_prefetch);
+EXT4_RW_ATTR_SBI_UI(trim_max_mbps, s_trim_max_mbps);
 EXT4_RW_ATTR_SBI_UI(max_writeback_mb_bump, s_max_writeback_mb_bump);
+EXT4_RW_ATTR_SBI_UI(extent_max_zeroout_kb, s_extent_max_zeroout_kb);
+EXT4_RW_ATTR_SBI_UI(dir_cache_kb, s_dir_cache_kb);
 EXT4_RW_ATTR_SBI_BOOL(squelch_errors, s_mount_flags, EXT4_MF_FS_SQUELCH);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+EXT4_RW_ATTR_SBI_UI(snapshot_pack, s_snapshot_pack);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+EXT4_RW_ATTR_SBI_UI(snapshot_cache_kb, s_snapshot_cache_kb);
+#endif
 
 static struct attribute *ext4_attrs[] = {
 	ATTR_LIST(delayed_allocation_blocks),
@@ -2656,8 +2702,19 @@ static struct attribute *ext4_attrs[] = {
 	ATTR_LIST(mb_order2_req),
 	ATTR_LIST(mb_stream_req),
 	ATTR_LIST(mb_group_prealloc),
+	ATTR_LIST(mb_optimize_scan),
+	ATTR_LIST(mb_prefetch),
+	ATTR_LIST(trim_max_mbps),
 	ATTR_LIST(max_writeback_mb_bump),
+	ATTR_LIST(extent_max_zeroout_kb),
+	ATTR_LIST(dir_cache_kb),
 	ATTR_LIST(squelch_errors),
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COMPRESS
+	ATTR_LIST(snapshot_pack),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+	ATTR_LIST(snapshot_cache_kb),
+#endif
 	NULL,
 };
 
@@ -2817,6 +2874,35 @@ static void ext4_lazyinode_timeout(unsigned long data)
 	wake_up_process(p);
 }
 
+/*
+ * Read ahead the block bitmaps of the next batch of groups and build
+ * their buddy cache. Once all groups are done, go on to inode table
+ * zeroing if it was asked for, otherwise the request is finished.
+ */
+static int ext4_run_li_prefetch(struct ext4_li_request *elr)
+{
+	struct super_block *sb = elr->lr_super;
+	unsigned int nr = elr->lr_sbi->s_mb_prefetch;
+	ext4_group_t group = elr->lr_next_group;
+	ext4_group_t next;
+
+	if (nr && group < elr->lr_sbi->s_groups_count) {
+		next = ext4_mb_prefetch(sb, group, nr);
+		ext4_mb_prefetch_fini(sb, group, next - group);
+		elr->lr_next_group = next;
+		elr->lr_next_sched = jiffies;
+		return 0;
+	}
+
+	if (elr->lr_first_not_zeroed == elr->lr_sbi->s_groups_count ||
+	    !test_opt(sb, INIT_INODE_TABLE))
+		return 1;
+	elr->lr_mode = EXT4_LI_MODE_ITABLE;
+	elr->lr_next_group = elr->lr_first_not_zeroed;
+	elr->lr_next_sched = jiffies;
+	return 0;
+}
+
 /* Find next suitable group and run ext4_init_inode_table */
 static int ext4_run_li_request(struct ext4_li_request *elr)
 {
@@ -2826,6 +2912,9 @@ static int ext4_run_li_request(struct ext4_li_request *elr)
 	unsigned long timeout = 0;
 	int ret = 0;
 
+	if (elr->lr_mode == EXT4_LI_MODE_PREFETCH_BBITMAP)
+		return ext4_run_li_prefetch(elr);
+
 	sb = elr->lr_super;
 	ngroups = EXT4_SB(sb)->s_groups_count;
 
@@ -3075,7 +3164,7 @@ static int ext4_li_info_new(void)
 }
 
 static struct ext4_li_request *ext4_li_request_new(struct super_block *sb,
-					    ext4_group_t start)
+					    ext4_group_t start, int prefetch)
 {
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
 	struct ext4_li_request *elr;
@@ -3087,6 +3176,19 @@ static struct ext4_li_request *ext4_li_request_new(struct super_block *sb,
 
 	elr->lr_super = sb;
 	elr->lr_sbi = sbi;
+	elr->lr_first_not_zeroed = start;
+
+	/*
+	 * The bitmap prefetch starts right away, the first allocations
+	 * after mount are waiting for it.
+	 */
+	if (prefetch) {
+		elr->lr_mode = EXT4_LI_MODE_PREFETCH_BBITMAP;
+		elr->lr_next_group = 0;
+		elr->lr_next_sched = jiffies;
+		return elr;
+	}
+	elr->lr_mode = EXT4_LI_MODE_ITABLE;
 	elr->lr_next_group = start;
 
 	/*
@@ -3107,24 +3209,21 @@ static int ext4_register_li_request(struct super_block *sb,
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
 	struct ext4_li_request *elr;
 	ext4_group_t ngroups = EXT4_SB(sb)->s_groups_count;
-	int ret;
+	int prefetch, ret;
 
 	if (sbi->s_li_request != NULL)
 		return 0;
 
-	if (first_not_zeroed == ngroups ||
-	    (sb->s_flags & MS_RDONLY) ||
-	    !test_opt(sb, INIT_INODE_TABLE)) {
-		sbi->s_li_request = NULL;
-		return 0;
-	}
-
-	if (first_not_zeroed == ngroups) {
+	prefetch = sbi->s_mb_prefetch != 0;
+	if (!test_opt(sb, INIT_INODE_TABLE))
+		first_not_zeroed = ngroups;
+	if ((!prefetch && first_not_zeroed == ngroups) ||
+	    (sb->s_flags & MS_RDONLY)) {
 		sbi->s_li_request = NULL;
 		return 0;
 	}
 
-	elr = ext4_li_request_new(sb, first_not_zeroed);
+	elr = ext4_li_request_new(sb, first_not_zeroed, prefetch);
 	if (!elr)
 		return -ENOMEM;
 
@@ -3233,6 +3332,7 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 		goto out_free_orig;
 	}
 	sb->s_fs_info = sbi;
+	sbi->s_sb = sb;
 	sbi->s_mount_opt = 0;
 	sbi->s_resuid = EXT4_DEF_RESUID;
 	sbi->s_resgid = EXT4_DEF_RESGID;
@@ -3606,6 +3706,10 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->s_gdb_count = db_count;
 	get_random_bytes(&sbi->s_next_generation, sizeof(u32));
 	spin_lock_init(&sbi->s_next_gen_lock);
+	INIT_LIST_HEAD(&sbi->s_es_lru);
+	spin_lock_init(&sbi->s_es_lru_lock);
+	INIT_LIST_HEAD(&sbi->s_dc_lru);
+	spin_lock_init(&sbi->s_dc_lru_lock);
 
 	err = percpu_counter_init(&sbi->s_freeblocks_counter,
 			ext4_count_free_blocks(sb));
@@ -3620,6 +3724,12 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 	if (!err) {
 		err = percpu_counter_init(&sbi->s_dirtyblocks_counter, 0);
 	}
+	if (!err) {
+		err = percpu_counter_init(&sbi->s_extent_cache_cnt, 0);
+	}
+	if (!err) {
+		err = percpu_counter_init(&sbi->s_dir_cache_bytes, 0);
+	}
 	if (err) {
 		ext4_msg(sb, KERN_ERR, "insufficient memory");
 		goto failed_mount3;
@@ -3627,6 +3737,8 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 
 	sbi->s_stripe = ext4_get_stripe_size(sbi);
 	sbi->s_max_writeback_mb_bump = 128;
+	sbi->s_extent_max_zeroout_kb = 64;
+	sbi->s_dir_cache_kb = 4096;
 
 	/*
 	 * set up enough so that it can read an inode
@@ -3871,6 +3983,14 @@ no_journal:
 		ext4_ext_release(sb);
 		goto failed_mount4;
 	};
+	ext4_es_register_shrinker(sb);
+	ext4_dc_register_shrinker(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CACHE
+	ext4_snapshot_cache_init(sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	ext4_snapshot_stats_init(sb);
+#endif
 
 	EXT4_SB(sb)->s_mount_state |= EXT4_ORPHAN_FS;
 	ext4_orphan_cleanup(sb, es);
@@ -3927,6 +4047,8 @@ failed_mount3:
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
 	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+	percpu_counter_destroy(&sbi->s_extent_cache_cnt);
+	percpu_counter_destroy(&sbi->s_dir_cache_bytes);
 failed_mount2:
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 	if (sbi->s_group_info) {
@@ -5155,6 +5277,9 @@ static int __init ext4_init_fs(void)
 	err = ext4_init_xattr();
 	if (err)
 		goto out2;
+	err = ext4_init_es();
+	if (err)
+		goto out_es;
 	err = init_inodecache();
 	if (err)
 		goto out1;
@@ -5180,6 +5305,8 @@ out:
 	unregister_as_ext3();
 	destroy_inodecache();
 out1:
+	ext4_exit_es();
+out_es:
 	ext4_exit_xattr();
 out2:
 	ext4_exit_mballoc();
@@ -5204,6 +5331,7 @@ static void __exit ext4_exit_fs(void)
 	unregister_as_ext3();
 	unregister_filesystem(&ext4_fs_type);
 	destroy_inodecache();
+	ext4_exit_es();
 	ext4_exit_xattr();
 	ext4_exit_mballoc();
 	remove_proc_entry("fs/ext4", NULL);